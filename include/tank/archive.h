@@ -21,6 +21,7 @@
 #include "drawing.h"
 #include "game.h"
 #include "config.h"
+#include "utils/random.h"
 
 namespace czh::ar
 {
@@ -45,6 +46,8 @@ namespace czh::ar
     size_t route_pos{0};
     int gap_count{0};
     bool has_good_target{false};
+    utils::Xoshiro256 rng;
+    size_t lod_tick{0};
   };
 
   struct BulletArchive
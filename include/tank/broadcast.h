@@ -25,36 +25,55 @@
 
 namespace czh::bc
 {
-  extern std::mutex send_msg_mtx;
-  constexpr size_t to_everyone = (std::numeric_limits<size_t>::max)();
+  // The current world's. (see g::World)
+  std::mutex& send_msg_mtx();
+
+  constexpr size_t to_everyone = msg::to_everyone;
   constexpr size_t from_system = (std::numeric_limits<size_t>::max)();
 
+  // The following require send_msg_mtx().
+
+  // Appends m to the world's log, dropping the old messages beyond cfg::Config's retention.
+  void post_message(size_t to, msg::Message m);
+
+  // Appended once to the world's log, whatever the number of receivers.
   template<typename... Args>
   int send_message(size_t from, size_t to, int priority, const std::string& c)
   {
-    std::lock_guard sl(send_msg_mtx);
-    msg::Message msg{
-      .from = from, .content = c,
-      .priority = priority, .read = false,
-      .time = std::chrono::duration_cast<std::chrono::seconds>
-      (std::chrono::system_clock::now().time_since_epoch()).count()
-    };
-    if (to == to_everyone)
-    {
-      for (auto& r : g::state.users | std::views::values)
-        r.messages.emplace_back(msg);
-    }
-    else
-    {
-      auto t = g::state.users.find(to);
-      if (t == g::state.users.end()) return -1;
-      t->second.messages.emplace_back(msg);
-    }
+    std::lock_guard sl(send_msg_mtx());
+    if (to != to_everyone && !g::state().users.contains(to))
+      return -1;
+    post_message(to, msg::Message{
+                   .from = from, .content = c, .priority = priority,
+                   .time = std::chrono::duration_cast<std::chrono::seconds>
+                   (std::chrono::system_clock::now().time_since_epoch()).count()
+                 });
     return 0;
   }
 
+  // Received from the server, already addressed to the local user.
+  void receive_message(size_t id, msg::Message m);
+
+  // The unread message with the highest priority, the newest of them on a tie. It is then read.
   std::optional<msg::Message> read_message(size_t id);
 
+  // All the unread messages from old to new. They are then read.
+  std::vector<std::shared_ptr<const msg::Message> > take_unread(size_t id);
+
+  // The messages of id from old to new, starting from the seq 'from'.
+  std::vector<std::shared_ptr<const msg::Message> > get_messages(size_t id, uint64_t from = 0);
+
+  [[nodiscard]] bool has_messages(size_t id);
+
+  void mark_all_read(size_t id);
+
+  // Clears the messages of id, or only the read ones.
+  void clear_messages(size_t id, bool only_read);
+
+  // Applies the retention to the log and forgets the dropped messages in every inbox,
+  // including those of the users who never read them.
+  void compact_messages();
+
 
   enum class Severity : int
   {
@@ -16,16 +16,32 @@
 #pragma once
 
 #include <chrono>
+#include <cstddef>
 
 namespace czh::cfg
 {
   struct Config
   {
     std::chrono::milliseconds tick;
+    int max_catch_up; // simulation steps a late tick may run to catch up
+    int max_fps; // frame rate of the render thread
     std::chrono::milliseconds msg_ttl;
     bool unsafe_mode;
     long long_pressing_threshold;
+    // AutoTank's level of detail, by the distance (cells) to the nearest user's visible zone
+    int lod_near; // Within it, full simulation
+    int lod_far; // Within it, cheap movement every lod_interval ticks. Beyond it, frozen
+    int lod_interval;
+    // Retention of the messages, read or not. (see msg::MessageLog)
+    size_t msg_max_count;
+    size_t msg_max_bytes;
+    std::chrono::milliseconds msg_max_age; // Never shorter than msg_ttl
+    // A user with more pending map changes gets a full redraw instead. (see g::UserData::full_resync)
+    size_t max_map_changes;
   };
-  extern Config config;
+  extern const Config default_config;
+
+  // The current world's. (see g::World)
+  Config& config();
 }
 #endif
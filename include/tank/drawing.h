@@ -43,6 +43,8 @@ namespace czh::draw
     std::string text;
 
     [[nodiscard]] bool is_empty() const;
+
+    bool operator==(const PointView&) const = default;
   };
 
   bool operator<(const PointView& c1, const PointView& c2);
@@ -73,6 +75,8 @@ namespace czh::draw
     int gap{0};
     std::size_t target_id{0};
     bool has_good_target{false};
+
+    bool operator==(const TankView&) const = default;
   };
 
   struct UserView
@@ -80,6 +84,8 @@ namespace czh::draw
     size_t user_id{0};
     std::string ip;
     bool active{false};
+
+    bool operator==(const UserView&) const = default;
   };
 
   struct Snapshot
@@ -88,6 +94,8 @@ namespace czh::draw
     std::map<size_t, TankView> tanks;
     std::set<map::Pos> changes;
     std::map<size_t, UserView> userinfo;
+    map::Zone zone; // The zone that `map` was extracted from.
+    bool full_resync{false}; // `changes` is incomplete, redraw everything.
   };
 
   struct DrawingState
@@ -124,14 +132,23 @@ namespace czh::draw
 
   MapView extract_map(const map::Zone& zone);
 
+  TankView extract_tank(const tank::Tank* t);
+
   std::map<size_t, TankView> extract_tanks();
 
   std::map<size_t, UserView> extract_userinfo();
 
   map::Zone get_visible_zone(size_t w, size_t h, size_t id);
 
+  // Runs on the simulation thread. Extracts (or fetches from the server) a snapshot and publishes it.
   int update_snapshot();
 
+  // Hands a snapshot to the render thread. An unconsumed snapshot is replaced, keeping its changes.
+  void publish_snapshot(Snapshot snapshot);
+
+  // The zone the render thread wants the next snapshot to cover.
+  map::Zone get_snapshot_zone();
+
   void draw();
 } // namespace czh::draw
 #endif // TANK_DRAWING_H
@@ -0,0 +1,108 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef TANK_ENV_H
+#define TANK_ENV_H
+#pragma once
+
+#include "game_map.h"
+#include "tank.h"
+#include "world.h"
+#include "utils/random.h"
+#include "utils/thpool.h"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+// Vectorized environment for training bots, linked from the tank_core library.
+// It steps N independent worlds in lockstep. Each world has one agent, a NormalTank
+// driven by the caller, and some AutoTanks. Nothing is drawn and no terminal is needed.
+namespace czh::env
+{
+  // The cells of an observation
+  enum class Cell : uint8_t
+  {
+    EMPTY, WALL, SELF, TANK, BULLET
+  };
+
+  struct Options
+  {
+    size_t num_envs{1};
+    int view_radius{7}; // An observation is a (2r + 1) x (2r + 1) grid centered on the agent
+    size_t auto_tanks{8};
+    size_t auto_tank_lvl{5};
+    map::Zone zone{-16, 16, -16, 16}; // Where the agent and the AutoTanks spawn
+    size_t max_steps{1000}; // An episode is truncated after it
+  };
+
+  // nullopt does nothing for a step.
+  using Action = std::optional<tank::NormalTankEvent>;
+
+  struct StepResult
+  {
+    // num_envs grids of obs_size() cells each, row by row from the top-left corner.
+    std::vector<Cell> observations;
+    // +1 for each AutoTank destroyed, minus the share of the agent's HP lost, -1 when the agent dies.
+    std::vector<float> rewards;
+    // An env that is done has already been reset, its observation is the first of the next episode.
+    std::vector<uint8_t> dones;
+  };
+
+  class VecEnv
+  {
+  private:
+    struct Env
+    {
+      std::unique_ptr<g::World> world;
+      utils::Xoshiro256 seeds; // Seeds of the following episodes
+      size_t agent{0};
+      size_t steps{0};
+      int hp{0};
+      size_t auto_tanks{0}; // alive
+    };
+
+    Options options;
+    std::vector<Env> envs;
+    StepResult result;
+    utils::Thpool pool;
+
+  public:
+    explicit VecEnv(const Options& options_);
+
+    // Starts a new episode in every env. The same seed gives the same episodes.
+    const std::vector<Cell>& reset(uint64_t seed);
+
+    // actions.size() must be num_envs.
+    const StepResult& step(const std::vector<Action>& actions);
+
+    [[nodiscard]] size_t size() const;
+
+    [[nodiscard]] size_t obs_side() const;
+
+    [[nodiscard]] size_t obs_size() const;
+
+  private:
+    void reset_env(size_t i, uint64_t seed);
+
+    void step_env(size_t i, const Action& action);
+
+    void observe(size_t i);
+
+    // Calls f(i) for every env, spread over the pool and the calling thread.
+    template<typename Func>
+    void for_each_env(Func&& f);
+  };
+}
+#endif
@@ -18,9 +18,13 @@
 #include "game_map.h"
 #include "message.h"
 #include "tank.h"
+#include "utils/mpsc.h"
+#include "utils/scheduler.h"
 
 #include <atomic>
 #include <chrono>
+#include <deque>
+#include <functional>
 #include <mutex>
 #include <optional>
 #include <set>
@@ -32,7 +36,9 @@ namespace czh::g
   {
     size_t user_id{0};
     std::set<map::Pos> map_changes;
-    std::vector<msg::Message> messages;
+    // map_changes overflowed or the user was offline, the whole view must be redrawn.
+    bool full_resync{false};
+    msg::Inbox inbox;
     std::chrono::steady_clock::time_point last_update;
     std::string ip;
     bool active{false};
@@ -67,17 +73,31 @@ namespace czh::g
     size_t id;
     size_t next_id;
     size_t next_bullet_id;
+    size_t tick; // Number of ticks run since the game started
     std::map<std::size_t, tank::Tank*> tanks;
     std::list<bullet::Bullet*> bullets;
-    std::vector<std::pair<std::size_t, tank::NormalTankEvent> > events;
+    // Pushed by any thread, drained by the game thread.
+    utils::MPSCQueue<std::pair<std::size_t, tank::NormalTankEvent> > events;
+    // Game thread only. Events waiting to be processed, per user.
+    std::map<std::size_t, std::deque<tank::NormalTankEvent> > pending_events;
+    msg::MessageLog messages; // Guarded by bc::send_msg_mtx()
   };
 
-  extern GameState state;
-  extern std::mutex mainloop_mtx;
-  extern std::mutex tank_reacting_mtx;
+  // The current world's. (see g::World)
+  GameState& state();
+
+  std::mutex& mainloop_mtx();
+
+  // Locked by g::mainloop() and by recorded commands, so a command always runs between two ticks. (see rec::)
+  std::mutex& command_mtx();
+
+  utils::TickScheduler& scheduler();
 
   std::optional<map::Pos> get_available_pos(const map::Zone& zone);
 
+  // Up to n distinct positions free of walls and tanks, fewer if the zone is full.
+  std::vector<map::Pos> get_available_pos(const map::Zone& zone, size_t n);
+
   tank::Tank* id_at(size_t id);
 
   void revive(std::size_t id, const map::Zone& zone, size_t from_id);
@@ -86,12 +106,32 @@ namespace czh::g
 
   std::size_t add_auto_tank(std::size_t lvl, const map::Pos& pos, size_t from_id);
 
+  // Places up to n AutoTanks in one pass. Returns their IDs.
+  std::vector<std::size_t> add_auto_tanks(std::size_t n, std::size_t lvl, const map::Zone& zone, size_t from_id);
+
   std::size_t add_tank(const map::Pos& pos, size_t from_id);
 
   std::size_t add_tank(const map::Zone& zone, size_t from_id);
 
+  std::size_t add_user(const map::Zone& zone, const std::string& ip);
+
+  void remove_user(std::size_t id);
+
+  void login(std::size_t id, const map::Zone& zone);
+
+  void logout(std::size_t id);
+
+  // Visible zones decide AutoTanks' level of detail, so changes are recorded.
+  void set_visible_zone(std::size_t id, const map::Zone& zone);
+
   void clear_death();
 
+  // Kills the alive tanks selected by pred. Returns the number of tanks killed.
+  std::size_t kill_tanks(const std::function<bool(const tank::Tank*)>& pred);
+
+  // Removes the tanks selected by pred and their bullets. Users' tanks shall not be selected.
+  std::size_t remove_tanks(const std::function<bool(const tank::Tank*)>& pred);
+
   void mainloop();
 
   void tank_react(std::size_t id, tank::NormalTankEvent event);
@@ -80,6 +80,11 @@ namespace czh::map
     [[nodiscard]] bool contains(const Pos& p) const;
 
     [[nodiscard]] Zone bigger_zone(int i) const;
+
+    // Chebyshev distance from the zone to p, 0 if inside.
+    [[nodiscard]] int distance(const Pos& p) const;
+
+    bool operator==(const Zone&) const = default;
   };
 
   class Map;
@@ -178,13 +183,18 @@ namespace czh::map
 
     [[nodiscard]] const Point& at(int x, int y) const;
 
+    // The tanks in the zone. Points are ordered by x then y, so each column is one range.
+    [[nodiscard]] std::vector<tank::Tank*> tanks_in(const Zone& zone) const;
+
   private:
     int tank_move(const Pos& pos, int direction);
 
     int bullet_move(bullet::Bullet*, const Pos& pos, int direction);
   };
 
-  extern Map map;
+  // The current world's. (see g::World)
+  Map& map();
+
   extern const Point empty_point;
   extern const Point wall_point;
 }
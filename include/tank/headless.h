@@ -0,0 +1,64 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef TANK_HEADLESS_H
+#define TANK_HEADLESS_H
+#pragma once
+
+#include "game_map.h"
+
+#include <chrono>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace czh::hl
+{
+  struct ScenarioCommand
+  {
+    size_t tick;
+    std::string command;
+  };
+
+  struct Scenario
+  {
+    std::optional<unsigned long long> seed;
+    std::vector<std::pair<size_t, size_t> > summons; // number, level
+    std::vector<ScenarioCommand> commands; // sorted by tick
+    map::Zone zone{-64, 64, -32, 32}; // user's visible zone
+    std::optional<map::Zone> summon_zone; // where --summon places tanks, defaults to zone
+  };
+
+  struct Options
+  {
+    bool enabled{false};
+    bool help{false};
+    std::optional<size_t> ticks; // 0 for endless, e.g. soak test. Defaults to 1000, or the whole replay
+    std::chrono::milliseconds tick{0}; // 0 for as fast as possible
+    Scenario scenario;
+    std::string replay; // A file written by 'record', replayed instead of the scenario
+    size_t envs{0}; // Steps an env::VecEnv of that many worlds with random actions instead
+  };
+
+  // Parses the command-line. Returns a message on error.
+  std::optional<std::string> parse_args(int argc, char** argv, Options& options);
+
+  std::optional<std::string> load_scenario(const std::string& filename, Scenario& scenario);
+
+  std::string usage();
+
+  // Runs g::mainloop() without a terminal and prints the timing statistics. Returns the exit code.
+  // A replay fails if any tick's world hash differs from the recording.
+  int run(const Options& options);
+}
+#endif
@@ -15,16 +15,25 @@
 #define TANK_MESSAGE_H
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace czh::msg
 {
+  constexpr size_t to_everyone = (std::numeric_limits<size_t>::max)();
+
   struct Message
   {
     size_t from;
     std::string content;
     int priority;
-    bool read;
     long long time;
   };
 
@@ -32,5 +41,113 @@ namespace czh::msg
   {
     return m1.priority < m2.priority;
   }
+
+  // What one user has seen of a MessageLog
+  struct Inbox
+  {
+    uint64_t begin{0}; // Messages before it were cleared
+    uint64_t cursor{0}; // Messages before it are indexed in unread
+    std::set<std::pair<int, uint64_t> > unread; // priority, seq
+    std::set<uint64_t> removed; // Read messages cleared
+  };
+
+  // How much of a MessageLog is kept, read or not.
+  struct Retention
+  {
+    size_t max_count;
+    size_t max_bytes;
+    long long min_time; // Messages sent before it (seconds since epoch) are dropped
+  };
+
+  // The messages of a world. A message is stored once, however many users receive it,
+  // and each user's Inbox indexes the log lazily when the user reads it.
+  // The oldest messages are dropped by shrink(), read or not.
+  class MessageLog
+  {
+  public:
+    struct Entry
+    {
+      uint64_t seq;
+      size_t to;
+      std::shared_ptr<const Message> msg;
+    };
+
+  private:
+    std::deque<Entry> entries;
+    uint64_t next_seq{0};
+    size_t bytes{0};
+
+    static size_t size_of(const Message& m) { return sizeof(Entry) + sizeof(Message) + m.content.size(); }
+
+  public:
+    uint64_t push(size_t to, std::shared_ptr<const Message> msg)
+    {
+      bytes += size_of(*msg);
+      entries.emplace_back(Entry{.seq = next_seq, .to = to, .msg = std::move(msg)});
+      return next_seq++;
+    }
+
+    // Drops the oldest messages until the log is within the retention.
+    void shrink(const Retention& r)
+    {
+      while (!entries.empty() && (entries.size() > r.max_count || bytes > r.max_bytes
+                                  || entries.front().msg->time < r.min_time))
+      {
+        bytes -= size_of(*entries.front().msg);
+        entries.pop_front();
+      }
+    }
+
+    [[nodiscard]] size_t size() const { return entries.size(); }
+
+    // Approximate memory used by the messages
+    [[nodiscard]] size_t size_bytes() const { return bytes; }
+
+    // The seq of the next message
+    [[nodiscard]] uint64_t end() const { return next_seq; }
+
+    // The seq of the oldest message kept
+    [[nodiscard]] uint64_t first() const { return next_seq - entries.size(); }
+
+    [[nodiscard]] const Entry* at(uint64_t seq) const
+    {
+      if (seq < first() || seq >= next_seq)
+        return nullptr;
+      return &entries[seq - first()];
+    }
+
+    void sync(size_t id, Inbox& inbox) const
+    {
+      auto beg = (std::max)({inbox.cursor, inbox.begin, first()});
+      for (auto seq = beg; seq < next_seq; ++seq)
+      {
+        auto& e = entries[seq - first()];
+        if (e.to == id || e.to == to_everyone)
+          inbox.unread.emplace(e.msg->priority, seq);
+      }
+      inbox.cursor = next_seq;
+      trim(inbox);
+    }
+
+    // Forgets the messages of an inbox that were dropped from the log.
+    void trim(Inbox& inbox) const
+    {
+      std::erase_if(inbox.unread, [this](auto&& u) { return u.second < first(); });
+      inbox.removed.erase(inbox.removed.begin(), inbox.removed.lower_bound(first()));
+    }
+
+    // Visits the messages of a synced inbox from old to new, f(const Entry&, bool read).
+    template<typename Func>
+    void for_each(size_t id, const Inbox& inbox, uint64_t from, Func&& f) const
+    {
+      for (auto seq = (std::max)({from, inbox.begin, first()}); seq < next_seq; ++seq)
+      {
+        auto& e = entries[seq - first()];
+        if ((e.to != id && e.to != to_everyone) || inbox.removed.contains(seq))
+          continue;
+        f(e, !inbox.unread.contains({e.msg->priority, seq}));
+      }
+    }
+  };
 }
 #endif
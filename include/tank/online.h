@@ -15,22 +15,94 @@
 #define TANK_ONLINE_H
 #pragma once
 
+#include "drawing.h"
 #include "tank.h"
+#include "world.h"
+#include "utils/mpsc.h"
 #include "utils/network.h"
+#include "utils/udp.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
 #include <string>
 #include <mutex>
 #include <optional>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace czh::online
 {
+  // A frame as the client has it after applying it, which later frames are deltas against.
+  // The user list is the same for all the frames made in one tick, so it's shared.
+  struct Baseline
+  {
+    size_t tick;
+    std::shared_ptr<const std::map<size_t, draw::UserView> > userinfo;
+    std::map<size_t, draw::TankView> tanks;
+    std::map<map::Pos, draw::PointView> view;
+  };
+
+  // Baselines kept per stream, a client acking later than this gets full frames.
+  constexpr size_t max_baselines = 64;
+
+  // A client's frame stream, a second connection that only receives frames after subscribing.
+  // With UDP, frames go over a UDPConnection instead, and fd is the client's connection.
+  struct Subscriber
+  {
+    utils::Socket_t fd;
+    g::World* world;
+    size_t id;
+    map::Zone zone;
+    bool roster{false}; // Wants every tank, not only those around zone. (for the status page)
+    bool pending{false}; // A frame is waiting to be sent, guarded by TankServer::push_mtx
+    size_t skipped{0}; // Frames not made since the last one because it was pending, guarded by TankServer::push_mtx
+    std::mutex send_mtx; // Held while a frame is sent
+    bool closed{false}; // Guarded by send_mtx
+    // The frame being sent on a TCP stream, which is non-blocking. Guarded by send_mtx.
+    utils::MsgHeader out_header{};
+    std::string out_frame;
+    size_t out_sent{0}; // Of the header and the frame
+    std::chrono::steady_clock::time_point out_begin;
+    std::shared_ptr<utils::UDPConnection> udp;
+    std::atomic<size_t> acked{0}; // The last tick the client applied, 0 if it needs a full frame
+    std::deque<Baseline> baselines; // Only used by the thread ticking `world`
+  };
+
   class TankServer
   {
   private:
     utils::TCPServer* svr{};
     std::thread th;
     int port{};
-    //UDPSocket* udp;
+    std::mutex rooms_mtx;
+    std::map<utils::Socket_t, std::shared_ptr<g::World> > rooms; // The room each connection joined
+
+    std::mutex subscribers_mtx;
+    std::map<utils::Socket_t, std::shared_ptr<Subscriber> > subscribers;
+    std::atomic<bool> has_subscribers{false};
+
+    // Frames are made by the ticking threads and sent by the push thread.
+    std::mutex push_mtx;
+    std::condition_variable push_cond;
+    std::vector<std::pair<std::shared_ptr<Subscriber>, std::string> > outbox;
+    bool push_stopping{false};
+    std::thread push_th;
+
+    // Datagrams of the clients using UDP, on the same port.
+    utils::UDPSocket* udp{nullptr};
+    std::thread udp_th;
+    std::atomic<bool> udp_stopping{false};
+    std::map<uint64_t, std::shared_ptr<Subscriber> > udp_subscribers; // By token, guarded by subscribers_mtx
+    std::mt19937_64 token_rng{std::random_device{}()}; // Guarded by subscribers_mtx
+
   public:
     TankServer() = default;
 
@@ -43,6 +115,34 @@ namespace czh::online
     [[nodiscard]] int get_port() const;
 
     void reset();
+
+    // Called by the thread ticking the current world after its steps. Queues a frame for each
+    // subscriber of the world, except those whose last frame hasn't been sent yet.
+    // A frame is a delta against the last one its client acked, or a full one if that's gone.
+    void publish_frames();
+
+  private:
+    std::string route(utils::Socket_t fd, std::string_view req);
+
+    // The default world if fd didn't join a room. Kept alive by the returned shared_ptr.
+    std::shared_ptr<g::World> room_of(utils::Socket_t fd);
+
+    // Leaves the room fd was in. nullptr if the room can't be created.
+    std::shared_ptr<g::World> join_room(utils::Socket_t fd, const std::string& name);
+
+    void leave_room(utils::Socket_t fd);
+
+    // Returns false if there is no such user, or the zone is inverted or too big.
+    bool subscribe(utils::Socket_t fd, size_t id, const map::Zone& zone,
+                   std::shared_ptr<utils::UDPConnection> conn = nullptr);
+
+    // Returns nullptr if fd wasn't a subscriber.
+    std::shared_ptr<Subscriber> unsubscribe(utils::Socket_t fd);
+
+    void push_frames();
+
+    // Routes the requests in the datagrams as if they came from the client's connection.
+    void receive_datagrams();
   };
 
   class TankClient
@@ -50,21 +150,58 @@ namespace czh::online
   private:
     std::string host;
     int port{0};
+    std::string room;
+
+    // The control connection, only touched by io_th. Requests are queued and sent at once
+    // with an ID, and their responses, matched by ID, may come back in any order.
     utils::TCPClient* cli{nullptr};
-    //UDPSocket* udp;
+    std::thread io_th;
+    utils::Poller io_poller;
+    utils::MPSCQueue<std::string> io_queue;
+    std::mutex pending_mtx;
+    std::map<uint32_t, std::function<void(utils::RecvRet, std::string)> > pending; // Guarded by pending_mtx
+    uint32_t next_request{1}; // Guarded by pending_mtx
+    bool io_closed{true}; // Nothing will complete a new request, guarded by pending_mtx
+    std::atomic<bool> io_stopping{false};
+    std::atomic<bool> io_failed{false};
+    utils::RecvRet io_err{utils::RecvRet::ok};
+    std::atomic<bool> pinging{false};
+
+    // The frame stream, read by stream_th
+    utils::TCPClient* stream{nullptr};
+    std::mutex stream_mtx; // Held while sending on the stream
+    std::thread stream_th;
+    std::atomic<bool> stream_failed{false};
+    utils::RecvRet stream_err{utils::RecvRet::ok};
+    map::Zone stream_zone;
+    bool stream_roster{false};
+    std::deque<Baseline> baselines; // Only used by stream_th
+    bool frame_lost{false}; // Only used by stream_th
+    std::chrono::steady_clock::time_point last_ping;
+
+    // Frames, inputs and commands over UDP instead, with stream_th receiving the datagrams.
+    bool use_udp{false}; // For the next connection
+    utils::UDPSocket* udp{nullptr};
+    std::unique_ptr<utils::UDPConnection> udp_conn;
+    std::atomic<bool> stream_stopping{false};
+
   public:
     TankClient() = default;
 
     ~TankClient();
 
-    std::optional<size_t> signup(const std::string& addr_, int port_);
+    // An empty room is the server's own game.
+    std::optional<size_t> signup(const std::string& addr_, int port_, const std::string& room_);
 
-    int login(const std::string& addr_, int port_, size_t id);
+    int login(const std::string& addr_, int port_, const std::string& room_, size_t id);
 
     void logout();
 
+    // Only queued, as are add_auto_tank() and run_command(), so inputs never wait behind a response.
     [[nodiscard]] int tank_react(tank::NormalTankEvent e);
 
+    // Frames are pushed by the server, this only sends the zone when it changed or the
+    // full roster is wanted, and measures the delay from time to time.
     [[nodiscard]] int update();
 
     [[nodiscard]] int add_auto_tank(size_t l);
@@ -75,17 +212,59 @@ namespace czh::online
 
     [[nodiscard]] std::string get_host() const;
 
+    [[nodiscard]] std::string get_room() const;
+
+    void set_udp(bool udp_);
+
+    // Whether the current connection uses UDP.
+    [[nodiscard]] bool is_udp() const;
+
   private:
     void cli_failed(bool shutdown = false);
+
+    // Starts io_th on the connected cli.
+    void start_io();
+
+    // Sends what is still queued, then stops io_th and closes cli.
+    void stop_io();
+
+    void io_loop();
+
+    // Queues a request. The callback gets its response on io_th, or the error if the connection
+    // fails first.
+    void request(std::string req, std::function<void(utils::RecvRet, std::string)> callback);
+
+    // Queues a request and waits for its response.
+    std::tuple<utils::RecvRet, std::string> request_and_wait(std::string req);
+
+    // Queues a request that has no response. Returns -1 if the connection has failed.
+    int post(std::string req);
+
+    int subscribe(size_t id);
+
+    void stop_stream();
+
+    void receive_frames(size_t id);
+
+    void receive_datagrams(size_t id);
+
+    // Sends the pending messages of udp_conn, with the sequenced one if given.
+    int send_datagrams(const std::string* sequenced = nullptr);
+
+    // Publishes the snapshot of a frame, returns the tick to ack. (see TankServer::publish_frames())
+    size_t apply_frame(size_t id, std::string_view frame, bool resync);
   };
 
   struct OnlineState
   {
     std::string error;
-    int delay; // ms
+    // Written by the client's threads, read by the render thread.
+    std::atomic<int> delay; // ms
+    std::atomic<size_t> dropped_frames; // Frames the server skipped because the last one wasn't sent yet
   };
 
   extern OnlineState state;
+  extern utils::NetSim net_sim;
   extern TankServer svr;
   extern TankClient cli;
   extern std::mutex online_mtx;
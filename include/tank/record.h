@@ -0,0 +1,90 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef TANK_RECORD_H
+#define TANK_RECORD_H
+#pragma once
+
+#include "archive.h"
+#include "game_map.h"
+#include "tank.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Deterministic record and replay.
+// A recording starts from an archive of the world and a fresh seed of utils::rand_engine(),
+// then logs every input of the simulation with the tick it took effect at.
+// Replaying the inputs on the same build reproduces the game tick by tick.
+namespace czh::rec
+{
+  enum class EntryType
+  {
+    COMMAND,
+    EVENT, // NormalTankEvent, recorded when the game thread drains it
+    ADD_USER,
+    REMOVE_USER,
+    LOGIN,
+    LOGOUT,
+    ADD_AUTO_TANK,
+    VIEW // A user's visible zone changed
+  };
+
+  struct Entry
+  {
+    EntryType type{EntryType::COMMAND};
+    size_t tick{0};
+    size_t user{0};
+    map::Zone zone; // Commands depend on the user's visible zone
+    std::string command;
+    tank::NormalTankEvent event{tank::NormalTankEvent::UP};
+    size_t lvl{0};
+  };
+
+  struct Recording
+  {
+    unsigned long long rng_seed{0};
+    size_t begin_tick{0};
+    ar::Archive archive;
+    std::vector<Entry> entries;
+    std::vector<uint64_t> hashes; // world_hash() after each tick since begin_tick
+  };
+
+  [[nodiscard]] bool is_recording();
+
+  // Commands that don't change the world, like 'help' or 'server', are not recorded.
+  [[nodiscard]] bool is_recorded_command(const std::string& name);
+
+  // g::mainloop_mtx() and draw::drawing_mtx must be held.
+  void start();
+
+  Recording stop();
+
+  // Caller must hold g::mainloop_mtx() or g::command_mtx(), so that g::state().tick is stable.
+  void record(Entry entry);
+
+  // Called by g::mainloop() after each tick.
+  void end_tick();
+
+  [[nodiscard]] uint64_t world_hash();
+
+  // Replays an entry. Must be called right before the g::mainloop() of entry.tick.
+  void apply(const Entry& entry);
+
+  std::optional<std::string> save(const Recording& recording, const std::string& filename);
+
+  std::optional<std::string> load(const std::string& filename, Recording& recording);
+}
+#endif
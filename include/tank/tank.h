@@ -15,9 +15,13 @@
 #define TANK_TANK_H
 #pragma once
 
+#include <cstdint>
 #include <functional>
+#include <type_traits>
 #include <utility>
 #include "game_map.h"
+#include "utils/random.h"
+#include "utils/type_list.h"
 
 namespace czh::ar
 {
@@ -51,6 +55,15 @@ namespace czh::tank
     END
   };
 
+  class NormalTank;
+  class AutoTank;
+
+  // Every kind of tank. A Tank's kind is its index in this list, see visit().
+  using Kinds = utils::TypeList<NormalTank, AutoTank>;
+
+  template<typename T>
+  constexpr uint8_t kind_of = static_cast<uint8_t>(utils::index_of_v<T, Kinds>);
+
   class Tank
   {
     friend class ar::Archiver;
@@ -60,7 +73,7 @@ namespace czh::tank
     bool hascleared;
 
   public:
-    bool is_auto;
+    const uint8_t kind;
     std::string name;
     int max_hp;
     int hp;
@@ -72,13 +85,13 @@ namespace czh::tank
     int bullet_range;
 
   public:
-    Tank(bool is_auto_, size_t id_, std::string name_, int max_hp_, map::Pos pos_, int bullet_hp_,
+    Tank(uint8_t kind_, size_t id_, std::string name_, int max_hp_, map::Pos pos_, int bullet_hp_,
          int bullet_lethality_, int bullet_range_) :
-        id(id_), hascleared(false), is_auto(is_auto_), name(std::move(name_)), max_hp(max_hp_), hp(max_hp_), pos(pos_),
+        id(id_), hascleared(false), kind(kind_), name(std::move(name_)), max_hp(max_hp_), hp(max_hp_), pos(pos_),
         direction(map::Direction::UP), bullet_hp(bullet_hp_), bullet_lethality(bullet_lethality_),
         bullet_range(bullet_range_)
     {
-      map::map.add_tank(this, pos);
+      map::map().add_tank(this, pos);
     }
 
     virtual ~Tank() = default;
@@ -101,11 +114,15 @@ namespace czh::tank
 
     [[nodiscard]] bool has_cleared() const;
 
-    void clear();
+    [[nodiscard]] bool is_auto() const { return kind == kind_of<AutoTank>; }
 
-    virtual void attacked(int lethality_);
+    void clear();
 
     void revive(const map::Pos &newpos);
+
+  protected:
+    // Each kind makes it public or hides it with its own reaction, call it through visit().
+    void attacked(int lethality_);
   };
 
   class NormalTank : public Tank
@@ -119,13 +136,15 @@ namespace czh::tank
   public:
     NormalTank(size_t id_, std::string name_, int max_hp_, map::Pos pos_, int bullet_hp_, int bullet_lethality_,
                int bullet_range_) :
-        Tank(false, id_, std::move(name_), max_hp_, pos_, bullet_hp_, bullet_lethality_, bullet_range_),
+        Tank(kind_of<NormalTank>, id_, std::move(name_), max_hp_, pos_, bullet_hp_, bullet_lethality_, bullet_range_),
         auto_event(NormalTankEvent::UP), auto_driving(false)
     {
     }
 
     ~NormalTank() override = default;
 
+    using Tank::attacked;
+
     void start_auto_drive(NormalTankEvent e)
     {
       auto_event = e;
@@ -168,12 +187,23 @@ namespace czh::tank
     std::size_t route_pos;
     int gap_count;
     bool has_good_target;
+    utils::Xoshiro256 rng;
+    size_t lod_tick; // The last tick it was simulated at, to fast-forward after being frozen
+
+    enum class Action
+    {
+      NONE,
+      FIRE,
+      MOVE
+    };
+    Action next_action; // Decided by plan(), carried out by act()
 
   public:
     AutoTank(size_t id_, std::string name_, int max_hp_, map::Pos pos_, int gap_, int bullet_hp_, int bullet_lethality_,
              int bullet_range_) :
-        Tank(true, id_, std::move(name_), max_hp_, pos_, bullet_hp_, bullet_lethality_, bullet_range_), gap(gap_),
-        target_id(0), route_pos(0), gap_count(0), has_good_target(false)
+        Tank(kind_of<AutoTank>, id_, std::move(name_), max_hp_, pos_, bullet_hp_, bullet_lethality_, bullet_range_), gap(gap_),
+        target_id(0), route_pos(0), gap_count(0), has_good_target(false), rng(utils::rand_stream(id_)),
+        lod_tick(no_lod_tick), next_action(Action::NONE)
     {
     }
 
@@ -187,12 +217,71 @@ namespace czh::tank
 
     void react();
 
-    void attacked(int lethality_) override;
+    // Decides what to do this tick. It only reads the world and the tank's own state,
+    // so that AutoTanks can plan in parallel.
+    void plan();
+
+    // Carries out the plan. Called serially.
+    void act();
+
+    // Reduced level of detail, called every `ticks` ticks: follows a random route
+    // without searching for targets or firing.
+    void react_cheap(int ticks);
+
+    // Called before react() or react_cheap() at the given tick. A tank that was
+    // frozen for a while is fast-forwarded statistically.
+    void wake(size_t tick);
+
+    void attacked(int lethality_);
 
   private:
+    static constexpr size_t no_lod_tick = static_cast<size_t>(-1);
+
+    void fast_forward(size_t ticks);
+
+    int move(AutoTankEvent e);
+
     void generate_random_route();
 
     [[nodiscard]] int find_route();
   };
+
+  namespace details
+  {
+    template<size_t I, typename TankPtr, typename Func>
+    decltype(auto) visit(TankPtr t, Func&& f)
+    {
+      using Kind = utils::index_at_t<static_cast<int>(I), Kinds>;
+      using KindPtr = std::conditional_t<std::is_const_v<std::remove_pointer_t<TankPtr> >, const Kind*, Kind*>;
+      static_assert(std::is_base_of_v<Tank, Kind>);
+      if constexpr (I + 1 == utils::size_of_v<Kinds>)
+        return std::forward<Func>(f)(static_cast<KindPtr>(t));
+      else
+      {
+        if (t->kind == I)
+          return std::forward<Func>(f)(static_cast<KindPtr>(t));
+        return visit<I + 1>(t, std::forward<Func>(f));
+      }
+    }
+  }
+
+  // Calls f with t as its own kind. The dispatch is a comparison chain on Tank::kind
+  // generated from Kinds, without RTTI or virtual calls. f must accept every kind,
+  // so adding a kind to Kinds fails to compile wherever it isn't handled.
+  // Tank::kind is only set by the kinds' constructors, so it is always valid.
+  template<typename TankPtr, typename Func>
+    requires std::is_convertible_v<TankPtr, const Tank*>
+  decltype(auto) visit(TankPtr t, Func&& f)
+  {
+    return details::visit<0>(t, std::forward<Func>(f));
+  }
+
+  // t as a T, nullptr if it is of another kind.
+  template<typename T, typename TankPtr>
+  auto get_if(TankPtr t)
+  {
+    using Ret = std::conditional_t<std::is_const_v<std::remove_pointer_t<TankPtr> >, const T*, T*>;
+    return t->kind == kind_of<T> ? static_cast<Ret>(t) : nullptr;
+  }
 } // namespace czh::tank
 #endif
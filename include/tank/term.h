@@ -40,6 +40,7 @@ namespace czh::term
   {
   public:
     int keyboard_mode;
+    bool inited;
 #if defined(CZH_TANK_KEYBOARD_MODE_0)
     DWORD initial_settings, new_settings;
 #elif defined(CZH_TANK_KEYBOARD_MODE_1)
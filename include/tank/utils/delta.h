@@ -0,0 +1,79 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef TANK_DELTA_H
+#define TANK_DELTA_H
+#pragma once
+
+#include <map>
+#include <vector>
+
+namespace czh::utils
+{
+  // What turns one std::map into another. Serializable.
+  template<typename K, typename V>
+  struct MapDelta
+  {
+    std::map<K, V> changed; // Added or modified
+    std::vector<K> removed;
+  };
+
+  // Calls on_changed(key, value) for what is added or modified in curr, and on_removed(key)
+  // for what is not there anymore. Both maps are walked once, side by side.
+  template<typename K, typename V, typename C, typename R>
+  void diff(const std::map<K, V>& base, const std::map<K, V>& curr, C&& on_changed, R&& on_removed)
+  {
+    auto b = base.begin();
+    auto c = curr.begin();
+    while (b != base.end() || c != curr.end())
+    {
+      if (c == curr.end() || (b != base.end() && b->first < c->first))
+      {
+        on_removed(b->first);
+        ++b;
+      }
+      else if (b == base.end() || c->first < b->first)
+      {
+        on_changed(c->first, c->second);
+        ++c;
+      }
+      else
+      {
+        if (!(b->second == c->second))
+          on_changed(c->first, c->second);
+        ++b;
+        ++c;
+      }
+    }
+  }
+
+  template<typename K, typename V>
+  MapDelta<K, V> diff(const std::map<K, V>& base, const std::map<K, V>& curr)
+  {
+    MapDelta<K, V> ret;
+    diff(base, curr,
+         [&ret](const K& k, const V& v) { ret.changed.emplace_hint(ret.changed.end(), k, v); },
+         [&ret](const K& k) { ret.removed.emplace_back(k); });
+    return ret;
+  }
+
+  template<typename K, typename V>
+  void apply(std::map<K, V>& base, const MapDelta<K, V>& delta)
+  {
+    for (auto& k : delta.removed)
+      base.erase(k);
+    for (auto& [k, v] : delta.changed)
+      base.insert_or_assign(k, v);
+  }
+}
+#endif
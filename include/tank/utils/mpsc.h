@@ -0,0 +1,125 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef TANK_MPSC_H
+#define TANK_MPSC_H
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace czh::utils
+{
+  // Lock-free multi-producer single-consumer queue.
+  // Producers push onto an intrusive stack with one CAS, and the consumer takes
+  // everything at once with a single exchange, so the consumer never races
+  // with a producer on the same node and there is no ABA problem.
+  // Drained nodes are kept for later pushes instead of being freed: the consumer returns them to a
+  // free list shared by the queues of T, which a producer takes whole into its own thread's cache.
+  template<typename T>
+  class MPSCQueue
+  {
+  private:
+    struct Node
+    {
+      T value;
+      Node* next;
+    };
+
+    struct Cache
+    {
+      Node* nodes{nullptr};
+
+      ~Cache() { free(nodes); }
+    };
+
+    std::atomic<Node*> head{nullptr};
+    static inline std::atomic<Node*> free_nodes{nullptr};
+    static inline thread_local Cache cache;
+
+  public:
+    MPSCQueue() = default;
+
+    MPSCQueue(const MPSCQueue&) = delete;
+
+    MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+    ~MPSCQueue() { free(head.exchange(nullptr, std::memory_order_acquire)); }
+
+    template<typename... Args>
+    void emplace(Args&&... args)
+    {
+      if (cache.nodes == nullptr)
+        cache.nodes = free_nodes.exchange(nullptr, std::memory_order_acquire);
+      Node* node = cache.nodes;
+      if (node != nullptr)
+      {
+        cache.nodes = node->next;
+        node->value = T{std::forward<Args>(args)...};
+        node->next = head.load(std::memory_order_relaxed);
+      }
+      else
+        node = new Node{T{std::forward<Args>(args)...}, head.load(std::memory_order_relaxed)};
+      while (!head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+      {
+      }
+    }
+
+    void push(T value) { emplace(std::move(value)); }
+
+    [[nodiscard]] bool empty() const { return head.load(std::memory_order_relaxed) == nullptr; }
+
+    // Consumer only. Takes every pushed item in one swap and visits them in push order.
+    template<typename Func>
+    void drain(Func&& func)
+    {
+      Node* list = head.exchange(nullptr, std::memory_order_acquire);
+      // The stack is LIFO, reverse it.
+      Node* prev = nullptr;
+      while (list != nullptr)
+      {
+        Node* next = list->next;
+        list->next = prev;
+        prev = list;
+        list = next;
+      }
+      Node* first = prev;
+      Node* last = nullptr;
+      while (prev != nullptr)
+      {
+        func(std::move(prev->value));
+        last = prev;
+        prev = prev->next;
+      }
+      if (last == nullptr)
+        return;
+      // The drained list goes back to the free list as it is.
+      last->next = free_nodes.load(std::memory_order_relaxed);
+      while (!free_nodes.compare_exchange_weak(last->next, first, std::memory_order_release, std::memory_order_relaxed))
+      {
+      }
+    }
+
+  private:
+    static void free(Node* node)
+    {
+      while (node != nullptr)
+      {
+        Node* next = node->next;
+        delete node;
+        node = next;
+      }
+    }
+  };
+}
+#endif
@@ -26,25 +26,40 @@
 #else
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <cstring>
 
 #endif
 
+// The server waits with epoll on Linux, and with select elsewhere or if TANK_USE_SELECT is defined.
+#if defined(__linux__) && !defined(TANK_USE_SELECT)
+#define TANK_USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #include "debug.h"
+#include "thpool.h"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <condition_variable>
 #include <functional>
 #include <future>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <set>
 #include <vector>
@@ -53,76 +68,13 @@ namespace czh::utils
 {
   constexpr uint32_t HEADER_MAGIC = 0x18273645;
   constexpr uint32_t SHUTDOWN_MAGIC = HEADER_MAGIC + 6;
-  constexpr uint16_t PROTOCOL_VERSION = 2;
+  constexpr uint16_t PROTOCOL_VERSION = 9;
 
 #ifdef _WIN32
   inline WSADATA wsa_data;
   [[maybe_unused]] inline int wsa_startup_err = WSAStartup(MAKEWORD(2, 2), &wsa_data);
 #endif
 
-  class Thpool
-  {
-  private:
-    using Task = std::function<void()>;
-    std::vector<std::thread> pool;
-    std::queue<Task> tasks;
-    std::atomic<bool> running;
-    std::mutex thpool_mtx;
-    std::condition_variable cond;
-
-  public:
-    explicit Thpool(size_t size) : running(true) { add_thread(size); }
-
-    ~Thpool()
-    {
-      running = false;
-      cond.notify_all();
-      for (auto &th : pool)
-      {
-        if (th.joinable())
-          th.join();
-      }
-    }
-
-    void add_task(const std::function<void()> &func)
-    {
-      dbg::tank_assert(running, "Can not add task on stopped Thpool");
-      //
-      {
-        std::lock_guard lock(thpool_mtx);
-        tasks.emplace([func] { func(); });
-      }
-      cond.notify_one();
-    }
-
-    void add_thread(std::size_t num)
-    {
-      for (std::size_t i = 0; i < num; i++)
-      {
-        pool.emplace_back(
-            [this]
-            {
-              while (running)
-              {
-                Task task;
-                //
-                {
-                  std::unique_lock lock(thpool_mtx);
-                  cond.wait(lock, [this] { return !running || !tasks.empty(); });
-                  if (!running)
-                    return;
-                  if (tasks.empty())
-                    continue;
-                  task = std::move(tasks.front());
-                  tasks.pop();
-                }
-                task();
-              }
-            });
-      }
-    }
-  };
-
   struct MsgHeader
   {
     uint32_t magic;
@@ -136,19 +88,6 @@ namespace czh::utils
   using Socket_t = int;
 #endif
 
-  inline int receive_all(Socket_t sock, char *buf, int size)
-  {
-    while (size > 0)
-    {
-      auto r = ::recv(sock, buf, size, MSG_WAITALL);
-      if (r <= 0)
-        return -1;
-      size -= r;
-      buf += r;
-    }
-    return 0;
-  }
-
   inline int send_all(Socket_t sock, const char *buf, int size)
   {
     while (size > 0)
@@ -166,28 +105,162 @@ namespace czh::utils
     return 0;
   }
 
-  inline int send_packet(Socket_t sock, const std::string &content)
+  inline MsgHeader make_header(uint32_t magic, size_t content_length)
+  {
+    return {.magic = static_cast<uint32_t>(htonl(magic)),
+            .version = htons(PROTOCOL_VERSION),
+            .content_length = static_cast<uint32_t>(htonl(static_cast<uint32_t>(content_length)))};
+  }
+
+#ifdef _WIN32
+  using IoBuf = WSABUF;
+
+  inline IoBuf make_io_buf(const void *data, size_t size)
+  {
+    return {.len = static_cast<ULONG>(size), .buf = static_cast<CHAR *>(const_cast<void *>(data))};
+  }
+#else
+  using IoBuf = iovec;
+
+  inline IoBuf make_io_buf(const void *data, size_t size)
+  {
+    return {.iov_base = const_cast<void *>(data), .iov_len = size};
+  }
+#endif
+
+  // Sends all the buffers with as few syscalls as possible, modifies them when only a part is sent.
+  inline int send_all(Socket_t sock, std::vector<IoBuf> &bufs)
   {
-    MsgHeader header{.magic = static_cast<uint32_t>(htonl(HEADER_MAGIC)),
-                     .version = htons(PROTOCOL_VERSION),
 #ifdef _WIN32
-                     .content_length = static_cast<uint32_t>(htonl(static_cast<u_long>(content.size())))
+    constexpr size_t max_bufs = 1024;
 #else
-                     .content_length = htonl(content.size())
+    constexpr size_t max_bufs = IOV_MAX;
 #endif
-    };
-    if (send_all(sock, reinterpret_cast<const char *>(&header), sizeof(MsgHeader)) != 0)
-      return -1;
-    if (send_all(sock, content.data(), static_cast<int>(content.size())) != 0)
-      return -1;
+    size_t first = 0;
+    while (first < bufs.size())
+    {
+      size_t count = (std::min)(bufs.size() - first, max_bufs);
+#ifdef _WIN32
+      DWORD s = 0;
+      if (WSASend(sock, bufs.data() + first, static_cast<DWORD>(count), &s, 0, nullptr, nullptr) != 0)
+        return -1;
+      auto len = [](const IoBuf &b) -> size_t { return b.len; };
+      auto advance = [](IoBuf &b, size_t n)
+      {
+        b.buf += n;
+        b.len -= static_cast<ULONG>(n);
+      };
+#else
+      msghdr msg{};
+      msg.msg_iov = bufs.data() + first;
+      msg.msg_iovlen = count;
+      auto s = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+      if (s < 0)
+        return -1;
+      auto len = [](const IoBuf &b) -> size_t { return b.iov_len; };
+      auto advance = [](IoBuf &b, size_t n)
+      {
+        b.iov_base = static_cast<char *>(b.iov_base) + n;
+        b.iov_len -= n;
+      };
+#endif
+      auto sent = static_cast<size_t>(s);
+      while (first < bufs.size() && sent >= len(bufs[first]))
+      {
+        sent -= len(bufs[first]);
+        ++first;
+      }
+      if (sent != 0)
+        advance(bufs[first], sent);
+    }
     return 0;
   }
 
+  inline void set_nonblocking(Socket_t fd)
+  {
+#ifdef _WIN32
+    u_long mode = 1;
+    ioctlsocket(fd, FIONBIO, &mode);
+#else
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+  }
+
+  // The last call on a non-blocking socket failed only because it wasn't ready.
+  inline bool would_block()
+  {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+  }
+
+  // One write of what a non-blocking socket has room for. The bytes sent, 0 if none, -1 on failure.
+  inline int64_t send_some(Socket_t sock, std::vector<IoBuf> &bufs)
+  {
+#ifdef _WIN32
+    DWORD s = 0;
+    if (WSASend(sock, bufs.data(), static_cast<DWORD>(bufs.size()), &s, 0, nullptr, nullptr) != 0)
+      return would_block() ? 0 : -1;
+    return s;
+#else
+    msghdr msg{};
+    msg.msg_iov = bufs.data();
+    msg.msg_iovlen = bufs.size();
+    auto s = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (s < 0)
+      return would_block() ? 0 : -1;
+    return s;
+#endif
+  }
+
+  // The header and the content go out in one write, so that they can share a segment with TCP_NODELAY.
+  inline int send_packet(Socket_t sock, const std::string &content)
+  {
+    auto header = make_header(HEADER_MAGIC, content.size());
+    std::vector<IoBuf> bufs{make_io_buf(&header, sizeof(MsgHeader)), make_io_buf(content.data(), content.size())};
+    return send_all(sock, bufs);
+  }
+
+  // Packets for one socket, sent together by flush() in a single scatter-gather write.
+  class OutBuffer
+  {
+  private:
+    std::vector<MsgHeader> headers;
+    std::vector<std::string> contents;
+
+  public:
+    void add(std::string content)
+    {
+      headers.emplace_back(make_header(HEADER_MAGIC, content.size()));
+      contents.emplace_back(std::move(content));
+    }
+
+    [[nodiscard]] bool empty() const { return contents.empty(); }
+
+    // Sends everything added and clears it. On failure, a part may have been sent.
+    int flush(Socket_t sock)
+    {
+      if (contents.empty())
+        return 0;
+      std::vector<IoBuf> bufs;
+      bufs.reserve(contents.size() * 2);
+      for (size_t i = 0; i < contents.size(); ++i)
+      {
+        bufs.emplace_back(make_io_buf(&headers[i], sizeof(MsgHeader)));
+        bufs.emplace_back(make_io_buf(contents[i].data(), contents[i].size()));
+      }
+      int ret = send_all(sock, bufs);
+      headers.clear();
+      contents.clear();
+      return ret;
+    }
+  };
+
   inline int send_shutdown_packet(Socket_t sock)
   {
-    MsgHeader header{.magic = static_cast<uint32_t>(htonl(SHUTDOWN_MAGIC)),
-                     .version = htons(PROTOCOL_VERSION),
-                     .content_length = static_cast<uint32_t>(htonl(0))};
+    auto header = make_header(SHUTDOWN_MAGIC, 0);
     if (send_all(sock, reinterpret_cast<const char *>(&header), sizeof(MsgHeader)) != 0)
       return -1;
     return 0;
@@ -221,30 +294,92 @@ namespace czh::utils
     ok = 0
   };
 
-  inline std::tuple<RecvRet, std::string> receive_packet(Socket_t sock)
+  // Packets longer are invalid, so that a hostile length can't make the receiver allocate it.
+  constexpr size_t default_max_packet_size = 64 * 1024 * 1024;
+
+  // The bytes received on a connection, from which whole packets are taken as views as soon as
+  // they are complete. The storage is reused: what was taken is dropped by moving the rest to
+  // the front when more room is needed.
+  class RecvBuffer
   {
-    MsgHeader header{};
-    if (receive_all(sock, reinterpret_cast<char *>(&header), sizeof(MsgHeader)) != 0)
-      return {RecvRet::failed, ""};
+  private:
+    static constexpr size_t min_read = 4096;
 
-    if (ntohs(header.version) != PROTOCOL_VERSION)
-      return {RecvRet::invalid, ""};
+    std::vector<char> buf;
+    size_t begin{0}; // The first byte not taken yet
+    size_t end{0}; // After the last received byte
+    size_t max_packet_size;
 
-    if (ntohl(header.magic) != HEADER_MAGIC)
+  public:
+    explicit RecvBuffer(size_t max_packet_size_ = default_max_packet_size)
+      : buf(min_read), max_packet_size(max_packet_size_)
     {
-      if (ntohl(header.magic) == SHUTDOWN_MAGIC)
-        return {RecvRet::shutdown, ""};
-      else
-        return {RecvRet::invalid, ""};
     }
 
-    std::string ret(ntohl(header.content_length), '\0');
+    // One recv() of whatever is available, blocks if there is nothing yet.
+    // On a non-blocking socket with nothing yet, nothing is added.
+    RecvRet fill(Socket_t sock)
+    {
+      // Room for the rest of the packet being received, or at least min_read more bytes.
+      size_t want = (std::max)(packet_size(), end - begin + min_read);
+      if (buf.size() - begin < want && begin != 0)
+      {
+        std::memmove(buf.data(), buf.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+      }
+      if (buf.size() - begin < want)
+        buf.resize(begin + want);
+      auto r = ::recv(sock, buf.data() + end, static_cast<int>(buf.size() - end), 0);
+      if (r < 0 && would_block())
+        return RecvRet::ok;
+      if (r <= 0)
+        return RecvRet::failed;
+      end += static_cast<size_t>(r);
+      return RecvRet::ok;
+    }
 
-    if (receive_all(sock, reinterpret_cast<char *>(ret.data()), static_cast<int>(ret.size())) != 0)
-      return {RecvRet::failed, ""};
+    // The next packet, if all of it has been received. The view is valid until the next fill().
+    std::optional<std::tuple<RecvRet, std::string_view> > next()
+    {
+      if (end - begin < sizeof(MsgHeader))
+        return std::nullopt;
+      MsgHeader header{};
+      std::memcpy(&header, buf.data() + begin, sizeof(MsgHeader));
+      if (ntohs(header.version) != PROTOCOL_VERSION)
+        return std::tuple{RecvRet::invalid, std::string_view{}};
+      if (ntohl(header.magic) != HEADER_MAGIC)
+      {
+        if (ntohl(header.magic) == SHUTDOWN_MAGIC)
+          return std::tuple{RecvRet::shutdown, std::string_view{}};
+        return std::tuple{RecvRet::invalid, std::string_view{}};
+      }
+      size_t length = ntohl(header.content_length);
+      if (length > max_packet_size)
+        return std::tuple{RecvRet::invalid, std::string_view{}};
+      if (end - begin < sizeof(MsgHeader) + length)
+        return std::nullopt;
+      std::string_view content{buf.data() + begin + sizeof(MsgHeader), length};
+      begin += sizeof(MsgHeader) + length;
+      if (begin == end)
+        begin = end = 0;
+      return std::tuple{RecvRet::ok, content};
+    }
 
-    return {RecvRet::ok, ret};
-  }
+    // next() has something to return, a packet or an error.
+    [[nodiscard]] bool has_packet() const { return end - begin >= packet_size(); }
+
+  private:
+    // The size of the packet at begin as far as known.
+    [[nodiscard]] size_t packet_size() const
+    {
+      if (end - begin < sizeof(MsgHeader))
+        return sizeof(MsgHeader);
+      MsgHeader header{};
+      std::memcpy(&header, buf.data() + begin, sizeof(MsgHeader));
+      return sizeof(MsgHeader) + (std::min<size_t>)(ntohl(header.content_length), max_packet_size);
+    }
+  };
 
   inline void tank_close(Socket_t fd)
   {
@@ -264,33 +399,243 @@ namespace czh::utils
 #endif
   }
 
+  // Readiness of the server's sockets. A socket is reported once, and not again until
+  // it is rearmed, so that only one pool thread at a time reads a connection.
+#ifdef TANK_USE_EPOLL
+  class Poller
+  {
+  private:
+    int epfd;
+    int wakefd; // An eventfd, written by wake()
+
+  public:
+    Poller() : epfd(epoll_create1(EPOLL_CLOEXEC)), wakefd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+      if (epfd < 0 || wakefd < 0)
+        throw std::runtime_error(std::format("epoll: {}", strerror(errno)));
+      epoll_event ev{};
+      ev.events = EPOLLIN;
+      ev.data.fd = wakefd;
+      epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+    }
+
+    ~Poller()
+    {
+      ::close(wakefd);
+      ::close(epfd);
+    }
+
+    Poller(const Poller&) = delete;
+
+    Poller& operator=(const Poller&) = delete;
+
+    void add(Socket_t fd)
+    {
+      epoll_event ev{};
+      ev.events = EPOLLIN | EPOLLONESHOT;
+      ev.data.fd = fd;
+      epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void rearm(Socket_t fd)
+    {
+      epoll_event ev{};
+      ev.events = EPOLLIN | EPOLLONESHOT;
+      ev.data.fd = fd;
+      epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+    }
+
+    void remove(Socket_t fd) { epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr); }
+
+    // Interrupts wait().
+    void wake()
+    {
+      uint64_t one = 1;
+      [[maybe_unused]] auto r = ::write(wakefd, &one, sizeof(one));
+    }
+
+    // Blocks until some sockets are readable or wake() is called. Returns -1 on error.
+    int wait(std::vector<Socket_t>& ready)
+    {
+      std::array<epoll_event, 256> events{};
+      int n = epoll_wait(epfd, events.data(), static_cast<int>(events.size()), -1);
+      if (n < 0)
+        return errno == EINTR ? 0 : -1;
+      for (int i = 0; i < n; ++i)
+      {
+        Socket_t fd = events[i].data.fd;
+        if (fd == wakefd)
+        {
+          uint64_t count;
+          [[maybe_unused]] auto r = ::read(wakefd, &count, sizeof(count));
+        }
+        else
+          ready.emplace_back(fd);
+      }
+      return 0;
+    }
+  };
+#else
+  class Poller
+  {
+  private:
+    std::mutex poller_mtx;
+    std::set<Socket_t> armed;
+#ifndef _WIN32
+    int wake_pipe[2];
+#endif
+
+  public:
+    Poller()
+    {
+#ifndef _WIN32
+      if (::pipe(wake_pipe) != 0)
+        throw std::runtime_error(std::format("pipe(): {}", strerror(errno)));
+      fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+      fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+#endif
+    }
+
+    ~Poller()
+    {
+#ifndef _WIN32
+      ::close(wake_pipe[0]);
+      ::close(wake_pipe[1]);
+#endif
+    }
+
+    Poller(const Poller&) = delete;
+
+    Poller& operator=(const Poller&) = delete;
+
+    void add(Socket_t fd)
+    {
+      //
+      {
+        std::lock_guard l(poller_mtx);
+        armed.insert(fd);
+      }
+      wake();
+    }
+
+    void rearm(Socket_t fd) { add(fd); }
+
+    void remove(Socket_t fd)
+    {
+      std::lock_guard l(poller_mtx);
+      armed.erase(fd);
+    }
+
+    // Interrupts wait(). On Windows, wait() polls every millisecond instead.
+    void wake()
+    {
+#ifndef _WIN32
+      char c = 0;
+      [[maybe_unused]] auto r = ::write(wake_pipe[1], &c, 1);
+#endif
+    }
+
+    int wait(std::vector<Socket_t>& ready)
+    {
+      fd_set sockets;
+      FD_ZERO(&sockets);
+      int maxfd = 0;
+      //
+      {
+        std::lock_guard l(poller_mtx);
+        for (const auto& r : armed)
+          FD_SET(r, &sockets);
+        if (!armed.empty())
+          maxfd = static_cast<int>(*armed.rbegin());
+      }
+#ifdef _WIN32
+      timeval timeout{.tv_sec = 0, .tv_usec = 1000};
+      int in_socket = ::select(maxfd + 1, &sockets, nullptr, nullptr, &timeout);
+#else
+      FD_SET(wake_pipe[0], &sockets);
+      maxfd = (std::max)(maxfd, wake_pipe[0]);
+      int in_socket = ::select(maxfd + 1, &sockets, nullptr, nullptr, nullptr);
+#endif
+      if (in_socket < 0)
+        return errno == EINTR ? 0 : -1;
+#ifndef _WIN32
+      if (FD_ISSET(wake_pipe[0], &sockets))
+      {
+        char buf[64];
+        while (::read(wake_pipe[0], buf, sizeof(buf)) > 0);
+      }
+#endif
+      std::lock_guard l(poller_mtx);
+      for (auto it = armed.begin(); it != armed.end();)
+      {
+        if (FD_ISSET(*it, &sockets))
+        {
+          ready.emplace_back(*it);
+          it = armed.erase(it);
+        }
+        else
+          ++it;
+      }
+      return 0;
+    }
+  };
+#endif
+
   class TCPServer
   {
   private:
-    bool running;
-    Thpool pool;
+    // Requests answered in one turn of a connection. The others wait for its next turn, after
+    // the tasks queued meanwhile, so that a flood of pipelined requests can't hold a pool thread.
+    static constexpr size_t max_batched_requests = 64;
+
+    struct Connection
+    {
+      bool busy{false}; // Being read and answered by a pool thread
+      RecvBuffer in;
+    };
+
+    std::atomic<bool> running;
+    Thpool pool; // Its tasks block on sockets and the game's locks, so it has more threads than cores.
     Socket_t listening_socket;
-    std::set<Socket_t> free_sockets;
-    std::mutex free_mtx;
-    std::function<std::string(Socket_t, const std::string &)> router;
+    Poller poller;
+    std::map<Socket_t, Connection> connections;
+    std::mutex connections_mtx;
+    std::function<std::string(Socket_t, std::string_view)> router;
     std::function<void(Socket_t)> on_closed;
     std::function<void(Socket_t)> on_closed_unexpectedly;
+    size_t max_request_size;
 
   public:
-    explicit TCPServer(const std::function<std::string(Socket_t, const std::string &)> &router_,
+    // Clients only send small requests.
+    static constexpr size_t default_max_request_size = 1024 * 1024;
+
+    explicit TCPServer(const std::function<std::string(Socket_t, std::string_view)> &router_,
                        const std::function<void(Socket_t)> &on_closed_,
-                       const std::function<void(Socket_t)> &on_closed_unexpectedly_) :
-        running(true), pool(8),
+                       const std::function<void(Socket_t)> &on_closed_unexpectedly_,
+                       size_t max_request_size_ = default_max_request_size) :
+        running(true), pool((std::max)(Thpool::default_size(), size_t{8})),
 #ifdef _WIN32
         listening_socket(INVALID_SOCKET),
 #else
         listening_socket(-1),
 #endif
-        router(router_), on_closed(on_closed_), on_closed_unexpectedly(on_closed_unexpectedly_)
+        router(router_), on_closed(on_closed_), on_closed_unexpectedly(on_closed_unexpectedly_),
+        max_request_size(max_request_size_)
     {
     }
 
-    void stop() { running = false; }
+    // The pool's tasks use the members below it, they must finish first.
+    ~TCPServer() { pool.stop(); }
+
+    TCPServer(const TCPServer &) = delete;
+
+    TCPServer &operator=(const TCPServer &) = delete;
+
+    void stop()
+    {
+      running = false;
+      poller.wake();
+    }
 
     void bind_and_listen(int port)
     {
@@ -327,7 +672,7 @@ namespace czh::utils
 #endif
       }
 
-      if (::listen(listening_socket, 5) != 0)
+      if (::listen(listening_socket, SOMAXCONN) != 0)
       {
         tank_close(listening_socket);
 #ifdef _WIN32
@@ -342,164 +687,200 @@ namespace czh::utils
 
     void start()
     {
-      free_sockets.insert(listening_socket);
-      timeval timeout{};
-      timeout.tv_sec = 0;
-      timeout.tv_usec = 100;
-      while (true)
+      poller.add(listening_socket);
+      std::vector<Socket_t> ready;
+      while (running)
       {
-        fd_set sockets;
-        FD_ZERO(&sockets);
-        int maxfd;
-        //
-        {
-          std::lock_guard l(free_mtx);
-          for (const auto &r : free_sockets)
-            FD_SET(r, &sockets);
-          maxfd = static_cast<int>(*std::prev(std::end(free_sockets)));
-        }
-        int in_socket = ::select(maxfd + 1, &sockets, nullptr, nullptr, &timeout);
-        if (in_socket < 0)
+        ready.clear();
+        if (poller.wait(ready) != 0)
         {
           tank_close(listening_socket);
 #ifdef _WIN32
           char buf[256];
           strerror_s(buf, sizeof(buf), errno);
-          throw std::runtime_error(std::format("select(): {}", buf));
+          throw std::runtime_error(std::format("poll: {}", buf));
 #else
-          throw std::runtime_error(std::format("select(): {}", strerror(errno)));
+          throw std::runtime_error(std::format("poll: {}", strerror(errno)));
 #endif
         }
-        else if (in_socket > 0)
+        for (auto fd : ready)
         {
-          for (int eventfd = 0; eventfd <= maxfd; ++eventfd)
+          if (fd == listening_socket)
           {
-            if (FD_ISSET(eventfd, &sockets))
-            {
-              if (eventfd == listening_socket)
-              {
-                sockaddr_in client_addr{};
+            accept_connection();
+            poller.rearm(listening_socket);
+          }
+          else
+            handle(fd);
+        }
+      }
+
+      std::lock_guard l(connections_mtx);
+      poller.remove(listening_socket);
+      tank_close(listening_socket);
+      // The busy ones are closed by their pool thread. (see finish())
+      for (auto it = connections.begin(); it != connections.end();)
+      {
+        if (it->second.busy)
+        {
+          ++it;
+          continue;
+        }
+        poller.remove(it->first);
+        send_shutdown_packet(it->first);
+        tank_shutdown(it->first);
+        tank_close(it->first);
+        it = connections.erase(it);
+      }
+    }
+
+  private:
+    void accept_connection()
+    {
+      sockaddr_in client_addr{};
 #ifdef _WIN32
-                int addrlen = sizeof(client_addr);
+      int addrlen = sizeof(client_addr);
 #else
-                socklen_t addrlen = sizeof(client_addr);
+      socklen_t addrlen = sizeof(client_addr);
 #endif
-                Socket_t client_socket =
-                    ::accept(listening_socket, reinterpret_cast<struct sockaddr *>(&client_addr), &addrlen);
+      Socket_t client_socket =
+          ::accept(listening_socket, reinterpret_cast<struct sockaddr *>(&client_addr), &addrlen);
 
 #ifdef _WIN32
-                if (client_socket == INVALID_SOCKET)
-                  continue;
+      if (client_socket == INVALID_SOCKET)
+        return;
 #else
-                if (client_socket < 0)
-                  continue;
+      if (client_socket < 0)
+        return;
 #endif
 
 #ifdef _WIN32
-                tcp_keepalive kavars{};
-                tcp_keepalive alive_out{};
-                kavars.onoff = TRUE;
-                kavars.keepalivetime = 3000;
-                kavars.keepaliveinterval = 1000;
-                int alive = 1;
-                setsockopt(client_socket, SOL_SOCKET, SO_KEEPALIVE, reinterpret_cast<const char *>(&alive),
-                           sizeof alive);
-                unsigned long ulBytesReturn = 0;
-                WSAIoctl(client_socket, SIO_KEEPALIVE_VALS, &kavars, sizeof(kavars), &alive_out, sizeof(alive_out),
-                         &ulBytesReturn, nullptr, nullptr);
+      tcp_keepalive kavars{};
+      tcp_keepalive alive_out{};
+      kavars.onoff = TRUE;
+      kavars.keepalivetime = 3000;
+      kavars.keepaliveinterval = 1000;
+      int alive = 1;
+      setsockopt(client_socket, SOL_SOCKET, SO_KEEPALIVE, reinterpret_cast<const char *>(&alive),
+                 sizeof alive);
+      unsigned long ulBytesReturn = 0;
+      WSAIoctl(client_socket, SIO_KEEPALIVE_VALS, &kavars, sizeof(kavars), &alive_out, sizeof(alive_out),
+               &ulBytesReturn, nullptr, nullptr);
 #else
-                int keepalive = 1;
-                int keepidle = 3;
-                int keepcnt = 2;
-                int keepintvl = 1;
-                setsockopt(client_socket, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
-                setsockopt(client_socket, SOL_TCP, TCP_KEEPIDLE, &keepidle, sizeof(keepidle));
-                setsockopt(client_socket, SOL_TCP, TCP_KEEPCNT, &keepcnt, sizeof(keepcnt));
-                setsockopt(client_socket, SOL_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(keepintvl));
-#endif
-
-                //
-                {
-                  std::lock_guard l(free_mtx);
-                  free_sockets.emplace(client_socket);
-                }
-              }
-              else
-              {
-                char buf[1];
-                //
-                {
-                  std::lock_guard l(free_mtx);
-                  free_sockets.erase(eventfd);
-                }
-                if (auto ret = ::recv(eventfd, buf, sizeof(buf), MSG_PEEK); (ret < 0 && errno != EAGAIN) || ret == 0)
-                {
-                  on_closed_unexpectedly(eventfd);
-                  tank_close(eventfd);
-                }
-                else
-                {
-                  pool.add_task(
-                      [this, eventfd]
-                      {
-                        auto [err, content] = receive_packet(eventfd);
-                        if (err == RecvRet::ok)
-                        {
-                          auto res = router(eventfd, content);
-                          if (!res.empty())
-                            send_packet(eventfd, res);
-                          //
-                          {
-                            std::lock_guard l(free_mtx);
-                            free_sockets.emplace(eventfd);
-                          }
-                        }
-                        else if (err == RecvRet::failed)
-                        {
-                          on_closed_unexpectedly(eventfd);
-                          tank_close(eventfd);
-                        }
-                        else if (err == RecvRet::shutdown)
-                        {
-                          on_closed(eventfd);
-                          tank_shutdown(eventfd);
-                          tank_close(eventfd);
-                        }
-                      });
-                }
-              }
-            }
-          }
-        }
-        if (!running)
-          break;
-      } // while
+      int keepalive = 1;
+      int keepidle = 3;
+      int keepcnt = 2;
+      int keepintvl = 1;
+      setsockopt(client_socket, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+      setsockopt(client_socket, SOL_TCP, TCP_KEEPIDLE, &keepidle, sizeof(keepidle));
+      setsockopt(client_socket, SOL_TCP, TCP_KEEPCNT, &keepcnt, sizeof(keepcnt));
+      setsockopt(client_socket, SOL_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(keepintvl));
+#endif
 
+      std::lock_guard l(connections_mtx);
+      connections.emplace(client_socket, Connection{.in = RecvBuffer(max_request_size)});
+      poller.add(client_socket);
+    }
+
+    // A connection is readable. It isn't reported again until finish() rearms it.
+    void handle(Socket_t fd)
+    {
+      RecvBuffer *in;
+      //
       {
-        std::lock_guard l(free_mtx);
-        for (const Socket_t &fd : free_sockets)
+        std::lock_guard l(connections_mtx);
+        auto &conn = connections[fd];
+        conn.busy = true;
+        in = &conn.in;
+      }
+      pool.add_task([this, fd, in] { serve(fd, in, true); });
+    }
+
+    // Answers up to max_batched_requests of the requests received, after one recv() if `receive`.
+    void serve(Socket_t fd, RecvBuffer *in, bool receive)
+    {
+      if (receive && in->fill(fd) != RecvRet::ok)
+      {
+        on_closed_unexpectedly(fd);
+        close_connection(fd);
+        return;
+      }
+      // The requests received are answered together, in one write. A partial one waits
+      // in the buffer for the rest.
+      OutBuffer out;
+      for (size_t i = 0; i < max_batched_requests; ++i)
+      {
+        auto packet = in->next();
+        if (!packet.has_value())
+          break;
+        auto [err, content] = *packet;
+        if (err == RecvRet::invalid)
         {
-          if (fd == listening_socket)
-            tank_close(listening_socket);
-          else
-          {
-            send_shutdown_packet(fd);
-            tank_shutdown(fd);
-            tank_close(fd);
-          }
+          on_closed_unexpectedly(fd);
+          close_connection(fd);
+          return;
+        }
+        else if (err == RecvRet::shutdown)
+        {
+          on_closed(fd);
+          tank_shutdown(fd);
+          close_connection(fd);
+          return;
         }
-        free_sockets.clear();
+        auto res = router(fd, content);
+        if (!res.empty())
+          out.add(std::move(res));
       }
+      out.flush(fd);
+      // Already received, the poller wouldn't report them.
+      if (in->has_packet())
+        pool.add_task([this, fd, in] { serve(fd, in, false); });
+      else
+        finish(fd);
+    }
+
+    // The request was answered, wait for the next one.
+    void finish(Socket_t fd)
+    {
+      std::lock_guard l(connections_mtx);
+      if (!running)
+      {
+        send_shutdown_packet(fd);
+        tank_shutdown(fd);
+        poller.remove(fd);
+        tank_close(fd);
+        connections.erase(fd);
+        return;
+      }
+      connections[fd].busy = false;
+      poller.rearm(fd);
+    }
+
+    void close_connection(Socket_t fd)
+    {
+      std::lock_guard l(connections_mtx);
+      poller.remove(fd);
+      tank_close(fd);
+      connections.erase(fd);
     }
   };
 
   class TCPClient
   {
   private:
-    Socket_t sock;
+#ifdef _WIN32
+    Socket_t sock{INVALID_SOCKET};
+#else
+    Socket_t sock{-1};
+#endif
+    RecvBuffer in;
 
   public:
-    TCPClient() = default;
+    explicit TCPClient(size_t max_packet_size = default_max_packet_size) : in(max_packet_size) {}
+
+    TCPClient(const TCPClient&) = delete;
+
+    TCPClient& operator=(const TCPClient&) = delete;
 
     void init()
     {
@@ -532,34 +913,50 @@ namespace czh::utils
 
     ~TCPClient() { disconnect(); }
 
-    void disconnect() const
+    // Closes the connection, if not yet.
+    void disconnect()
     {
+#ifdef _WIN32
+      if (sock == INVALID_SOCKET)
+        return;
+#else
+      if (sock < 0)
+        return;
+#endif
       send_shutdown_packet(sock);
       tank_shutdown(sock);
       tank_close(sock);
+#ifdef _WIN32
+      sock = INVALID_SOCKET;
+#else
+      sock = -1;
+#endif
     }
 
+    [[nodiscard]] Socket_t get_socket() const { return sock; }
+
+    // Makes a recv() blocked in another thread fail. disconnect() is still needed.
+    void interrupt() const { tank_shutdown(sock); }
+
     [[nodiscard]] int send(const std::string &str) const { return send_packet(sock, str); }
 
-    [[nodiscard]] std::tuple<RecvRet, std::string> recv() const
+    // Blocks until a whole packet is received. The view is valid until the next receive.
+    // On failure, the connection is left to disconnect().
+    [[nodiscard]] std::tuple<RecvRet, std::string_view> recv()
     {
-      auto ret = receive_packet(sock);
-      auto [err, content] = ret;
-      if (err == RecvRet::shutdown || err == RecvRet::failed)
+      while (true)
       {
-        tank_shutdown(sock);
-        tank_close(sock);
+        if (auto packet = in.next(); packet.has_value())
+          return *packet;
+        if (in.fill(sock) != RecvRet::ok)
+          return {RecvRet::failed, {}};
       }
-      return ret;
     }
 
-    [[nodiscard]] std::tuple<RecvRet, std::string> send_and_recv(const std::string &str) const
-    {
-      int ret = send(str);
-      if (ret != 0)
-        return {RecvRet::failed, ""};
-      return recv();
-    }
+    // For a readable socket: one recv() of what is available, whose packets are then taken by next().
+    [[nodiscard]] RecvRet receive() { return in.fill(sock); }
+
+    [[nodiscard]] std::optional<std::tuple<RecvRet, std::string_view> > next() { return in.next(); }
   };
 } // namespace czh::utils
 #endif
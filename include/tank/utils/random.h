@@ -0,0 +1,142 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef TANK_RANDOM_H
+#define TANK_RANDOM_H
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <random>
+
+namespace czh::utils
+{
+  inline uint64_t splitmix64(uint64_t& x)
+  {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+
+  // xoshiro256** (https://prng.di.unimi.it/)
+  // 32 bytes of state and a few cycles per number. Trivially copyable, so it can be archived as is.
+  class Xoshiro256
+  {
+  public:
+    using result_type = uint64_t;
+
+  private:
+    uint64_t s[4];
+
+  public:
+    Xoshiro256() : Xoshiro256(0) {}
+
+    explicit Xoshiro256(uint64_t seed_) { seed(seed_); }
+
+    // An independent stream for each id, e.g. each tank, derived from the same seed.
+    Xoshiro256(uint64_t seed_, uint64_t stream) { seed(seed_ ^ (stream * 0xd1342543de82ef95ull + 1)); }
+
+    void seed(uint64_t seed_)
+    {
+      for (auto& r : s)
+        r = splitmix64(seed_);
+    }
+
+    static constexpr result_type min() { return 0; }
+
+    static constexpr result_type max() { return (std::numeric_limits<result_type>::max)(); }
+
+    result_type operator()()
+    {
+      const uint64_t result = rotl(s[1] * 5, 7) * 9;
+      const uint64_t t = s[1] << 17;
+      s[2] ^= s[0];
+      s[3] ^= s[1];
+      s[1] ^= s[2];
+      s[0] ^= s[3];
+      s[2] ^= t;
+      s[3] = rotl(s[3], 45);
+      return result;
+    }
+
+  private:
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+  };
+
+  struct WorldRandom
+  {
+    uint64_t seed;
+    Xoshiro256 engine;
+
+    static WorldRandom from_seed(uint64_t seed)
+    {
+      return WorldRandom{.seed = seed, .engine = Xoshiro256{seed}};
+    }
+
+    static WorldRandom from_device()
+    {
+      std::random_device rd;
+      return from_seed((static_cast<uint64_t>(rd()) << 32) | rd());
+    }
+  };
+
+  // The current world's. (see g::World, defined in src/world.cpp)
+  WorldRandom& world_random();
+
+  // The world's stream. Every random number of the simulation that doesn't belong
+  // to a tank comes from it, so that a game can be reproduced from its seed. (see rec::)
+  // Only used with g::mainloop_mtx held.
+  inline Xoshiro256& rand_engine()
+  {
+    return world_random().engine;
+  }
+
+  inline uint64_t rand_seed()
+  {
+    return world_random().seed;
+  }
+
+  inline void seed_rand(uint64_t seed)
+  {
+    world_random() = WorldRandom::from_seed(seed);
+  }
+
+  // A stream split off the world seed, owned by one tank. Tanks never share an engine,
+  // so their decisions don't depend on the order they are made in.
+  inline Xoshiro256 rand_stream(uint64_t id)
+  {
+    return Xoshiro256{rand_seed(), id};
+  }
+
+  // For the interface and anything else outside the simulation.
+  inline Xoshiro256& thread_rng()
+  {
+    thread_local Xoshiro256 engine{(static_cast<uint64_t>(std::random_device{}()) << 32) | std::random_device{}()};
+    return engine;
+  }
+
+  template<typename T, typename Engine>
+  T randnum(T a, T b, Engine& engine) // [a, b)
+  {
+    std::uniform_int_distribution<T> u(a, b - 1);
+    return u(engine);
+  }
+
+  template<typename T>
+  T randnum(T a, T b) // [a, b)
+  {
+    return randnum(a, b, rand_engine());
+  }
+}
+#endif
@@ -0,0 +1,144 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef TANK_SCHEDULER_H
+#define TANK_SCHEDULER_H
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+namespace czh::utils
+{
+  struct TickStats
+  {
+    std::atomic<uint64_t> ticks{0};
+    std::atomic<uint64_t> late_ticks{0}; // started noticeably after its deadline
+    std::atomic<uint64_t> overruns{0}; // work took longer than one tick
+    std::atomic<uint64_t> catch_up_steps{0}; // extra steps run to make up for late ticks
+    std::atomic<uint64_t> dropped_steps{0}; // steps given up because catch-up was bounded
+    std::atomic<int64_t> last_cost{0}; // ns
+    std::atomic<int64_t> max_cost{0}; // ns
+    std::atomic<int64_t> total_cost{0}; // ns
+
+    void reset()
+    {
+      ticks = 0;
+      late_ticks = 0;
+      overruns = 0;
+      catch_up_steps = 0;
+      dropped_steps = 0;
+      last_cost = 0;
+      max_cost = 0;
+      total_cost = 0;
+    }
+  };
+
+  // Fixed-timestep scheduler based on steady_clock deadlines.
+  // Deadlines advance by exactly one tick, so neither sleeping jitter nor
+  // the cost of a tick accumulates into drift.
+  class TickScheduler
+  {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+  private:
+    Clock::time_point deadline;
+    Clock::time_point work_begin;
+    Clock::duration tick;
+    bool started;
+    TickStats stats;
+
+#ifdef _WIN32
+    static constexpr auto spin_threshold = std::chrono::microseconds(2000);
+#else
+    static constexpr auto spin_threshold = std::chrono::microseconds(1000);
+#endif
+    static constexpr auto late_threshold = std::chrono::microseconds(1000);
+
+  public:
+    TickScheduler() : tick(std::chrono::milliseconds(16)), started(false)
+    {
+    }
+
+    // Waits for the next deadline and returns how many simulation steps are due.
+    // At most 1 + max_catch_up steps are returned, the rest are counted as dropped.
+    size_t wait_next(Clock::duration tick_, size_t max_catch_up)
+    {
+      wait_until(next_deadline(tick_));
+      return take_due(max_catch_up);
+    }
+
+    // The two halves of wait_next(), for callers that wait for many schedulers at once.
+    [[nodiscard]] Clock::time_point next_deadline(Clock::duration tick_)
+    {
+      if (!started || tick_ != tick)
+      {
+        tick = tick_;
+        deadline = Clock::now();
+        started = true;
+      }
+      return deadline;
+    }
+
+    // The steps due once next_deadline() has passed.
+    size_t take_due(size_t max_catch_up)
+    {
+      auto now = Clock::now();
+      auto lateness = now - deadline;
+      size_t missed = tick.count() > 0 ? static_cast<size_t>(lateness / tick) : 0;
+      size_t steps = 1 + (std::min)(missed, max_catch_up);
+
+      if (lateness > late_threshold)
+        ++stats.late_ticks;
+      stats.catch_up_steps += steps - 1;
+      stats.dropped_steps += missed - (steps - 1);
+
+      // Skip the deadlines we gave up on instead of trying to run them later.
+      deadline += tick * static_cast<Clock::rep>(missed + 1);
+      work_begin = now;
+      return steps;
+    }
+
+    // Marks the end of the work started by the last wait_next().
+    void finish(size_t steps = 1)
+    {
+      auto cost = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - work_begin).count();
+      stats.ticks += steps;
+      stats.last_cost = cost;
+      stats.total_cost += cost;
+      if (cost > stats.max_cost)
+        stats.max_cost = cost;
+      if (cost > std::chrono::duration_cast<std::chrono::nanoseconds>(tick).count())
+        ++stats.overruns;
+    }
+
+    [[nodiscard]] const TickStats& get_stats() const { return stats; }
+
+    TickStats& get_stats() { return stats; }
+
+    // Sleeps most of the way, then yields until the deadline for sub-millisecond accuracy.
+    static void wait_until(Clock::time_point tp)
+    {
+      auto now = Clock::now();
+      if (tp - now > spin_threshold)
+        std::this_thread::sleep_until(tp - spin_threshold);
+      while (Clock::now() < tp)
+        std::this_thread::yield();
+    }
+  };
+}
+#endif
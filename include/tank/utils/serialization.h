@@ -17,22 +17,48 @@
 #include <type_traits>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <map>
+#include <memory>
+#include <optional>
 #include <iterator>
 #include <tuple>
 #include <array>
+#include <algorithm>
 #include <cstring>
 
 namespace czh::utils
 {
   template<typename T>
-  std::decay_t<T> deserialize(const std::string& str);
+  std::decay_t<T> deserialize(std::string_view str);
 
   template<typename T>
   std::string serialize(const T& item);
 
+  // Data serialized before, written as it is, one piece after another. It stands for the value it
+  // was serialized from, so that the parts of messages shared by many are serialized only once.
+  struct Serialized
+  {
+    std::vector<std::shared_ptr<const std::string> > pieces;
+  };
+
   namespace details
   {
+    // Set when deserialize() finds its input shorter than what it describes. (see try_deserialize())
+    inline thread_local bool malformed = false;
+
+    // str.substr(pos, n), but cut at the end of str instead of throwing.
+    inline std::string_view checked_substr(std::string_view str, size_t pos, size_t n)
+    {
+      if (pos > str.size() || n > str.size() - pos)
+      {
+        malformed = true;
+        pos = (std::min)(pos, str.size());
+        n = str.size() - pos;
+      }
+      return str.substr(pos, n);
+    }
+
     struct Any
     {
       template<typename T>
@@ -168,6 +194,8 @@ namespace czh::utils
     struct enum_tag {};
     struct container_tag {};
     struct string_tag {};
+    struct string_view_tag {};
+    struct serialized_tag {};
     struct map_tag {};
     struct array_tag {};
     struct struct_tag {};
@@ -227,6 +255,8 @@ namespace czh::utils
       else if constexpr(std::is_integral_v<R>) return int_tag{};
       else if constexpr(std::is_enum_v<R>) return enum_tag{};
       else if constexpr(std::is_same_v<R, std::string>) return string_tag{};
+      else if constexpr(std::is_same_v<R, std::string_view>) return string_view_tag{};
+      else if constexpr(std::is_same_v<R, Serialized>) return serialized_tag{};
       else if constexpr(is_map_v<R>) return map_tag{};
       else if constexpr(is_serializable_container_v<R>) return container_tag{};
       else if constexpr(is_serializable_struct_v<R> || is_serializable_tuple_like_v<R>) return struct_tag{};
@@ -241,7 +271,7 @@ namespace czh::utils
     std::string internal_serialize(not_implemented_tag, const T &item) = delete;
 
     template<typename T>
-    T internal_deserialize(not_implemented_tag, const std::string &str) = delete;
+    T internal_deserialize(not_implemented_tag, std::string_view str) = delete;
 
     template<typename T>
     std::string internal_serialize(int_tag, const T &item)
@@ -275,7 +305,7 @@ namespace czh::utils
     }
 
     template<typename T>
-    T internal_deserialize(int_tag, const std::string &str)
+    T internal_deserialize(int_tag, std::string_view str)
     {
       if constexpr(sizeof(T) > 1)
       {
@@ -290,6 +320,11 @@ namespace czh::utils
           size_t shift = 0;
           for (auto &c : str)
           {
+            if (shift >= sizeof(T) * 8)
+            {
+              malformed = true;
+              break;
+            }
             result |= static_cast<T>(c & 0x7f) << shift;
             shift += 7;
           }
@@ -309,7 +344,7 @@ namespace czh::utils
     }
 
     template<typename T>
-    T internal_deserialize(enum_tag, const std::string &str)
+    T internal_deserialize(enum_tag, std::string_view str)
     {
       return static_cast<T>(internal_deserialize<std::underlying_type_t<std::remove_cvref_t<T>>>(int_tag{}, str));
     }
@@ -323,10 +358,10 @@ namespace czh::utils
     }
 
     template<typename T>
-    T internal_deserialize(trivially_copy_tag, const std::string &str)
+    T internal_deserialize(trivially_copy_tag, std::string_view str)
     {
-      T item;
-      std::memcpy(&item, str.data(), sizeof(T));
+      T item{};
+      std::memcpy(&item, str.data(), (std::min)(sizeof(T), str.size()));
       return item;
     }
 
@@ -337,11 +372,43 @@ namespace czh::utils
     }
 
     template<typename T>
-    T internal_deserialize(string_tag, const std::string &str)
+    T internal_deserialize(string_tag, std::string_view str)
+    {
+      return T{str};
+    }
+
+    template<typename T>
+    std::string internal_serialize(string_view_tag, const T &item)
+    {
+      return std::string{item};
+    }
+
+    // A view into the deserialized data, which must outlive it.
+    template<typename T>
+    T internal_deserialize(string_view_tag, std::string_view str)
     {
       return str;
     }
 
+    template<typename T>
+    std::string internal_serialize(serialized_tag, const T &item)
+    {
+      size_t size = 0;
+      for (auto &r: item.pieces)
+        size += r->size();
+      std::string ret;
+      ret.reserve(size);
+      for (auto &r: item.pieces)
+        ret += *r;
+      return ret;
+    }
+
+    template<typename T>
+    T internal_deserialize(serialized_tag, std::string_view str)
+    {
+      return T{{std::make_shared<const std::string>(str)}};
+    }
+
     template<typename T>
     std::string internal_serialize(map_tag, const T &item)
     {
@@ -353,7 +420,7 @@ namespace czh::utils
     }
 
     template<typename T>
-    T internal_deserialize(map_tag, const std::string &str)
+    T internal_deserialize(map_tag, std::string_view str)
     {
       auto v = deserialize<std::vector<std::pair<std::remove_cvref_t<typename T::key_type>,
           std::remove_cvref_t<typename T::mapped_type>>>>(str);
@@ -391,12 +458,12 @@ namespace czh::utils
     }
 
     template<typename T>
-    auto item_deserialize_helper(const std::string &str, size_t &pos)
+    auto item_deserialize_helper(std::string_view str, size_t &pos)
     {
       // These types don't need a size indicator.
       if constexpr(tag_is<T, trivially_copy_tag> || (tag_is<T, int_tag> && sizeof(T) == 1))
       {
-        std::string buf = str.substr(pos, sizeof(T));
+        auto buf = checked_substr(str, pos, sizeof(T));
         pos += sizeof(T);
         return deserialize<std::remove_cvref_t<T>>(buf);
       }
@@ -409,7 +476,7 @@ namespace czh::utils
         {
           if ((str[i] & 0x80) == 0) break;
         }
-        std::string buf = str.substr(pos, int_size);
+        auto buf = checked_substr(str, pos, int_size);
         pos += int_size;
 
         if constexpr(tag_is<T, int_tag> || tag_is<T, enum_tag>)
@@ -419,8 +486,8 @@ namespace czh::utils
         else
         {
           auto data_size = deserialize<size_t>(buf);
-          std::string data_buf = str.substr(pos, data_size);
-          pos += data_size;
+          auto data_buf = checked_substr(str, pos, data_size);
+          pos += data_buf.size();
           return deserialize<std::remove_cvref_t<T>>(data_buf);
         }
       }
@@ -437,7 +504,7 @@ namespace czh::utils
     }
 
     template<typename T>
-    T internal_deserialize(container_tag, const std::string &str)
+    T internal_deserialize(container_tag, std::string_view str)
     {
       if (str.empty()) return T{};
       T ret;
@@ -459,7 +526,7 @@ namespace czh::utils
     }
 
     template<typename T>
-    T internal_deserialize(struct_tag, const std::string &str)
+    T internal_deserialize(struct_tag, std::string_view str)
     {
       if (str.empty()) return T{};
       T ret;
@@ -475,7 +542,7 @@ namespace czh::utils
     }
 
     template<typename T>
-    T internal_deserialize(pointer_tag, const std::string &str)
+    T internal_deserialize(pointer_tag, std::string_view str)
     {
       using value_type = std::remove_pointer_t<T>;
       T item = new value_type();
@@ -495,7 +562,7 @@ namespace czh::utils
     }
 
     template<typename T>
-    std::decay_t<T> internal_deserialize(array_tag, const std::string &str)
+    std::decay_t<T> internal_deserialize(array_tag, std::string_view str)
     {
       using value_type = std::remove_extent_t<T>;
       if (str.empty()) return nullptr;
@@ -518,13 +585,25 @@ namespace czh::utils
 
 
   template<typename T>
-  std::decay_t<T> deserialize(const std::string &str)
+  std::decay_t<T> deserialize(std::string_view str)
   {
     static_assert(!details::tag_is<T, details::not_implemented_tag>,
       "This type must overload ser::serialize() and ser::deserialize()");
     return details::internal_deserialize<T>(details::dispatch_tag<T>(), str);
   }
 
+  // An element of a container as serialize() writes it. A container serializes to its elements
+  // one after another, and a std::map to its std::pairs, so they can be put together with Serialized.
+  template<typename T>
+  std::string serialize_element(const T &item)
+  {
+    std::string buf;
+    size_t pos = 0;
+    details::item_serialize_helper(buf, pos, item);
+    buf.resize(pos);
+    return buf;
+  }
+
   template<typename ...Args> requires (sizeof...(Args) > 1)
   std::string serialize(Args&& ...args)
   {
@@ -532,9 +611,39 @@ namespace czh::utils
   }
 
   template<typename ...Args> requires (sizeof...(Args) > 1)
-  std::tuple<Args...> deserialize(const std::string &str)
+  std::tuple<Args...> deserialize(std::string_view str)
   {
     return deserialize<std::tuple<Args...>>(str);
   }
+
+  // deserialize() never reads out of str, but makes what it can of a malformed one.
+  // This is nullopt for those instead, for what comes from the network.
+  template<typename T>
+  std::optional<std::decay_t<T>> try_deserialize(std::string_view str)
+  {
+    details::malformed = false;
+    auto ret = deserialize<T>(str);
+    if (details::malformed)
+      return std::nullopt;
+    return ret;
+  }
+
+  template<typename ...Args> requires (sizeof...(Args) > 1)
+  std::optional<std::tuple<Args...>> try_deserialize(std::string_view str)
+  {
+    return try_deserialize<std::tuple<Args...>>(str);
+  }
+
+  // The first field of a serialized struct or tuple, without deserializing the others.
+  template<typename T>
+  std::optional<std::decay_t<T>> try_deserialize_first(std::string_view str)
+  {
+    details::malformed = false;
+    size_t pos = 0;
+    auto ret = details::item_deserialize_helper<std::decay_t<T>>(str, pos);
+    if (details::malformed)
+      return std::nullopt;
+    return ret;
+  }
 }
 #endif
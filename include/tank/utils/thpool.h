@@ -0,0 +1,285 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef TANK_THPOOL_H
+#define TANK_THPOOL_H
+#pragma once
+
+#include "debug.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace czh::utils
+{
+  // A move-only void() callable. Small ones, like lambdas capturing a few references,
+  // are stored inline, where std::function would allocate.
+  class Task
+  {
+  private:
+    static constexpr size_t inline_size = 48;
+
+    struct Ops
+    {
+      void (*call)(void*);
+      void (*move)(void* from, void* to); // Also destroys `from`
+      void (*destroy)(void*);
+    };
+
+    template<typename F>
+    static constexpr bool fits = sizeof(F) <= inline_size && alignof(F) <= alignof(std::max_align_t)
+                                 && std::is_nothrow_move_constructible_v<F>;
+
+    template<typename F>
+    static constexpr Ops inline_ops{
+      .call = [](void* p) { (*static_cast<F*>(p))(); },
+      .move = [](void* from, void* to)
+      {
+        new(to) F(std::move(*static_cast<F*>(from)));
+        static_cast<F*>(from)->~F();
+      },
+      .destroy = [](void* p) { static_cast<F*>(p)->~F(); }
+    };
+
+    template<typename F>
+    static constexpr Ops heap_ops{
+      .call = [](void* p) { (**static_cast<F**>(p))(); },
+      .move = [](void* from, void* to) { new(to) F*(*static_cast<F**>(from)); },
+      .destroy = [](void* p) { delete *static_cast<F**>(p); }
+    };
+
+    alignas(std::max_align_t) std::byte storage[inline_size];
+    const Ops* ops{nullptr};
+
+  public:
+    Task() = default;
+
+    template<typename F>
+      requires (!std::is_same_v<std::decay_t<F>, Task>) && std::is_invocable_v<std::decay_t<F>&>
+    Task(F&& func)
+    {
+      using D = std::decay_t<F>;
+      if constexpr (fits<D>)
+      {
+        new(storage) D(std::forward<F>(func));
+        ops = &inline_ops<D>;
+      }
+      else
+      {
+        new(storage) D*(new D(std::forward<F>(func)));
+        ops = &heap_ops<D>;
+      }
+    }
+
+    Task(Task&& other) noexcept : ops(other.ops)
+    {
+      if (ops != nullptr)
+      {
+        ops->move(other.storage, storage);
+        other.ops = nullptr;
+      }
+    }
+
+    Task& operator=(Task&& other) noexcept
+    {
+      if (this != &other)
+      {
+        reset();
+        ops = other.ops;
+        if (ops != nullptr)
+        {
+          ops->move(other.storage, storage);
+          other.ops = nullptr;
+        }
+      }
+      return *this;
+    }
+
+    Task(const Task&) = delete;
+
+    Task& operator=(const Task&) = delete;
+
+    ~Task() { reset(); }
+
+    void operator()() { ops->call(storage); }
+
+    explicit operator bool() const { return ops != nullptr; }
+
+  private:
+    void reset()
+    {
+      if (ops != nullptr)
+      {
+        ops->destroy(storage);
+        ops = nullptr;
+      }
+    }
+  };
+
+  // Work-stealing pool. Each worker has its own deque: it takes its newest task from the back,
+  // and when it runs out, steals the oldest ones from the front of the others. Tasks added by
+  // a worker go to its own deque, the others are spread over the workers.
+  class Thpool
+  {
+  private:
+    struct Worker
+    {
+      std::mutex mtx;
+      std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker> > workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> queued{0}; // Added and not taken yet
+    std::atomic<size_t> next{0}; // The worker for the next task added from outside
+    std::atomic<bool> stopping{false};
+
+    // Only for the workers with nothing to do.
+    std::mutex sleep_mtx;
+    std::condition_variable sleep_cond;
+    std::atomic<size_t> sleeping{0};
+
+    struct Current
+    {
+      const Thpool* pool;
+      size_t index;
+    };
+
+    static inline thread_local Current current{nullptr, 0};
+
+  public:
+    // All the hardware threads, but the one adding the tasks.
+    static size_t default_size() { return (std::max)(std::thread::hardware_concurrency(), 2u) - 1; }
+
+    explicit Thpool(size_t size = default_size())
+    {
+      dbg::tank_assert(size != 0, "Thpool needs a thread.");
+      for (size_t i = 0; i < size; ++i)
+        workers.emplace_back(std::make_unique<Worker>());
+      for (size_t i = 0; i < size; ++i)
+        threads.emplace_back([this, i] { work(i); });
+    }
+
+    Thpool(const Thpool&) = delete;
+
+    Thpool& operator=(const Thpool&) = delete;
+
+    ~Thpool() { stop(); }
+
+    template<typename F>
+    void add_task(F&& func)
+    {
+      bool inside = current.pool == this;
+      dbg::tank_assert(inside || !stopping, "Can not add task on stopped Thpool");
+      auto& worker = *workers[inside ? current.index : next.fetch_add(1, std::memory_order_relaxed) % workers.size()];
+      //
+      {
+        std::lock_guard l(worker.mtx);
+        worker.tasks.emplace_back(std::forward<F>(func));
+        // Counted before any thief can take it, and paired with the check of `queued` by a worker
+        // going to sleep.
+        queued.fetch_add(1);
+      }
+      if (sleeping.load() != 0)
+      {
+        //
+        {
+          std::lock_guard l(sleep_mtx);
+        }
+        sleep_cond.notify_one();
+      }
+    }
+
+    // Runs everything added so far, including what those tasks add, then joins the threads.
+    void stop()
+    {
+      //
+      {
+        std::lock_guard l(sleep_mtx);
+        stopping = true;
+      }
+      sleep_cond.notify_all();
+      for (auto& th : threads)
+      {
+        if (th.joinable())
+          th.join();
+      }
+      threads.clear();
+    }
+
+    [[nodiscard]] size_t size() const { return threads.size(); }
+
+  private:
+    void work(size_t index)
+    {
+      current = {this, index};
+      while (true)
+      {
+        if (auto task = take(index); task)
+        {
+          task();
+          continue;
+        }
+        std::unique_lock l(sleep_mtx);
+        sleeping.fetch_add(1);
+        sleep_cond.wait(l, [this] { return queued.load() != 0 || stopping; });
+        sleeping.fetch_sub(1);
+        if (queued.load() == 0 && stopping)
+          return;
+      }
+    }
+
+    Task take(size_t index)
+    {
+      auto pop = [this](Worker& worker, bool own) -> Task
+      {
+        std::lock_guard l(worker.mtx);
+        if (worker.tasks.empty())
+          return {};
+        Task ret;
+        if (own)
+        {
+          ret = std::move(worker.tasks.back());
+          worker.tasks.pop_back();
+        }
+        else
+        {
+          ret = std::move(worker.tasks.front());
+          worker.tasks.pop_front();
+        }
+        queued.fetch_sub(1);
+        return ret;
+      };
+
+      if (auto task = pop(*workers[index], true); task)
+        return task;
+      for (size_t i = 1; i < workers.size(); ++i)
+      {
+        if (auto task = pop(*workers[(index + i) % workers.size()], false); task)
+          return task;
+      }
+      return {};
+    }
+  };
+}
+#endif
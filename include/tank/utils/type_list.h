@@ -125,5 +125,15 @@ namespace czh::utils
 
   template<typename List>
   constexpr size_t size_of_v = size_of<List>::value;
+
+  // A set of lambdas called as one, e.g. for tank::visit.
+  template<typename... Fs>
+  struct Overloaded : Fs...
+  {
+    using Fs::operator()...;
+  };
+
+  template<typename... Fs>
+  Overloaded(Fs...) -> Overloaded<Fs...>;
 }
 #endif
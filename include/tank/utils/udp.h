@@ -0,0 +1,493 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef TANK_UDP_H
+#define TANK_UDP_H
+#pragma once
+
+#include "network.h"
+#include "serialization.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace czh::utils
+{
+  constexpr uint32_t DATAGRAM_MAGIC = HEADER_MAGIC + 8;
+
+  // Bigger messages are split, so that each datagram fits in a common MTU.
+  constexpr size_t max_fragment_size = 1024;
+  constexpr size_t max_fragments = 4096;
+  constexpr size_t max_sequenced_size = max_fragment_size * max_fragments;
+
+  // Redundant messages kept for resending, older ones are given up on.
+  constexpr size_t max_redundant = 8;
+
+  // Loss and latency applied to received datagrams, to test over loopback.
+  struct NetSim
+  {
+    std::atomic<int> loss{0}; // %
+    std::atomic<int> latency{0}; // ms
+    std::atomic<int> jitter{0}; // ms, latency varies by up to this either way, which reorders datagrams
+  };
+
+  inline sockaddr_in make_address(const std::string &ip, int port)
+  {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, ip.c_str(), &addr.sin_addr.s_addr);
+    addr.sin_port = htons(port);
+    return addr;
+  }
+
+  class UDPSocket
+  {
+  private:
+#ifdef _WIN32
+    Socket_t sock{INVALID_SOCKET};
+#else
+    Socket_t sock{-1};
+#endif
+    NetSim *sim;
+    std::minstd_rand rng{std::random_device{}()};
+    // Received ones waiting for their simulated latency, only used by the receiving thread
+    std::multimap<std::chrono::steady_clock::time_point, std::pair<sockaddr_in, std::string> > delayed;
+    std::string buf;
+
+  public:
+    explicit UDPSocket(NetSim *sim_ = nullptr) : sim(sim_), buf(65536, '\0') {}
+
+    ~UDPSocket() { close(); }
+
+    UDPSocket(const UDPSocket&) = delete;
+
+    UDPSocket& operator=(const UDPSocket&) = delete;
+
+    // Binds to the port, 0 for any.
+    void open(int port)
+    {
+      sock = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+#ifdef _WIN32
+      if (sock == INVALID_SOCKET)
+      {
+        char buf[256];
+        strerror_s(buf, sizeof(buf), errno);
+        throw std::runtime_error(std::format("socket(): {}", buf));
+      }
+#else
+      if (sock < 0)
+        throw std::runtime_error(std::format("socket(): {}", strerror(errno)));
+#endif
+      // A frame of many fragments is sent at once.
+      int size = 1 << 20;
+      setsockopt(sock, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char *>(&size), sizeof(size));
+      setsockopt(sock, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char *>(&size), sizeof(size));
+
+      sockaddr_in addr{};
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = INADDR_ANY;
+      addr.sin_port = htons(port);
+      if (::bind(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+      {
+        close();
+#ifdef _WIN32
+        char buf[256];
+        strerror_s(buf, sizeof(buf), errno);
+        throw std::runtime_error(std::format("bind(): {}", buf));
+#else
+        throw std::runtime_error(std::format("bind(): {}", strerror(errno)));
+#endif
+      }
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+      if (sock == INVALID_SOCKET)
+        return;
+      tank_close(sock);
+      sock = INVALID_SOCKET;
+#else
+      if (sock < 0)
+        return;
+      tank_close(sock);
+      sock = -1;
+#endif
+    }
+
+    [[nodiscard]] int send_to(const sockaddr_in &to, const std::string &data) const
+    {
+      auto s = ::sendto(sock, data.data(), static_cast<int>(data.size()), 0,
+                        reinterpret_cast<const sockaddr *>(&to), sizeof(to));
+      return s == static_cast<decltype(s)>(data.size()) ? 0 : -1;
+    }
+
+    // Waits for a datagram for at most timeout. Returns false if none came.
+    bool recv_from(sockaddr_in &from, std::string &data, std::chrono::milliseconds timeout)
+    {
+      auto deadline = std::chrono::steady_clock::now() + timeout;
+      while (true)
+      {
+        auto now = std::chrono::steady_clock::now();
+        if (!delayed.empty() && delayed.begin()->first <= now)
+        {
+          std::tie(from, data) = std::move(delayed.begin()->second);
+          delayed.erase(delayed.begin());
+          return true;
+        }
+        auto until = delayed.empty() ? deadline : (std::min)(deadline, delayed.begin()->first);
+        if (until <= now && until == deadline)
+          return false;
+
+        auto wait = std::chrono::duration_cast<std::chrono::microseconds>(until - now).count();
+        timeval tv{.tv_sec = static_cast<decltype(tv.tv_sec)>(wait / 1000000),
+                   .tv_usec = static_cast<decltype(tv.tv_usec)>(wait % 1000000)};
+        fd_set sockets;
+        FD_ZERO(&sockets);
+        FD_SET(sock, &sockets);
+        if (::select(static_cast<int>(sock) + 1, &sockets, nullptr, nullptr, &tv) <= 0)
+          continue;
+
+        sockaddr_in addr{};
+#ifdef _WIN32
+        int addrlen = sizeof(addr);
+#else
+        socklen_t addrlen = sizeof(addr);
+#endif
+        auto n = ::recvfrom(sock, buf.data(), static_cast<int>(buf.size()), 0,
+                            reinterpret_cast<sockaddr *>(&addr), &addrlen);
+        if (n < 0)
+          continue;
+
+        int latency = 0;
+        if (sim != nullptr)
+        {
+          if (static_cast<int>(rng() % 100) < sim->loss)
+            continue;
+          int jitter = sim->jitter;
+          latency = sim->latency;
+          if (jitter > 0)
+            latency += static_cast<int>(rng() % (2 * jitter + 1)) - jitter;
+        }
+        if (latency <= 0)
+        {
+          from = addr;
+          data.assign(buf.data(), n);
+          return true;
+        }
+        delayed.emplace(std::chrono::steady_clock::now() + std::chrono::milliseconds(latency),
+                        std::make_pair(addr, std::string(buf.data(), n)));
+      }
+    }
+  };
+
+  // The body of a datagram, after a MsgHeader.
+  struct Datagram
+  {
+    uint64_t token; // Which connection it belongs to
+    uint32_t seq;
+    uint32_t ack; // The latest seq received
+    uint32_t reliable_ack; // The reliable messages before it were received
+    uint32_t redundant_ack;
+    uint32_t reliable_first; // The ID of reliable[0]
+    std::vector<std::string> reliable;
+    uint32_t redundant_first;
+    std::vector<std::string> redundant;
+    uint32_t sequenced; // The ID of the message the fragment belongs to, 0 if none
+    uint32_t fragment_index;
+    uint32_t fragment_count;
+    std::string fragment;
+  };
+
+  // What follows the header, if it is one of a datagram.
+  inline std::optional<std::string_view> datagram_body(std::string_view data)
+  {
+    if (data.size() < sizeof(MsgHeader))
+      return std::nullopt;
+    MsgHeader header{};
+    std::memcpy(&header, data.data(), sizeof(MsgHeader));
+    if (ntohl(header.magic) != DATAGRAM_MAGIC || ntohs(header.version) != PROTOCOL_VERSION
+        || ntohl(header.content_length) != data.size() - sizeof(MsgHeader))
+      return std::nullopt;
+    return data.substr(sizeof(MsgHeader));
+  }
+
+  // Only the token, to find the connection before parsing the rest.
+  inline std::optional<uint64_t> datagram_token(std::string_view data)
+  {
+    auto body = datagram_body(data);
+    if (!body.has_value())
+      return std::nullopt;
+    return try_deserialize_first<uint64_t>(*body);
+  }
+
+  // Anyone can send datagrams, malformed ones are nullopt.
+  inline std::optional<Datagram> parse_datagram(std::string_view data)
+  {
+    auto body = datagram_body(data);
+    if (!body.has_value())
+      return std::nullopt;
+    return try_deserialize<Datagram>(*body);
+  }
+
+  enum class Channel
+  {
+    reliable, redundant, sequenced
+  };
+
+  struct Delivery
+  {
+    Channel channel;
+    uint32_t id;
+    std::string data;
+  };
+
+  // The reliability layer of a UDP connection, kept by both ends. Messages are sent on one of
+  // three channels, each delivered in order and at most once:
+  //   - reliable: resent until acked, never lost. (commands, chat messages)
+  //   - redundant: the latest few unacked ones are in every datagram, older ones may be lost. (inputs)
+  //   - sequenced: sent once in fragments, anything older than the last one delivered is dropped. (frames)
+  // Every datagram carries its sequence number and the latest one received, which gives the RTT.
+  class UDPConnection
+  {
+  private:
+    using clock = std::chrono::steady_clock;
+
+    std::mutex mtx;
+    uint64_t token;
+    std::optional<sockaddr_in> peer;
+    clock::time_point last_received;
+
+    uint32_t next_seq{1};
+    uint32_t peer_seq{0};
+    uint32_t acked_seq{0};
+    std::array<clock::time_point, 256> sent_at{}; // By seq
+    std::chrono::microseconds rtt{std::chrono::milliseconds(100)}; // Smoothed
+
+    // Sending
+    uint32_t reliable_first{1}; // The ID of reliable_out[0]
+    std::deque<std::string> reliable_out; // Not acked yet
+    size_t reliable_unsent{0}; // The first in reliable_out that was never sent
+    clock::time_point reliable_sent; // When all of reliable_out was last sent
+    uint32_t redundant_first{1};
+    std::deque<std::string> redundant_out;
+    uint32_t next_sequenced{1};
+
+    // Receiving
+    uint32_t reliable_in{1}; // The next one to deliver
+    uint32_t redundant_in{1};
+    uint32_t sequenced_in{0}; // The last one delivered
+    uint32_t assembling{0};
+    std::vector<std::optional<std::string> > fragments;
+    size_t fragments_left{0};
+
+  public:
+    explicit UDPConnection(uint64_t token_, std::optional<sockaddr_in> peer_ = std::nullopt)
+      : token(token_), peer(peer_), last_received(clock::now())
+    {
+    }
+
+    [[nodiscard]] uint64_t get_token() const { return token; }
+
+    // Where the latest datagram came from, if any.
+    [[nodiscard]] std::optional<sockaddr_in> get_peer()
+    {
+      std::lock_guard l(mtx);
+      return peer;
+    }
+
+    [[nodiscard]] clock::duration since_received()
+    {
+      std::lock_guard l(mtx);
+      return clock::now() - last_received;
+    }
+
+    [[nodiscard]] std::chrono::milliseconds get_rtt()
+    {
+      std::lock_guard l(mtx);
+      return std::chrono::duration_cast<std::chrono::milliseconds>(rtt);
+    }
+
+    void send_reliable(std::string data)
+    {
+      std::lock_guard l(mtx);
+      reliable_out.emplace_back(std::move(data));
+    }
+
+    void send_redundant(std::string data)
+    {
+      std::lock_guard l(mtx);
+      redundant_out.emplace_back(std::move(data));
+      if (redundant_out.size() > max_redundant)
+      {
+        redundant_out.pop_front();
+        ++redundant_first;
+      }
+    }
+
+    // The datagrams to send now: the pending reliable and redundant messages, and the
+    // sequenced one if given, in as many datagrams as its fragments. Nothing if the
+    // sequenced one is bigger than max_sequenced_size.
+    std::optional<std::vector<std::string> > make_datagrams(const std::string *sequenced = nullptr)
+    {
+      if (sequenced != nullptr && sequenced->size() > max_sequenced_size)
+        return std::nullopt;
+      std::lock_guard l(mtx);
+      auto now = clock::now();
+      std::vector<std::string> ret;
+
+      Datagram first = make_header(now);
+      // The unacked ones are resent if they aren't acked in about an RTT, new ones are sent at once.
+      auto rto = (std::max)(rtt * 2, std::chrono::microseconds(std::chrono::milliseconds(50)));
+      size_t begin = now - reliable_sent >= rto ? 0 : reliable_unsent;
+      size_t bytes = 0;
+      for (size_t i = begin; i < reliable_out.size() && (i == begin || bytes < max_fragment_size); ++i)
+      {
+        bytes += reliable_out[i].size();
+        first.reliable.emplace_back(reliable_out[i]);
+      }
+      if (!first.reliable.empty())
+      {
+        first.reliable_first = reliable_first + static_cast<uint32_t>(begin);
+        reliable_unsent = (std::max)(reliable_unsent, begin + first.reliable.size());
+        if (begin == 0)
+          reliable_sent = now;
+      }
+      first.redundant_first = redundant_first;
+      first.redundant = {redundant_out.begin(), redundant_out.end()};
+
+      if (sequenced == nullptr)
+      {
+        ret.emplace_back(encode(first));
+        return ret;
+      }
+      auto id = next_sequenced++;
+      auto count = (std::max<size_t>)(1, (sequenced->size() + max_fragment_size - 1) / max_fragment_size);
+      for (size_t i = 0; i < count; ++i)
+      {
+        Datagram d = i == 0 ? std::move(first) : make_header(now);
+        d.sequenced = id;
+        d.fragment_index = static_cast<uint32_t>(i);
+        d.fragment_count = static_cast<uint32_t>(count);
+        d.fragment = sequenced->substr(i * max_fragment_size, max_fragment_size);
+        ret.emplace_back(encode(d));
+      }
+      return ret;
+    }
+
+    // Appends what the datagram completes to out.
+    void receive(const sockaddr_in &from, Datagram d, std::vector<Delivery> &out)
+    {
+      std::lock_guard l(mtx);
+      auto now = clock::now();
+      peer = from;
+      last_received = now;
+      peer_seq = (std::max)(peer_seq, d.seq);
+
+      if (d.ack > acked_seq && next_seq - d.ack <= sent_at.size())
+      {
+        acked_seq = d.ack;
+        auto sample = std::chrono::duration_cast<std::chrono::microseconds>(now - sent_at[d.ack % sent_at.size()]);
+        rtt = (rtt * 7 + sample) / 8;
+      }
+      while (!reliable_out.empty() && reliable_first < d.reliable_ack)
+      {
+        reliable_out.pop_front();
+        ++reliable_first;
+        if (reliable_unsent != 0)
+          --reliable_unsent;
+      }
+      while (!redundant_out.empty() && redundant_first < d.redundant_ack)
+      {
+        redundant_out.pop_front();
+        ++redundant_first;
+      }
+
+      // The reliable ones are resent from the oldest unacked, so anything after a gap will come again.
+      for (size_t i = 0; i < d.reliable.size(); ++i)
+      {
+        auto id = d.reliable_first + static_cast<uint32_t>(i);
+        if (id > reliable_in)
+          break;
+        if (id == reliable_in)
+        {
+          out.emplace_back(Delivery{.channel = Channel::reliable, .id = id, .data = std::move(d.reliable[i])});
+          ++reliable_in;
+        }
+      }
+      for (size_t i = 0; i < d.redundant.size(); ++i)
+      {
+        auto id = d.redundant_first + static_cast<uint32_t>(i);
+        if (id >= redundant_in)
+        {
+          out.emplace_back(Delivery{.channel = Channel::redundant, .id = id, .data = std::move(d.redundant[i])});
+          redundant_in = id + 1;
+        }
+      }
+
+      if (d.sequenced <= sequenced_in || d.sequenced < assembling
+          || d.fragment_count == 0 || d.fragment_count > max_fragments || d.fragment_index >= d.fragment_count)
+        return;
+      if (d.sequenced != assembling)
+      {
+        assembling = d.sequenced;
+        fragments.assign(d.fragment_count, std::nullopt);
+        fragments_left = d.fragment_count;
+      }
+      if (fragments.size() != d.fragment_count || fragments[d.fragment_index].has_value())
+        return;
+      fragments[d.fragment_index] = std::move(d.fragment);
+      if (--fragments_left != 0)
+        return;
+      std::string data;
+      for (auto &f : fragments)
+        data += *f;
+      fragments.clear();
+      sequenced_in = assembling;
+      out.emplace_back(Delivery{.channel = Channel::sequenced, .id = sequenced_in, .data = std::move(data)});
+    }
+
+  private:
+    Datagram make_header(clock::time_point now)
+    {
+      sent_at[next_seq % sent_at.size()] = now;
+      return Datagram{
+        .token = token,
+        .seq = next_seq++,
+        .ack = peer_seq,
+        .reliable_ack = reliable_in,
+        .redundant_ack = redundant_in
+      };
+    }
+
+    static std::string encode(const Datagram &d)
+    {
+      auto body = serialize(d);
+      auto header = utils::make_header(DATAGRAM_MAGIC, body.size());
+      std::string ret(sizeof(MsgHeader), '\0');
+      std::memcpy(ret.data(), &header, sizeof(MsgHeader));
+      return ret + body;
+    }
+  };
+} // namespace czh::utils
+#endif
@@ -17,24 +17,15 @@
 
 #include "wide_char_width.h"
 #include "debug.h"
+#include "random.h"
 
 #include <string_view>
 #include <string>
-#include <random>
 #include <type_traits>
 #include <ranges>
 
 namespace czh::utils
 {
-  template<typename T>
-  T randnum(T a, T b) // [a, b)
-  {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<T> u(a, b - 1);
-    return u(gen);
-  }
-
   template<typename BeginIt, typename EndIt>
   concept ItRange =
       requires(BeginIt begin_it, EndIt end_it)
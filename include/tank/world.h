@@ -0,0 +1,96 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef TANK_WORLD_H
+#define TANK_WORLD_H
+#pragma once
+
+#include "config.h"
+#include "game.h"
+#include "game_map.h"
+#include "utils/random.h"
+#include "utils/scheduler.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A world is everything one game needs: map, tanks, bullets, users and config.
+// The process-wide game is the default world. With the server started, each connection
+// can join a room instead, which is another world, ticked on a pool shared by the rooms.
+// g::state(), map::map(), cfg::config() etc. are those of the calling thread's current world.
+namespace czh::g
+{
+  struct World
+  {
+    std::string name;
+    GameState state;
+    map::Map map;
+    cfg::Config config;
+    utils::WorldRandom random;
+    std::mutex mainloop_mtx;
+    std::mutex command_mtx;
+    std::mutex send_msg_mtx;
+    utils::TickScheduler scheduler;
+
+    // Rooms only, guarded by the rooms' mutex
+    size_t members{0}; // Connections that joined it
+    bool ticking{false}; // A tick of it is queued or running
+
+    explicit World(std::string name_);
+
+    ~World();
+  };
+
+  // The current world of the calling thread, the default world if none was entered.
+  World& world();
+
+  World& default_world();
+
+  [[nodiscard]] bool is_default_world();
+
+  // Makes w the current world of the calling thread until the end of the scope.
+  class WorldScope
+  {
+  private:
+    World* prev;
+
+  public:
+    explicit WorldScope(World& w);
+
+    ~WorldScope();
+
+    WorldScope(const WorldScope&) = delete;
+
+    WorldScope& operator=(const WorldScope&) = delete;
+  };
+
+  // A room can't be created beyond these.
+  constexpr size_t max_rooms = 32;
+  constexpr size_t max_room_name = 32;
+
+  // Joins the room, creating it and starting to tick it if needed. An empty name is the default
+  // world. nullptr if the room can't be created. Each join is paired with a leave_room().
+  std::shared_ptr<World> join_room(const std::string& name);
+
+  // The room is destroyed when its last member leaves, once the last shared_ptr to it is gone.
+  void leave_room(World& room);
+
+  [[nodiscard]] std::vector<std::string> get_room_names();
+
+  // Stops ticking every room and forgets them, they are destroyed with the last shared_ptr.
+  // The default world is kept.
+  void close_rooms();
+}
+#endif
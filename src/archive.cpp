@@ -17,6 +17,7 @@
 #include "tank/game_map.h"
 #include "tank/input.h"
 #include "tank/archive.h"
+#include "tank/broadcast.h"
 #include "tank/utils/utils.h"
 #include "tank/utils/debug.h"
 
@@ -59,6 +60,8 @@ namespace czh::ar
       ret->route_pos = data.route_pos;
       ret->gap_count = data.gap_count;
       ret->has_good_target = data.has_good_target;
+      ret->rng = data.rng;
+      ret->lod_tick = data.lod_tick;
       return ret;
     }
     else
@@ -82,7 +85,7 @@ namespace czh::ar
       .name = t->name,
       .max_hp = t->max_hp,
       .hp = t->hp,
-      .is_auto = t->is_auto,
+      .is_auto = t->is_auto(),
       .pos = t->pos,
       .direction = t->direction,
       .bullet_hp = t->bullet_hp,
@@ -90,16 +93,16 @@ namespace czh::ar
       .bullet_range = t->bullet_range
     };
 
-    if (t->is_auto)
+    if (auto tank = tank::get_if<tank::AutoTank>(t); tank != nullptr)
     {
-      ret.is_auto = true;
-      auto tank = dynamic_cast<const tank::AutoTank*>(t);
       ret.gap = tank->gap;
       ret.target_id = tank->target_id;
       ret.route = tank->route;
       ret.route_pos = tank->route_pos;
       ret.gap_count = tank->gap_count;
       ret.has_good_target = tank->has_good_target;
+      ret.rng = tank->rng;
+      ret.lod_tick = tank->lod_tick;
     }
     return ret;
   }
@@ -172,28 +175,32 @@ namespace czh::ar
   {
     Archive ret{
       // game state
-      .users = g::state.users,
-      .user_id = g::state.id,
-      .next_id = g::state.next_id,
+      .users = []
+      {
+        std::lock_guard sl(bc::send_msg_mtx());
+        return g::state().users;
+      }(),
+      .user_id = g::state().id,
+      .next_id = g::state().next_id,
 
       // draw state
       .focus = draw::state.focus,
       .style = draw::state.style,
 
       // map
-      .game_map = Archiver::archive_map(map::map),
+      .game_map = Archiver::archive_map(map::map()),
 
       // input state
       .history = input::state.history,
 
       // config
-      .config = cfg::config
+      .config = cfg::config()
     };
 
-    for (const auto& r : g::state.tanks | std::views::values)
+    for (const auto& r : g::state().tanks | std::views::values)
       ret.tanks.emplace_back(Archiver::archive_tank(r));
 
-    for (const auto& r : g::state.bullets)
+    for (const auto& r : g::state().bullets)
       ret.bullets.emplace_back(Archiver::archive_bullet(r));
     return ret;
   }
@@ -201,35 +208,42 @@ namespace czh::ar
   void load(const Archive& archive)
   {
     // game state
-    g::state.users = archive.users;
-    g::state.id = archive.user_id;
-    g::state.next_id = archive.next_id;
+    //
+    {
+      std::lock_guard sl(bc::send_msg_mtx());
+      g::state().users = archive.users;
+      // The message log isn't archived, the inboxes start over from its end.
+      for (auto& user : g::state().users | std::views::values)
+        user.inbox = msg::Inbox{.begin = g::state().messages.end(), .cursor = g::state().messages.end()};
+    }
+    g::state().id = archive.user_id;
+    g::state().next_id = archive.next_id;
 
     // draw state
     draw::state.focus = archive.focus;
     draw::state.style = archive.style;
 
     // map
-    Archiver::archive_map(map::map) = archive.game_map;
+    Archiver::archive_map(map::map()) = archive.game_map;
 
     // input state
     input::state.history = archive.history;
 
     // config
-    cfg::config = archive.config;
+    cfg::config() = archive.config;
 
-    g::state.tanks.clear();
+    g::state().tanks.clear();
     for (const auto& r : archive.tanks)
     {
-      g::state.tanks[r.id] = Archiver::load_tank(r);
+      g::state().tanks[r.id] = Archiver::load_tank(r);
     }
 
-    g::state.bullets.clear();
+    g::state().bullets.clear();
     for (const auto& r : archive.bullets)
     {
-      g::state.bullets.emplace_back(Archiver::load_bullet(r));
+      g::state().bullets.emplace_back(Archiver::load_bullet(r));
     }
 
-    map::map = Archiver::load_map(archive.game_map, g::state.tanks, g::state.bullets);
+    map::map() = Archiver::load_map(archive.game_map, g::state().tanks, g::state().bullets);
   }
 }
@@ -12,35 +12,118 @@
 //   See the License for the specific language governing permissions and
 //   limitations under the License.
 #include "tank/broadcast.h"
+#include "tank/config.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <ranges>
+#include <vector>
 
 namespace czh::bc
 {
-  std::mutex send_msg_mtx;
+  msg::Inbox& synced_inbox(size_t id)
+  {
+    auto& inbox = g::state().users[id].inbox;
+    g::state().messages.sync(id, inbox);
+    return inbox;
+  }
+
+  msg::Retention retention()
+  {
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    return msg::Retention{
+      .max_count = cfg::config().msg_max_count,
+      .max_bytes = cfg::config().msg_max_bytes,
+      .min_time = std::chrono::duration_cast<std::chrono::seconds>(now - cfg::config().msg_max_age).count()
+    };
+  }
+
+  void post_message(size_t to, msg::Message m)
+  {
+    g::state().messages.push(to, std::make_shared<const msg::Message>(std::move(m)));
+    g::state().messages.shrink(retention());
+  }
+
+  void receive_message(size_t id, msg::Message m)
+  {
+    post_message(id, std::move(m));
+  }
 
   std::optional<msg::Message> read_message(size_t id)
   {
-    int max_priority = (std::numeric_limits<int>::min)();
-    auto it = g::state.users[id].messages.rbegin();
-    std::vector<decltype(it)> unread;
-    for (; it < g::state.users[id].messages.rend(); ++it)
+    auto& inbox = synced_inbox(id);
+    if (inbox.unread.empty())
+      return std::nullopt;
+    auto it = std::prev(inbox.unread.end());
+    auto seq = it->second;
+    inbox.unread.erase(it);
+    return *g::state().messages.at(seq)->msg;
+  }
+
+  std::vector<std::shared_ptr<const msg::Message> > take_unread(size_t id)
+  {
+    auto& inbox = synced_inbox(id);
+    std::vector<uint64_t> seqs;
+    seqs.reserve(inbox.unread.size());
+    for (auto& seq : inbox.unread | std::views::values)
+      seqs.emplace_back(seq);
+    std::ranges::sort(seqs);
+    inbox.unread.clear();
+
+    std::vector<std::shared_ptr<const msg::Message> > ret;
+    ret.reserve(seqs.size());
+    for (auto& seq : seqs)
+      ret.emplace_back(g::state().messages.at(seq)->msg);
+    return ret;
+  }
+
+  std::vector<std::shared_ptr<const msg::Message> > get_messages(size_t id, uint64_t from)
+  {
+    std::vector<std::shared_ptr<const msg::Message> > ret;
+    g::state().messages.for_each(id, synced_inbox(id), from,
+                                 [&ret](auto&& e, bool) { ret.emplace_back(e.msg); });
+    return ret;
+  }
+
+  bool has_messages(size_t id)
+  {
+    auto& log = g::state().messages;
+    auto& inbox = g::state().users[id].inbox;
+    for (auto seq = log.end(); seq > (std::max)(inbox.begin, log.first()); --seq)
     {
-      if (!it->read)
-      {
-        if (it->priority > max_priority)
-          max_priority = it->priority;
-        unread.emplace_back(it);
-      }
+      auto e = log.at(seq - 1);
+      if ((e->to == id || e->to == to_everyone) && !inbox.removed.contains(e->seq))
+        return true;
     }
+    return false;
+  }
 
-    // new -> old
-    for (auto& r : unread)
+  void mark_all_read(size_t id)
+  {
+    synced_inbox(id).unread.clear();
+  }
+
+  void clear_messages(size_t id, bool only_read)
+  {
+    auto& inbox = synced_inbox(id);
+    if (!only_read)
     {
-      if (r->priority == max_priority)
-      {
-        r->read = true;
-        return *r;
-      }
+      inbox = msg::Inbox{.begin = g::state().messages.end(), .cursor = g::state().messages.end()};
+      return;
     }
-    return std::nullopt;
+    g::state().messages.for_each(id, inbox, 0, [&inbox](auto&& e, bool read)
+    {
+      if (read)
+        inbox.removed.insert(e.seq);
+    });
+  }
+
+  void compact_messages()
+  {
+    g::state().messages.shrink(retention());
+    for (auto& user : g::state().users | std::views::values)
+      g::state().messages.trim(user.inbox);
   }
 }
@@ -21,7 +21,7 @@ namespace czh::bullet
     switch (direction)
     {
       case map::Direction::UP:
-        ret = map::map.bullet_up(this, pos);
+        ret = map::map().bullet_up(this, pos);
         if (ret != 0)
         {
           hp -= 1;
@@ -34,7 +34,7 @@ namespace czh::bullet
         }
         break;
       case map::Direction::DOWN:
-        ret = map::map.bullet_down(this, pos);
+        ret = map::map().bullet_down(this, pos);
         if (ret != 0)
         {
           hp -= 1;
@@ -47,7 +47,7 @@ namespace czh::bullet
         }
         break;
       case map::Direction::LEFT:
-        ret = map::map.bullet_left(this, pos);
+        ret = map::map().bullet_left(this, pos);
         if (ret != 0)
         {
           hp -= 1;
@@ -60,7 +60,7 @@ namespace czh::bullet
         }
         break;
       case map::Direction::RIGHT:
-        ret = map::map.bullet_right(this, pos);
+        ret = map::map().bullet_right(this, pos);
         if (ret != 0)
         {
           hp -= 1;
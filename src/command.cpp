@@ -12,11 +12,13 @@
 //   See the License for the specific language governing permissions and
 //   limitations under the License.
 #include "tank/game.h"
+#include "tank/config.h"
 #include "tank/term.h"
 #include "tank/archive.h"
 #include "tank/command.h"
 #include "tank/broadcast.h"
 #include "tank/online.h"
+#include "tank/record.h"
 #include "tank/utils/utils.h"
 #include "tank/utils/serialization.h"
 #include <string>
@@ -48,7 +50,7 @@ namespace czh::cmd
     };
   }
 
-  input::HintProvider id_provider(const std::function<bool(decltype(g::state.tanks)::value_type)>& pred,
+  input::HintProvider id_provider(const std::function<bool(decltype(g::state().tanks)::value_type)>& pred,
                                   const std::string& cond = "")
   {
     return [pred, cond](const std::string& s)
@@ -56,7 +58,7 @@ namespace czh::cmd
       if (cond.empty() || cond == s)
       {
         input::Hints ret;
-        for (auto& r : g::state.tanks)
+        for (auto& r : g::state().tanks)
         {
           if (pred(r))
             ret.emplace_back(std::to_string(r.first), true);
@@ -79,7 +81,7 @@ namespace czh::cmd
 
   input::HintProvider valid_auto_id_provider(const std::string& cond = "")
   {
-    return id_provider([](auto&& r) { return r.second->is_auto; }, cond);
+    return id_provider([](auto&& r) { return r.second->is_auto(); }, cond);
   }
 
   input::HintProvider user_id_provider(const std::string& cond = "")
@@ -134,6 +136,11 @@ namespace czh::cmd
     return p > 0 && p < 65536;
   }
 
+  inline std::string room_suffix(const std::string& room)
+  {
+    return room.empty() ? "" : std::format(" (room {})", room);
+  }
+
   inline bool is_valid_id(const int id)
   {
     return g::id_at(id) != nullptr;
@@ -202,14 +209,24 @@ namespace czh::cmd
       }
     },
     {
-      "connect", "[ip] [port]", {
+      "connect", "[ip] [port] (in [room]) (as [id])", {
         fixed_provider({{"[ip]", false}}),
         fixed_provider({{"[port]", false}}),
+        fixed_provider({{"in", true}, {"as", true}}),
+        fixed_provider({{"[room or remote id]", false}}),
         fixed_provider({{"as", true}}),
-        fixed_provider({{"[remote id]", false}})
+        fixed_provider({{"[remote id]", false}}, "as")
       }
     },
     {"disconnect", "** No arguments **", {}},
+    {
+      "net", "udp (or tcp) (or sim [loss %] [latency ms] (jitter ms)) (or sim off)", {
+        fixed_provider({{"udp", true}, {"tcp", true}, {"sim", true}}),
+        fixed_provider({{"off", true}, {"[loss, int, %]", false}}, "sim"),
+        fixed_provider({{"[latency, int, milliseconds]", false}}),
+        fixed_provider({{"[jitter, int, milliseconds]", false}})
+      }
+    },
     {
       "fill", "[status] [A x,y] [B x,y optional]", {
         fixed_provider({{"0", true}, {"1", true}}),
@@ -251,7 +268,10 @@ namespace czh::cmd
         concat(fixed_provider({
                  {"tick", true}, {"seed", true},
                  {"msgTTL", true}, {"longPressTH", true},
-                 {"unsafe", true}
+                 {"catchUp", true}, {"fps", true},
+                 {"lodNear", true}, {"lodFar", true}, {"lodInterval", true},
+                 {"msgMaxCount", true}, {"msgMaxBytes", true}, {"msgMaxAge", true},
+                 {"maxMapChanges", true}, {"unsafe", true}
                }), valid_id_provider()),
         // Arg 1: Tank setting fields or Game setting's value
         [](const std::string& last_arg)
@@ -264,13 +284,31 @@ namespace czh::cmd
             return input::Hints{{"[TTL, int, milliseconds]", false}};
           else if (last_arg == "longPressTH")
             return input::Hints{{"[Threshold, int, microseconds]", false}};
+          else if (last_arg == "catchUp")
+            return input::Hints{{"[Max catch-up steps, int]", false}};
+          else if (last_arg == "fps")
+            return input::Hints{{"[Max FPS, int]", false}};
+          else if (last_arg == "lodNear")
+            return input::Hints{{"[Full detail distance, int, cells]", false}};
+          else if (last_arg == "lodFar")
+            return input::Hints{{"[Frozen distance, int, cells]", false}};
+          else if (last_arg == "lodInterval")
+            return input::Hints{{"[Reduced detail interval, int, ticks]", false}};
+          else if (last_arg == "msgMaxCount")
+            return input::Hints{{"[Max messages kept, int]", false}};
+          else if (last_arg == "msgMaxBytes")
+            return input::Hints{{"[Max bytes of messages kept, int]", false}};
+          else if (last_arg == "msgMaxAge")
+            return input::Hints{{"[Max age of messages kept, int, milliseconds]", false}};
+          else if (last_arg == "maxMapChanges")
+            return input::Hints{{"[Max pending map changes per user, int]", false}};
           else if (last_arg == "unsafe")
             return input::Hints{{"[bool]", false}, {"true", true}, {"false", true}};
           else // Tank's
           {
             if (is_valid_id(last_arg))
             {
-              if (g::id_at(std::stoull(last_arg))->is_auto)
+              if (g::id_at(std::stoull(last_arg))->is_auto())
               {
                 return input::Hints{
                   {"bullet", true}, {"name", true},
@@ -321,6 +359,7 @@ namespace czh::cmd
     {"continue", "** No arguments **", {}},
     {"quit", "** No arguments **", {}},
     {"status", "** No arguments **", {}},
+    {"timing", "(reset optional)", {fixed_provider({{"reset", true}})}},
     {
       "notification", "notification (action)",
       {
@@ -329,7 +368,13 @@ namespace czh::cmd
       }
     },
     {"save", "[filename, string]", {}},
-    {"load", "[filename, string]", {}}
+    {"load", "[filename, string]", {}},
+    {
+      "record", "start (or stop [filename])", {
+        fixed_provider({{"start", true}, {"stop", true}}),
+        fixed_provider({{"[filename, string]", false}}, "stop")
+      }
+    }
   };
 
   CmdCall parse(const std::string& cmd)
@@ -477,7 +522,7 @@ namespace czh::cmd
       return;
     }
 
-    if (g::state.mode == g::Mode::CLIENT)
+    if (g::state().mode == g::Mode::CLIENT)
     {
       if (remote_cmds.find(call.name) != remote_cmds.end())
       {
@@ -488,6 +533,18 @@ namespace czh::cmd
       }
     }
 
+    // Hold the tick back while a recorded command runs, so it replays at exactly the same tick.
+    std::unique_lock<std::mutex> cl;
+    if (rec::is_recording() && rec::is_recorded_command(call.name))
+    {
+      cl = std::unique_lock(g::command_mtx());
+      std::lock_guard ml(g::mainloop_mtx());
+      rec::record({
+        .type = rec::EntryType::COMMAND, .user = user_id,
+        .zone = g::state().users[user_id].visible_zone, .command = str
+      });
+    }
+
     if (call.is("help"))
     {
       if (call.args.empty())
@@ -502,25 +559,48 @@ namespace czh::cmd
         draw::state.help_pos = i - 1;
       }
       else goto invalid_args;
-      g::state.page = g::Page::HELP;
+      g::state().page = g::Page::HELP;
       draw::state.inited = false;
     }
     else if (call.is("status"))
     {
       if (call.args.empty())
       {
-        g::state.page = g::Page::STATUS;
+        g::state().page = g::Page::STATUS;
         draw::state.inited = false;
       }
       else goto invalid_args;
     }
+    else if (call.is("timing"))
+    {
+      auto& stats = g::scheduler().get_stats();
+      if (call.args.empty())
+      {
+        uint64_t ticks = stats.ticks;
+        double avg = ticks == 0 ? 0 : static_cast<double>(stats.total_cost) / static_cast<double>(ticks) / 1e6;
+        bc::info(user_id, "Tick: {} ms, Ticks: {}, Late: {}, Overruns: {}, Catch-up: {}, Dropped: {}.",
+                 cfg::config().tick.count(), ticks, stats.late_ticks.load(), stats.overruns.load(),
+                 stats.catch_up_steps.load(), stats.dropped_steps.load());
+        bc::info(user_id, "Cost: last {:.3f} ms, avg {:.3f} ms, max {:.3f} ms.",
+                 static_cast<double>(stats.last_cost) / 1e6, avg, static_cast<double>(stats.max_cost) / 1e6);
+      }
+      else if (call.get_if([&call](const std::string& option)
+      {
+        return call.assert(option == "reset", "Invalid option.");
+      }))
+      {
+        stats.reset();
+        bc::info(user_id, "Timing statistics were reset.");
+      }
+      else goto invalid_args;
+    }
     else if (call.is("notification"))
     {
       //std::lock_guard ml(game::mainloop_mtx);
       std::lock_guard dl(draw::drawing_mtx);
       if (call.args.empty())
       {
-        g::state.page = g::Page::NOTIFICATION;
+        g::state().page = g::Page::NOTIFICATION;
         draw::state.inited = false;
       }
       else if (auto v = call.get_if([&call](const std::string& option)
@@ -529,32 +609,30 @@ namespace czh::cmd
       }); v)
       {
         auto [opt] = *v;
+        std::lock_guard sl(bc::send_msg_mtx());
         if (opt == "clear")
-          g::state.users[user_id].messages.clear();
+          bc::clear_messages(user_id, false);
         else if (opt == "read")
-        {
-          for (auto& r : g::state.users[user_id].messages)
-            r.read = true;
-        }
+          bc::mark_all_read(user_id);
       }
       else if (call.get_if([&call](const std::string& option, const std::string& f)
       {
         return call.assert(option == "clear" && f == "read", "Invalid option.");
       }))
       {
-        auto& msgs = g::state.users[user_id].messages;
-        msgs.erase(std::remove_if(msgs.begin(), msgs.end(), [](auto&& m) { return m.read; }), msgs.end());
+        std::lock_guard sl(bc::send_msg_mtx());
+        bc::clear_messages(user_id, true);
       }
       else goto invalid_args;
 
-      if (g::state.page == g::Page::NOTIFICATION)
+      if (g::state().page == g::Page::NOTIFICATION)
         draw::state.inited = false;
     }
     else if (call.is("quit"))
     {
       if (call.args.empty())
       {
-        std::lock_guard ml(g::mainloop_mtx);
+        std::lock_guard ml(g::mainloop_mtx());
         std::lock_guard dl(draw::drawing_mtx);
         term::move_cursor({0, draw::state.height + 1});
         term::output("\033[?25h");
@@ -569,7 +647,7 @@ namespace czh::cmd
     {
       if (call.args.empty())
       {
-        g::state.running = false;
+        g::state().running = false;
         bc::info(user_id, "Stopped.");
       }
       else goto invalid_args;
@@ -578,14 +656,14 @@ namespace czh::cmd
     {
       if (call.args.empty())
       {
-        g::state.running = true;
+        g::state().running = true;
         bc::info(user_id, "Continuing.");
       }
       else goto invalid_args;
     }
     else if (call.is("fill"))
     {
-      std::lock_guard ml(g::mainloop_mtx);
+      std::lock_guard ml(g::mainloop_mtx());
       std::lock_guard dl(draw::drawing_mtx);
       int from_x;
       int from_y;
@@ -619,16 +697,16 @@ namespace czh::cmd
       {
         for (int j = zone.y_min; j < zone.y_max; ++j)
         {
-          if (map::map.has(map::Status::TANK, {i, j}))
+          if (map::map().has(map::Status::TANK, {i, j}))
           {
-            if (auto t = map::map.at(i, j).get_tank(); t != nullptr)
+            if (auto t = map::map().at(i, j).get_tank(); t != nullptr)
             {
               t->kill();
             }
           }
-          else if (map::map.has(map::Status::BULLET, {i, j}))
+          else if (map::map().has(map::Status::BULLET, {i, j}))
           {
-            auto bullets = map::map.at(i, j).get_bullets();
+            auto bullets = map::map().at(i, j).get_bullets();
             for (auto& r : bullets)
             {
               r->kill();
@@ -639,23 +717,23 @@ namespace czh::cmd
       }
       if (is_wall)
       {
-        map::map.fill(zone, map::Status::WALL);
+        map::map().fill(zone, map::Status::WALL);
       }
       else
       {
-        map::map.fill(zone);
+        map::map().fill(zone);
       }
       bc::info(user_id, "Filled from ({}, {}) to ({}, {}).", from_x, from_y, to_x, to_y);
     }
     else if (call.is("tp"))
     {
-      std::lock_guard ml(g::mainloop_mtx);
+      std::lock_guard ml(g::mainloop_mtx());
       std::lock_guard dl(draw::drawing_mtx);
       int id = -1;
       map::Pos to_pos;
       auto check = [](const map::Pos& p)
       {
-        return !map::map.has(map::Status::WALL, p) && !map::map.has(map::Status::TANK, p);
+        return !map::map().has(map::Status::WALL, p) && !map::map().has(map::Status::TANK, p);
       };
 
       if (auto v = call.get_if(
@@ -700,20 +778,20 @@ namespace czh::cmd
       else goto invalid_args;
 
       auto tank = g::id_at(id);
-      map::map.remove_status(map::Status::TANK, tank->pos);
-      map::map.add_tank(tank, to_pos);
+      map::map().remove_status(map::Status::TANK, tank->pos);
+      map::map().add_tank(tank, to_pos);
       tank->pos = to_pos;
       bc::info(user_id, "{} was teleported to ({}, {}).", tank->name, to_pos.x, to_pos.y);
     }
     else if (call.is("revive"))
     {
-      std::lock_guard ml(g::mainloop_mtx);
+      std::lock_guard ml(g::mainloop_mtx());
       std::lock_guard dl(draw::drawing_mtx);
       int id;
       if (call.args.empty())
       {
-        for (auto& r : g::state.tanks | std::views::values)
-          g::revive(r->get_id(), g::state.users[user_id].visible_zone, user_id);
+        for (auto& r : g::state().tanks | std::views::values)
+          g::revive(r->get_id(), g::state().users[user_id].visible_zone, user_id);
         bc::info(user_id, "Revived all tanks.");
         return;
       }
@@ -725,12 +803,12 @@ namespace czh::cmd
         std::tie(id) = *v;
       }
       else goto invalid_args;
-      g::revive(id, g::state.users[user_id].visible_zone, user_id);
+      g::revive(id, g::state().users[user_id].visible_zone, user_id);
       bc::info(user_id, g::id_at(id)->name + " revived.");
     }
     else if (call.is("summon"))
     {
-      std::lock_guard ml(g::mainloop_mtx);
+      std::lock_guard ml(g::mainloop_mtx());
       std::lock_guard dl(draw::drawing_mtx);
       int num, lvl;
       if (auto v = call.get_if(
@@ -743,11 +821,8 @@ namespace czh::cmd
         std::tie(num, lvl) = *v;
       }
       else goto invalid_args;
-      for (size_t i = 0; i < num; ++i)
-      {
-        g::add_auto_tank(lvl, g::state.users[user_id].visible_zone, user_id);
-      }
-      bc::info(user_id, "Added {} AutoTanks, Level: {}.", num, lvl);
+      auto ids = g::add_auto_tanks(num, lvl, g::state().users[user_id].visible_zone, user_id);
+      bc::info(user_id, "Added {} AutoTanks, Level: {}.", ids.size(), lvl);
     }
     else if (call.is("observe"))
     {
@@ -765,15 +840,11 @@ namespace czh::cmd
     }
     else if (call.is("kill"))
     {
-      std::lock_guard ml(g::mainloop_mtx);
+      std::lock_guard ml(g::mainloop_mtx());
       std::lock_guard dl(draw::drawing_mtx);
       if (call.args.empty())
       {
-        for (auto& r : g::state.tanks)
-        {
-          if (r.second->is_alive()) r.second->kill();
-        }
-        g::clear_death();
+        g::kill_tanks([](auto&&) { return true; });
         bc::info(user_id, "Killed all tanks.");
       }
       else if (auto v = call.get_if([&call](int id)
@@ -791,39 +862,13 @@ namespace czh::cmd
     }
     else if (call.is("clear"))
     {
-      std::lock_guard ml(g::mainloop_mtx);
+      std::lock_guard ml(g::mainloop_mtx());
       std::lock_guard dl(draw::drawing_mtx);
-      if (g::state.page == g::Page::STATUS)
+      if (g::state().page == g::Page::STATUS)
         draw::state.inited = false;
       if (call.args.empty())
       {
-        for (auto& r : g::state.bullets)
-        {
-          if (g::id_at(r->get_tank())->is_auto)
-          {
-            r->kill();
-          }
-        }
-        for (auto& r : g::state.tanks)
-        {
-          if (r.second->is_auto)
-          {
-            r.second->kill();
-          }
-        }
-        g::clear_death(); // before delete
-        for (auto it = g::state.tanks.begin(); it != g::state.tanks.end();)
-        {
-          if (!it->second->is_auto)
-          {
-            ++it;
-          }
-          else
-          {
-            delete it->second;
-            it = g::state.tanks.erase(it);
-          }
-        }
+        g::remove_tanks([](const tank::Tank* t) { return t->is_auto(); });
         bc::info(user_id, "Cleared all tanks.");
       }
       else if (auto v = call.get_if([&call](const std::string& f)
@@ -831,63 +876,25 @@ namespace czh::cmd
         return call.assert(f == "death", "Invalid option.");
       }); v)
       {
-        for (auto& r : g::state.bullets)
-        {
-          auto t = g::id_at(r->get_tank());
-          if (t->is_auto && !t->is_alive())
-          {
-            r->kill();
-          }
-        }
-        for (auto& r : g::state.tanks)
-        {
-          if (r.second->is_auto && !r.second->is_alive())
-          {
-            r.second->kill();
-          }
-        }
-        g::clear_death(); // before delete
-        for (auto it = g::state.tanks.begin(); it != g::state.tanks.end();)
-        {
-          if (!it->second->is_auto || it->second->is_alive())
-          {
-            ++it;
-          }
-          else
-          {
-            delete it->second;
-            it = g::state.tanks.erase(it);
-          }
-        }
+        g::remove_tanks([](const tank::Tank* t) { return t->is_auto() && !t->is_alive(); });
         bc::info(user_id, "Cleared all died tanks.");
       }
       else if (auto v = call.get_if(
         [&call](int id)
         {
           return call.assert(is_valid_id(id), "Invalid ID.") &&
-                 call.assert(g::id_at(id)->is_auto, "User's Tank can not be cleared.");
+                 call.assert(g::id_at(id)->is_auto(), "User's Tank can not be cleared.");
         }); v)
       {
         auto [id] = *v;
-        for (auto& r : g::state.bullets)
-        {
-          if (r->get_tank() == id)
-          {
-            r->kill();
-          }
-        }
-        auto t = g::id_at(id);
-        t->kill();
-        g::clear_death(); // before delete
-        delete t;
-        g::state.tanks.erase(id);
+        g::remove_tanks([id](const tank::Tank* t) { return t->get_id() == static_cast<size_t>(id); });
         bc::info(user_id, "ID: {} was cleared.", id);
       }
       else goto invalid_args;
     }
     else if (call.is("set"))
     {
-      std::lock_guard ml(g::mainloop_mtx);
+      std::lock_guard ml(g::mainloop_mtx());
       std::lock_guard dl(draw::drawing_mtx);
       if (auto v = call.get_if(
         [&call](int id, const std::string& key, int value)
@@ -904,7 +911,7 @@ namespace czh::cmd
             return call.assert(value > 0 && value <= t->max_hp, "Invalid value. (0 < HP <= Max HP)");
           else if (key == "target")
           {
-            return call.assert(t->is_auto, "Only AutoTank has target.")
+            return call.assert(t->is_auto(), "Only AutoTank has target.")
                    && call.assert(t->is_alive(), "The tank shall be alive.")
                    && call.assert(is_valid_id(value), "Invalid target id.")
                    && call.assert(value != id, "Can not set one as a target of itself.")
@@ -927,14 +934,15 @@ namespace czh::cmd
         }
         else if (key == "hp")
         {
-          if (!tank->is_alive()) g::revive(id, g::state.users[user_id].visible_zone, user_id);
+          if (!tank->is_alive()) g::revive(id, g::state().users[user_id].visible_zone, user_id);
           tank->hp = value;
           bc::info(user_id, "The HP of {} was set to {}.", tank->name, value);
           return;
         }
         else if (key == "target")
         {
-          auto atank = dynamic_cast<tank::AutoTank*>(tank);
+          auto atank = tank::get_if<tank::AutoTank>(tank);
+          dbg::tank_assert(atank != nullptr);
           auto target = g::id_at(value);
           int ret = atank->set_target(value);
           if (ret == 0)
@@ -969,9 +977,27 @@ namespace czh::cmd
           else if (key == "seed")
             return true;
           else if (key == "msgTTL")
-            return call.assert(arg > 0, "MsgTTL shall > 0.");
+            return call.assert(arg > 0 && arg <= cfg::config().msg_max_age.count(), "MsgTTL shall be in (0, msgMaxAge].");
           else if (key == "longPressTH")
             return call.assert(arg > 0, "LongPressTH shall > 0.");
+          else if (key == "catchUp")
+            return call.assert(arg >= 0, "CatchUp shall >= 0.");
+          else if (key == "fps")
+            return call.assert(arg > 0 && arg <= 1000, "FPS shall be in (0, 1000].");
+          else if (key == "lodNear")
+            return call.assert(arg >= 0 && arg <= cfg::config().lod_far, "LodNear shall be in [0, lodFar].");
+          else if (key == "lodFar")
+            return call.assert(arg >= cfg::config().lod_near, "LodFar shall >= lodNear.");
+          else if (key == "lodInterval")
+            return call.assert(arg > 0, "LodInterval shall > 0.");
+          else if (key == "msgMaxCount")
+            return call.assert(arg > 0, "MsgMaxCount shall > 0.");
+          else if (key == "msgMaxBytes")
+            return call.assert(arg > 0, "MsgMaxBytes shall > 0.");
+          else if (key == "msgMaxAge")
+            return call.assert(arg >= cfg::config().msg_ttl.count(), "MsgMaxAge shall >= msgTTL.");
+          else if (key == "maxMapChanges")
+            return call.assert(arg > 0, "MaxMapChanges shall > 0.");
           else
           {
             call.error.emplace_back("Invalid option");
@@ -982,36 +1008,81 @@ namespace czh::cmd
         auto [option, arg] = *v;
         if (option == "tick")
         {
-          cfg::config.tick = std::chrono::milliseconds(arg);
+          cfg::config().tick = std::chrono::milliseconds(arg);
           bc::info(user_id, "Tick was set to {}.", arg);
         }
         else if (option == "seed")
         {
-          map::map.seed = arg;
+          map::map().seed = arg;
           draw::state.inited = false;
           bc::info(user_id, "Seed was set to {}.", arg);
         }
         else if (option == "msgTTL")
         {
-          cfg::config.msg_ttl = std::chrono::milliseconds(arg);
+          cfg::config().msg_ttl = std::chrono::milliseconds(arg);
           bc::info(user_id, "Message TTL was set to {}.", arg);
         }
         else if (option == "longPressTH")
         {
-          cfg::config.long_pressing_threshold = arg;
+          cfg::config().long_pressing_threshold = arg;
           bc::info(user_id, "Long press threshold was set to {}.", arg);
         }
+        else if (option == "catchUp")
+        {
+          cfg::config().max_catch_up = arg;
+          bc::info(user_id, "Max catch-up steps was set to {}.", arg);
+        }
+        else if (option == "fps")
+        {
+          cfg::config().max_fps = arg;
+          bc::info(user_id, "Max FPS was set to {}.", arg);
+        }
+        else if (option == "lodNear")
+        {
+          cfg::config().lod_near = arg;
+          bc::info(user_id, "Full detail distance was set to {}.", arg);
+        }
+        else if (option == "lodFar")
+        {
+          cfg::config().lod_far = arg;
+          bc::info(user_id, "Frozen distance was set to {}.", arg);
+        }
+        else if (option == "lodInterval")
+        {
+          cfg::config().lod_interval = arg;
+          bc::info(user_id, "Reduced detail interval was set to {}.", arg);
+        }
+        else if (option == "msgMaxCount")
+        {
+          cfg::config().msg_max_count = arg;
+          bc::info(user_id, "Max messages kept was set to {}.", arg);
+        }
+        else if (option == "msgMaxBytes")
+        {
+          cfg::config().msg_max_bytes = arg;
+          bc::info(user_id, "Max bytes of messages kept was set to {}.", arg);
+        }
+        else if (option == "msgMaxAge")
+        {
+          cfg::config().msg_max_age = std::chrono::milliseconds(arg);
+          bc::info(user_id, "Max age of messages kept was set to {}.", arg);
+        }
+        else if (option == "maxMapChanges")
+        {
+          cfg::config().max_map_changes = arg;
+          bc::info(user_id, "Max pending map changes was set to {}.", arg);
+        }
       }
       else if (auto v = call.get_if(
         [&call, &user_id](const std::string& key, bool arg)
         {
           return call.assert(key == "unsafe", "Invalid option.")
-                 && call.assert(cfg::config.unsafe_mode || user_id == g::state.id,
+                 && call.assert(cfg::config().unsafe_mode || user_id == g::state().id,
                                 "This command can only be executed by the server itself. (see '/help' for a workaround)");
         }); v)
       {
         auto [option, arg] = *v;
-        cfg::config.unsafe_mode = arg;
+        cfg::config().unsafe_mode = arg;
         if (arg)
           bc::warn(user_id, "Unsafe mode enabled.");
         else
@@ -1054,70 +1125,88 @@ namespace czh::cmd
     }
     else if (call.is("server"))
     {
-      std::lock_guard ml(g::mainloop_mtx);
+      std::lock_guard ml(g::mainloop_mtx());
       //std::lock_guard dl(drawing::drawing_mtx);
       if (auto v = call.get_if(
         [&call](const std::string& key, int port)
         {
           return call.assert(key == "start", "Invalid option")
-                 && call.assert(g::state.mode == g::Mode::NATIVE, "Invalid request to start server mode.")
+                 && call.assert(g::state().mode == g::Mode::NATIVE, "Invalid request to start server mode.")
                  && call.assert(is_port(port), "Invalid port.");
         }); v)
       {
         auto [s, port] = *v;
-        g::state.mode = g::Mode::SERVER;
+        g::state().mode = g::Mode::SERVER;
         online::svr.start(port);
       }
       else if (auto v = call.get_if(
         [&call](const std::string& key)
         {
           return call.assert(key == "stop", "Invalid option.")
-                 && call.assert(g::state.mode == g::Mode::SERVER, "Invalid request to stop server mode.");
+                 && call.assert(g::state().mode == g::Mode::SERVER, "Invalid request to stop server mode.");
         }); v)
       {
         online::svr.stop();
-        for (auto& r : g::state.users)
+        for (auto& r : g::state().users)
         {
           if (r.first == 0) continue;
-          g::state.tanks[r.first]->kill();
-          g::state.tanks[r.first]->clear();
-          delete g::state.tanks[r.first];
-          g::state.tanks.erase(r.first);
+          g::state().tanks[r.first]->kill();
+          g::state().tanks[r.first]->clear();
+          delete g::state().tanks[r.first];
+          g::state().tanks.erase(r.first);
         }
-        g::state.users = {{0, g::state.users[0]}};
-        g::state.mode = g::Mode::NATIVE;
+        g::state().users = {{0, g::state().users[0]}};
+        g::state().mode = g::Mode::NATIVE;
         bc::info(user_id, "Server stopped.");
       }
       else goto invalid_args;
     }
     else if (call.is("connect"))
     {
-      std::lock_guard ml(g::mainloop_mtx);
+      std::lock_guard ml(g::mainloop_mtx());
       std::lock_guard dl(draw::drawing_mtx);
+      auto signup = [user_id](const std::string& ip, int port, const std::string& room)
+      {
+        g::state().mode = g::Mode::CLIENT;
+        auto try_connect = online::cli.signup(ip, port, room);
+        if (try_connect.has_value())
+        {
+          g::state().id = *try_connect;
+          draw::state.focus = g::state().id;
+          g::state().users = {{g::state().id, g::UserData{.user_id = g::state().id, .active = true}}};
+          draw::state.inited = false;
+          bc::info(user_id, "Connected to {}:{}{} as {}.", ip, port, room_suffix(room), g::state().id);
+        }
+      };
+      auto login = [user_id](const std::string& ip, int port, const std::string& room, int id)
+      {
+        g::state().mode = g::Mode::CLIENT;
+        int try_connect = online::cli.login(ip, port, room, id);
+        if (try_connect == 0)
+        {
+          g::state().mode = g::Mode::CLIENT;
+          g::state().id = static_cast<size_t>(id);
+          draw::state.focus = g::state().id;
+          g::state().users = {{g::state().id, g::UserData{.user_id = g::state().id, .active = true}}};
+          draw::state.inited = false;
+          bc::info(user_id, "Reconnected to {}:{}{} as {}.", ip, port, room_suffix(room), g::state().id);
+        }
+      };
       if (auto v = call.get_if(
         [&call](const std::string& ip, int port)
         {
-          return call.assert(g::state.mode == g::Mode::NATIVE, "Invalid request to connect a server.")
+          return call.assert(g::state().mode == g::Mode::NATIVE, "Invalid request to connect a server.")
                  && call.assert(is_ip(ip), "Invalid IP.")
                  && call.assert(is_port(port), "Invalid port.");
         }); v)
       {
         auto [ip, port] = *v;
-        g::state.mode = g::Mode::CLIENT;
-        auto try_connect = online::cli.signup(ip, port);
-        if (try_connect.has_value())
-        {
-          g::state.id = *try_connect;
-          draw::state.focus = g::state.id;
-          g::state.users = {{g::state.id, g::UserData{.user_id = g::state.id, .active = true}}};
-          draw::state.inited = false;
-          bc::info(user_id, "Connected to {}:{} as {}.", ip, port, g::state.id);
-        }
+        signup(ip, port, "");
       }
       else if (auto v = call.get_if(
         [&call](const std::string& ip, int port, const std::string& f, int id)
         {
-          return call.assert(g::state.mode == g::Mode::NATIVE, "Invalid request to connect a server.")
+          return call.assert(g::state().mode == g::Mode::NATIVE, "Invalid request to connect a server.")
                  && call.assert(is_ip(ip), "Invalid IP.")
                  && call.assert(is_port(port), "Invalid port.")
                  && call.assert(f == "as", "Invalid option")
@@ -1125,23 +1214,40 @@ namespace czh::cmd
         }); v)
       {
         auto [ip, port, f, id] = *v;
-        g::state.mode = g::Mode::CLIENT;
-        int try_connect = online::cli.login(ip, port, id);
-        if (try_connect == 0)
+        login(ip, port, "", id);
+      }
+      else if (auto v = call.get_if(
+        [&call](const std::string& ip, int port, const std::string& f, const std::string& room)
         {
-          g::state.mode = g::Mode::CLIENT;
-          g::state.id = static_cast<size_t>(id);
-          draw::state.focus = g::state.id;
-          g::state.users = {{g::state.id, g::UserData{.user_id = g::state.id, .active = true}}};
-          draw::state.inited = false;
-          bc::info(user_id, "Reconnected to {}:{} as {}.", ip, port, g::state.id);
-        }
+          return call.assert(g::state().mode == g::Mode::NATIVE, "Invalid request to connect a server.")
+                 && call.assert(is_ip(ip), "Invalid IP.")
+                 && call.assert(is_port(port), "Invalid port.")
+                 && call.assert(f == "in", "Invalid option");
+        }); v)
+      {
+        auto [ip, port, f, room] = *v;
+        signup(ip, port, room);
+      }
+      else if (auto v = call.get_if(
+        [&call](const std::string& ip, int port, const std::string& f1, const std::string& room,
+                const std::string& f2, int id)
+        {
+          return call.assert(g::state().mode == g::Mode::NATIVE, "Invalid request to connect a server.")
+                 && call.assert(is_ip(ip), "Invalid IP.")
+                 && call.assert(is_port(port), "Invalid port.")
+                 && call.assert(f1 == "in", "Invalid option")
+                 && call.assert(f2 == "as", "Invalid option")
+                 && call.assert(id >= 0, "Invalid ID.");
+        }); v)
+      {
+        auto [ip, port, f1, room, f2, id] = *v;
+        login(ip, port, room, id);
       }
       else goto invalid_args;
     }
     else if (call.is("disconnect"))
     {
-      if (g::state.mode != g::Mode::CLIENT)
+      if (g::state().mode != g::Mode::CLIENT)
       {
         call.error.emplace_back("Invalid request to disconnect.");
         goto invalid_args;
@@ -1149,12 +1255,71 @@ namespace czh::cmd
       if (call.args.empty())
       {
         online::cli.logout();
-        g::state.mode = g::Mode::NATIVE;
-        g::state.users = {{0, g::state.users[g::state.id]}};
-        g::state.id = 0;
-        draw::state.focus = g::state.id;
+        g::state().mode = g::Mode::NATIVE;
+        g::state().users = {{0, g::state().users[g::state().id]}};
+        g::state().id = 0;
+        draw::state.focus = g::state().id;
         draw::state.inited = false;
-        bc::info(g::state.id, "Disconnected.");
+        bc::info(g::state().id, "Disconnected.");
+      }
+      else goto invalid_args;
+    }
+    else if (call.is("net"))
+    {
+      if (auto v = call.get_if(
+        [&call, &user_id](const std::string& proto)
+        {
+          return call.assert(proto == "udp" || proto == "tcp", "Invalid option.")
+                 && call.assert(user_id == g::state().id, "This command can only be executed locally.");
+        }); v)
+      {
+        auto [proto] = *v;
+        online::cli.set_udp(proto == "udp");
+        bc::info(user_id, "The next connection will use {}.", proto == "udp" ? "UDP" : "TCP");
+      }
+      else if (auto v = call.get_if(
+        [&call, &user_id](const std::string& key, const std::string& off)
+        {
+          return call.assert(key == "sim", "Invalid option.")
+                 && call.assert(off == "off", "Invalid option.")
+                 && call.assert(user_id == g::state().id, "This command can only be executed locally.");
+        }); v)
+      {
+        online::net_sim.loss = 0;
+        online::net_sim.latency = 0;
+        online::net_sim.jitter = 0;
+        bc::info(user_id, "Network simulation disabled.");
+      }
+      else if (auto v = call.get_if(
+        [&call, &user_id](const std::string& key, int loss, int latency)
+        {
+          return call.assert(key == "sim", "Invalid option.")
+                 && call.assert(loss >= 0 && loss <= 100, "Invalid loss.")
+                 && call.assert(latency >= 0, "Invalid latency.")
+                 && call.assert(user_id == g::state().id, "This command can only be executed locally.");
+        }); v)
+      {
+        auto [key, loss, latency] = *v;
+        online::net_sim.loss = loss;
+        online::net_sim.latency = latency;
+        online::net_sim.jitter = 0;
+        bc::info(user_id, "Simulating {}% loss and {} ms latency on UDP.", loss, latency);
+      }
+      else if (auto v = call.get_if(
+        [&call, &user_id](const std::string& key, int loss, int latency, int jitter)
+        {
+          return call.assert(key == "sim", "Invalid option.")
+                 && call.assert(loss >= 0 && loss <= 100, "Invalid loss.")
+                 && call.assert(latency >= 0, "Invalid latency.")
+                 && call.assert(jitter >= 0, "Invalid jitter.")
+                 && call.assert(user_id == g::state().id, "This command can only be executed locally.");
+        }); v)
+      {
+        auto [key, loss, latency, jitter] = *v;
+        online::net_sim.loss = loss;
+        online::net_sim.latency = latency;
+        online::net_sim.jitter = jitter;
+        bc::info(user_id, "Simulating {}% loss and {} ms latency with {} ms jitter on UDP.", loss, latency, jitter);
       }
       else goto invalid_args;
     }
@@ -1183,13 +1348,13 @@ namespace czh::cmd
     }
     else if (call.is("save"))
     {
-      std::lock_guard ml(g::mainloop_mtx);
+      std::lock_guard ml(g::mainloop_mtx());
       std::lock_guard dl(draw::drawing_mtx);
       std::string filename;
       if (auto v = call.get_if(
         [&call, &user_id](const std::string& fn)
         {
-          return call.assert(cfg::config.unsafe_mode || user_id == g::state.id,
+          return call.assert(cfg::config().unsafe_mode || user_id == g::state().id,
                              "This command can only be executed by the server itself. (see '/help' for a workaround)");
         }); v)
       {
@@ -1211,13 +1376,13 @@ namespace czh::cmd
     }
     else if (call.is("load"))
     {
-      std::lock_guard ml(g::mainloop_mtx);
+      std::lock_guard ml(g::mainloop_mtx());
       std::lock_guard dl(draw::drawing_mtx);
       std::string filename;
       if (auto v = call.get_if(
         [&call, &user_id](const std::string& fn)
         {
-          return call.assert(cfg::config.unsafe_mode || user_id == g::state.id,
+          return call.assert(cfg::config().unsafe_mode || user_id == g::state().id,
                              "This command can only be executed by the server itself. (see '/help' for a workaround)");
         }); v)
       {
@@ -1242,6 +1407,48 @@ namespace czh::cmd
       draw::state.inited = false;
       bc::info(user_id, "Loaded from '{}'.", filename);
     }
+    else if (call.is("record"))
+    {
+      std::lock_guard ml(g::mainloop_mtx());
+      std::lock_guard dl(draw::drawing_mtx);
+      if (g::state().mode == g::Mode::CLIENT)
+      {
+        bc::error(user_id, "Recording is only available in native or server mode.");
+        return;
+      }
+      if (auto v = call.get_if(
+        [&call, &user_id](const std::string& action)
+        {
+          return call.assert(action == "start", "Invalid action.")
+                 && call.assert(cfg::config().unsafe_mode || user_id == g::state().id,
+                                "This command can only be executed by the server itself. (see '/help' for a workaround)")
+                 && call.assert(!rec::is_recording(), "Already recording.");
+        }); v)
+      {
+        rec::start();
+        bc::info(user_id, "Recording started at tick {}.", g::state().tick);
+      }
+      else if (auto v = call.get_if(
+        [&call, &user_id](const std::string& action, const std::string& fn)
+        {
+          return call.assert(action == "stop", "Invalid action.")
+                 && call.assert(cfg::config().unsafe_mode || user_id == g::state().id,
+                                "This command can only be executed by the server itself. (see '/help' for a workaround)")
+                 && call.assert(rec::is_recording(), "Not recording.");
+        }); v)
+      {
+        auto [action, filename] = *v;
+        auto recording = rec::stop();
+        if (auto err = rec::save(recording, filename); err.has_value())
+        {
+          bc::error(user_id, *err);
+          return;
+        }
+        bc::info(user_id, "Recorded {} ticks, {} entries to '{}'.",
+                 recording.hashes.size(), recording.entries.size(), filename);
+      }
+      else goto invalid_args;
+    }
     else
     {
       bc::error(user_id, "Invalid command. Type '/help' for more infomation.");
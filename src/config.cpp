@@ -17,11 +17,20 @@
 
 namespace czh::cfg
 {
-  Config config
+  const Config default_config
   {
     .tick = std::chrono::milliseconds(16),
+    .max_catch_up = 3,
+    .max_fps = 60,
     .msg_ttl = std::chrono::milliseconds(2000),
     .unsafe_mode = false,
-    .long_pressing_threshold = 80000
+    .long_pressing_threshold = 80000,
+    .lod_near = 32,
+    .lod_far = 256,
+    .lod_interval = 4,
+    .msg_max_count = 4096,
+    .msg_max_bytes = 1 << 20,
+    .msg_max_age = std::chrono::hours(1),
+    .max_map_changes = 4096
   };
 }
@@ -19,10 +19,12 @@
 #include "tank/input.h"
 #include "tank/online.h"
 #include "tank/term.h"
+#include "tank/world.h"
 #include "tank/utils/debug.h"
 #include "tank/utils/utils.h"
 
 #include <iomanip>
+#include <memory>
 #include <mutex>
 #include <ranges>
 #include <string>
@@ -46,6 +48,12 @@ namespace czh::draw
     Style{.background = 15, .wall = 9, .tanks = {10, 3, 4, 5, 6, 11, 12, 13, 14, 57, 100, 214}}
   };
   std::mutex drawing_mtx;
+
+  // Guards the mailbox between the simulation thread and the render thread.
+  std::mutex snapshot_mtx;
+  std::unique_ptr<Snapshot> pending_snapshot;
+  map::Zone snapshot_zone = state.visible_zone.bigger_zone(10);
+  bool has_snapshot = false;
   const PointView empty_point_view{.status = map::Status::END, .tank_id = -1, .text = ""};
   const PointView wall_point_view{.status = map::Status::WALL, .tank_id = -1, .text = ""};
 
@@ -84,21 +92,21 @@ namespace czh::draw
 
   PointView extract_point(const map::Pos& p)
   {
-    if (map::map.has(map::Status::TANK, p))
+    if (map::map().has(map::Status::TANK, p))
     {
       return {
-        .status = map::Status::TANK, .tank_id = static_cast<int>(map::map.at(p).get_tank()->get_id()), .text = ""
+        .status = map::Status::TANK, .tank_id = static_cast<int>(map::map().at(p).get_tank()->get_id()), .text = ""
       };
     }
-    else if (map::map.has(map::Status::BULLET, p))
+    else if (map::map().has(map::Status::BULLET, p))
     {
       return {
         .status = map::Status::BULLET,
-        .tank_id = static_cast<int>(map::map.at(p).get_bullets()[0]->get_tank()),
-        .text = map::map.at(p).get_bullets()[0]->get_text()
+        .tank_id = static_cast<int>(map::map().at(p).get_bullets()[0]->get_tank()),
+        .text = map::map().at(p).get_bullets()[0]->get_text()
       };
     }
-    else if (map::map.has(map::Status::WALL, p))
+    else if (map::map().has(map::Status::WALL, p))
     {
       return {.status = map::Status::WALL, .tank_id = -1, .text = ""};
     }
@@ -112,12 +120,12 @@ namespace czh::draw
   MapView extract_map(const map::Zone& zone)
   {
     MapView ret;
-    ret.seed = map::map.seed;
+    ret.seed = map::map().seed;
     for (int i = zone.x_min; i < zone.x_max; ++i)
     {
       for (int j = zone.y_min; j < zone.y_max; ++j)
       {
-        if (!map::map.at(i, j).is_generated())
+        if (!map::map().at(i, j).is_generated())
         {
           ret.view[map::Pos{i, j}] = extract_point({i, j});
         }
@@ -126,34 +134,36 @@ namespace czh::draw
     return ret;
   }
 
-  std::map<size_t, TankView> extract_tanks()
+  TankView extract_tank(const tank::Tank* t)
   {
-    std::map<size_t, TankView> view;
-    for (auto& r : g::state.tanks | std::views::values)
+    auto tv = TankView{
+      .id = t->get_id(),
+      .name = t->name,
+      .max_hp = t->max_hp,
+      .hp = t->hp,
+      .is_auto = t->is_auto(),
+      .is_alive = t->is_alive(),
+      .pos = t->pos,
+      .direction = t->direction,
+      .bullet_lethality = t->bullet_lethality
+    };
+    if (auto at = tank::get_if<tank::AutoTank>(t); at != nullptr)
     {
-      auto tv = TankView{
-        .id = r->get_id(),
-        .name = r->name,
-        .max_hp = r->max_hp,
-        .hp = r->hp,
-        .is_auto = r->is_auto,
-        .is_alive = r->is_alive(),
-        .pos = r->pos,
-        .direction = r->direction,
-        .bullet_lethality = r->bullet_lethality
-      };
-      if (r->is_auto)
+      if (at->is_target_good())
       {
-        auto at = dynamic_cast<tank::AutoTank*>(r);
-        if (at->is_target_good())
-        {
-          tv.gap = at->gap;
-          tv.has_good_target = true;
-          tv.target_id = at->get_target_id();
-        }
+        tv.gap = at->gap;
+        tv.has_good_target = true;
+        tv.target_id = at->get_target_id();
       }
-      view[r->get_id()] = tv;
     }
+    return tv;
+  }
+
+  std::map<size_t, TankView> extract_tanks()
+  {
+    std::map<size_t, TankView> view;
+    for (auto& r : g::state().tanks | std::views::values)
+      view[r->get_id()] = extract_tank(r);
     return view;
   }
 
@@ -168,7 +178,7 @@ namespace czh::draw
   std::map<size_t, UserView> extract_userinfo()
   {
     std::map<size_t, UserView> view;
-    for (auto& r : g::state.users)
+    for (auto& r : g::state().users)
     {
       view[r.first] = UserView{.user_id = r.second.user_id, .ip = r.second.ip, .active = r.second.active};
     }
@@ -423,16 +433,69 @@ namespace czh::draw
             (state.visible_zone.y_min + y_offset > pos.y) || (state.visible_zone.y_max - y_offset <= pos.y));
   }
 
+  void publish_snapshot(Snapshot snapshot)
+  {
+    std::lock_guard sl(snapshot_mtx);
+    // The render thread hasn't drawn the last one, drop it but keep its changes.
+    if (pending_snapshot != nullptr)
+    {
+      snapshot.changes.merge(pending_snapshot->changes);
+      snapshot.full_resync |= pending_snapshot->full_resync;
+    }
+    pending_snapshot = std::make_unique<Snapshot>(std::move(snapshot));
+  }
+
+  map::Zone get_snapshot_zone()
+  {
+    std::lock_guard sl(snapshot_mtx);
+    return snapshot_zone;
+  }
+
+  void set_snapshot_zone(const map::Zone& zone)
+  {
+    std::lock_guard sl(snapshot_mtx);
+    snapshot_zone = zone;
+  }
+
+  // Moves the latest published snapshot into state.snapshot. Returns false if there is none.
+  bool consume_snapshot()
+  {
+    std::unique_ptr<Snapshot> latest;
+    //
+    {
+      std::lock_guard sl(snapshot_mtx);
+      latest = std::move(pending_snapshot);
+    }
+    if (latest == nullptr)
+      return false;
+    if (latest->full_resync || latest->map.seed != state.snapshot.map.seed)
+      state.inited = false;
+    state.snapshot = std::move(*latest);
+    has_snapshot = true;
+    return true;
+  }
+
   int update_snapshot()
   {
-    if (g::state.mode == g::Mode::SERVER || g::state.mode == g::Mode::NATIVE)
+    if (g::state().mode == g::Mode::SERVER || g::state().mode == g::Mode::NATIVE)
     {
-      state.snapshot.map = extract_map(state.visible_zone.bigger_zone(10));
-      state.snapshot.tanks = extract_tanks();
-      state.snapshot.changes = g::state.users[g::state.id].map_changes;
-      g::state.users[g::state.id].map_changes.clear();
-      g::state.users[g::state.id].visible_zone = state.visible_zone;
-      state.snapshot.userinfo = extract_userinfo();
+      auto zone = get_snapshot_zone();
+      Snapshot snapshot;
+      //
+      {
+        std::lock_guard ml(g::mainloop_mtx());
+        snapshot.map = extract_map(zone);
+        snapshot.tanks = extract_tanks();
+        auto& user = g::state().users[g::state().id];
+        snapshot.changes = std::move(user.map_changes);
+        snapshot.full_resync = user.full_resync;
+        user.map_changes.clear();
+        user.full_resync = false;
+        g::set_visible_zone(g::state().id, zone.bigger_zone(-10));
+        snapshot.userinfo = extract_userinfo();
+      }
+      snapshot.zone = zone;
+      publish_snapshot(std::move(snapshot));
       return 0;
     }
     else
@@ -442,6 +505,7 @@ namespace czh::draw
         return 0;
       else
       {
+        std::lock_guard dl(drawing_mtx);
         state.inited = false;
         return -1;
       }
@@ -449,6 +513,12 @@ namespace czh::draw
     return -1;
   }
 
+  bool snapshot_covers(const map::Zone& zone)
+  {
+    const auto& z = state.snapshot.zone;
+    return z.x_min <= zone.x_min && z.x_max >= zone.x_max && z.y_min <= zone.y_min && z.y_max >= zone.y_max;
+  }
+
   // beg, end, lineno
   std::tuple<size_t, size_t, std::string> text_display_helper(size_t display_height, size_t content_pos,
                                                               size_t content_size)
@@ -627,6 +697,12 @@ Command:
   status
     - show Status page.
 
+  timing (reset)
+    - Show the statistics of the game's(or server's) tick timing.
+    - Late: ticks that started noticeably after their deadline.
+    - Overruns: ticks whose work took longer than one tick.
+    - reset: clear the statistics.
+
   quit
     - Quit Tank.
 
@@ -642,8 +718,12 @@ Command:
   load [filename]
     - load the game from a file.
 
+  record start (or stop [filename])
+    - Record the game from now on, and write it to the file when stopped.
+    - Replay it with 'tank --headless --replay [filename]'.
+
     Note:
-      Normally save and load can only be executed by the server itself, but you can use 'set unsafe true' to get around it. Notice that it is dangerous to let remote user access to your filesystem.
+      Normally save, load and record can only be executed by the server itself, but you can use 'set unsafe true' to get around it. Notice that it is dangerous to let remote user access to your filesystem.
 
   fill [Status] [A x,y] [B x,y optional]
     - Status: [0] Empty [1] Wall
@@ -696,6 +776,24 @@ Command:
       - TTL (int, milliseconds): a message's time to live.
   set longPressTH [threshold]
       - threshold (int, microseconds): long pressing threshold.
+  set catchUp [steps]
+      - steps (int): maximum extra steps a late tick runs to catch up. 0 to disable.
+  set fps [fps]
+      - fps (int): maximum frame rate of the screen. It doesn't affect the game's speed.
+  set lodNear [distance]
+      - distance (int, cells): AutoTanks within this distance of any user's view are fully simulated.
+  set lodFar [distance]
+      - distance (int, cells): AutoTanks further than lodNear only wander, those beyond lodFar are frozen until someone comes close.
+  set lodInterval [ticks]
+      - ticks (int): how often the wandering AutoTanks move.
+  set msgMaxCount [count]
+      - count (int): maximum number of messages kept, read or not. The oldest are dropped first.
+  set msgMaxBytes [bytes]
+      - bytes (int): maximum size of the messages kept.
+  set msgMaxAge [age]
+      - age (int, milliseconds): messages older than it are dropped. It shall >= msgTTL.
+  set maxMapChanges [count]
+      - count (int): a user with more pending map changes is redrawn entirely instead.
   set seed [seed]
       - seed (int): the game map's seed.
   set unsafe [bool]
@@ -717,14 +815,28 @@ Command:
   server stop
     - Stop Tank Server.
 
-  connect [ip] [port] (as [id])
+  connect [ip] [port] (in [room]) (as [id])
     - Connect to Tank Server.
     - ip (string): the server's IP.
     - port (int): the server's port.
+    - room (string, optional): join a separate game hosted by the server, created when the first player joins
+      and closed when the last one leaves. A server hosts at most 32 rooms, with names of at most 32 characters.
+      Without it, join the server's own game.
     - id (int, optional): login as the remote user id.
 
   disconnect
     - Disconnect from the Server.
+
+  net udp (or tcp)
+    - Receive frames and send inputs over UDP (or TCP, the default) from the next connection.
+      Login and ping stay on TCP.
+  net sim [loss] [latency] (jitter)
+    - Simulate a bad network on the received UDP datagrams.
+    - loss (int): the percentage of datagrams dropped.
+    - latency (int): the delay in milliseconds.
+    - jitter (int, optional): the random extra delay in milliseconds.
+  net sim off
+    - Stop the simulation.
 )";
     static auto raw_lines = help | std::views::split('\n');
     state.help_text.clear();
@@ -743,11 +855,14 @@ Command:
 
   void draw()
   {
-    if (g::state.suspend)
+    if (g::state().suspend)
       return;
-    term::hide_cursor();
-    // std::lock_guard ml(g::mainloop_mtx);
+    // std::lock_guard ml(g::mainloop_mtx());
     std::lock_guard dl(drawing_mtx);
+    consume_snapshot();
+    if (!has_snapshot)
+      return;
+    term::hide_cursor();
 
     if (state.height != term::get_height() || state.width != term::get_width())
     {
@@ -762,16 +877,19 @@ Command:
       }
       update_help_text();
     }
-    switch (g::state.page)
+    switch (g::state().page)
     {
       case g::Page::GAME:
       {
         // check zone
         if (!view_id_at(state.focus).has_value())
-          state.focus = g::state.id;
+          state.focus = g::state().id;
+        if (!view_id_at(state.focus).has_value())
+          return;
         if (!check_zone_size(state.visible_zone))
         {
           state.visible_zone = get_visible_zone(state.focus);
+          set_snapshot_zone(state.visible_zone.bigger_zone(10));
           state.inited = false;
           return;
         }
@@ -784,20 +902,21 @@ Command:
           {
             state.visible_zone = get_visible_zone(state.focus);
             state.inited = false;
-            int r = update_snapshot();
-            if (r != 0)
-              return;
           }
           else
           {
             move = view_id_at(state.focus)->direction;
             next_zone(move);
           }
+          set_snapshot_zone(state.visible_zone.bigger_zone(10));
         }
 
         // output
         if (!state.inited)
         {
+          // Wait for a snapshot of the new zone.
+          if (!snapshot_covers(state.visible_zone))
+            return;
           term::move_cursor({0, 0});
           for (int j = state.visible_zone.y_max - 1; j >= state.visible_zone.y_min; j--)
           {
@@ -1040,7 +1159,7 @@ Command:
       break;
       case g::Page::NOTIFICATION:
       {
-        auto& msgs = g::state.users[g::state.id].messages;
+        std::lock_guard sl(bc::send_msg_mtx());
         const auto add_notification_text = [](const msg::Message& msg) -> size_t
         {
           auto time = std::chrono::system_clock::to_time_t(
@@ -1095,29 +1214,18 @@ Command:
         {
           term::clear();
           state.notification_text.clear();
-          for (const auto& msg : msgs)
-            add_notification_text(msg);
+          for (const auto& msg : bc::get_messages(g::state().id))
+            add_notification_text(*msg);
           output_notification();
-          for (auto& r : msgs)
-          {
-            if (!r.read)
-              r.read = true;
-          }
+          bc::mark_all_read(g::state().id);
           state.inited = true;
         }
         else
         {
-          bool updated = false;
-          for (auto& r : msgs)
-          {
-            if (!r.read)
-            {
-              r.read = true;
-              state.notification_pos += add_notification_text(r);
-              updated = true;
-            }
-          }
-          if (updated)
+          auto unread = bc::take_unread(g::state().id);
+          for (auto& r : unread)
+            state.notification_pos += add_notification_text(*r);
+          if (!unread.empty())
             output_notification();
         }
       }
@@ -1128,27 +1236,34 @@ Command:
     {
       std::string right = "Tank Version 0.2.1 (Compile: " + std::string(__DATE__) + ")";
       std::string left;
-      if (g::state.mode == g::Mode::NATIVE)
+      if (g::state().mode == g::Mode::NATIVE)
         left += "Native Mode";
-      else if (g::state.mode == g::Mode::SERVER)
+      else if (g::state().mode == g::Mode::SERVER)
       {
         left += "Server Mode | Port: " + std::to_string(online::svr.get_port()) + " | ";
-        size_t active_users =
-            std::ranges::count_if(g::state.users | std::views::values, [](auto&& u) { return u.active; });
-
-        left += "User: " + std::to_string(active_users) + "/" + std::to_string(g::state.users.size());
+        // The users as of the last snapshot, g::state() is only read under mainloop_mtx.
+        auto& users = state.snapshot.userinfo;
+        size_t active_users = std::ranges::count_if(users | std::views::values, [](auto&& u) { return u.active; });
+        left += "User: " + std::to_string(active_users) + "/" + std::to_string(users.size());
+        if (auto rooms = g::get_room_names().size(); rooms != 0)
+          left += " | Rooms: " + std::to_string(rooms);
       }
-      else if (g::state.mode == g::Mode::CLIENT)
+      else if (g::state().mode == g::Mode::CLIENT)
       {
         left += "Client Mode | ";
-        left += "ID: " + std::to_string(g::state.id) + " | Connected to " + online::cli.get_host() + ":" +
-            std::to_string(online::cli.get_port()) + " | ";
-        if (online::state.delay < 50)
-          left += utils::color_256_fg(std::to_string(online::state.delay) + " ms", 2);
-        else if (online::state.delay < 100)
-          left += utils::color_256_fg(std::to_string(online::state.delay) + " ms", 11);
+        left += "ID: " + std::to_string(g::state().id) + " | Connected to " + online::cli.get_host() + ":" +
+            std::to_string(online::cli.get_port()) + (online::cli.is_udp() ? " (UDP)" : "") + " | ";
+        if (auto room = online::cli.get_room(); !room.empty())
+          left += "Room: " + room + " | ";
+        int delay = online::state.delay;
+        if (delay < 50)
+          left += utils::color_256_fg(std::to_string(delay) + " ms", 2);
+        else if (delay < 100)
+          left += utils::color_256_fg(std::to_string(delay) + " ms", 11);
         else
-          left += utils::color_256_fg(std::to_string(online::state.delay) + " ms", 9);
+          left += utils::color_256_fg(std::to_string(delay) + " ms", 9);
+        if (size_t dropped = online::state.dropped_frames; dropped != 0)
+          left += " | Dropped frames: " + std::to_string(dropped);
       }
       term::output("\x1b[2K");
       flexible_output(left, right);
@@ -1167,16 +1282,17 @@ Command:
     }
     else
     {
+      std::lock_guard sl(bc::send_msg_mtx());
       term::move_cursor(term::TermPos(0, state.height - 1));
-      if (g::state.users[g::state.id].messages.empty())
+      if (!bc::has_messages(g::state().id))
         show_info();
       else
       {
         auto now = std::chrono::steady_clock::now();
         auto d2 = std::chrono::duration_cast<std::chrono::milliseconds>(now - state.last_message_displayed);
-        if (d2 > cfg::config.msg_ttl)
+        if (d2 > cfg::config().msg_ttl)
         {
-          auto msg = bc::read_message(g::state.id);
+          auto msg = bc::read_message(g::state().id);
           if (msg.has_value())
           {
             std::string str = ((msg->from == bc::from_system) ? "" : std::to_string(msg->from) + ": ") + msg->content;
@@ -0,0 +1,175 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#include "tank/env.h"
+#include "tank/drawing.h"
+#include "tank/game.h"
+#include "tank/utils/debug.h"
+
+#include <algorithm>
+#include <latch>
+#include <mutex>
+#include <ranges>
+#include <string>
+
+namespace czh::env
+{
+  VecEnv::VecEnv(const Options& options_)
+    : options(options_), envs(options_.num_envs)
+  {
+    dbg::tank_assert(options.num_envs != 0 && options.view_radius >= 0, "Invalid env::Options.");
+    result.observations.resize(options.num_envs * obs_size());
+    result.rewards.resize(options.num_envs);
+    result.dones.resize(options.num_envs);
+  }
+
+  size_t VecEnv::size() const
+  {
+    return envs.size();
+  }
+
+  size_t VecEnv::obs_side() const
+  {
+    return static_cast<size_t>(options.view_radius) * 2 + 1;
+  }
+
+  size_t VecEnv::obs_size() const
+  {
+    return obs_side() * obs_side();
+  }
+
+  template<typename Func>
+  void VecEnv::for_each_env(Func&& f)
+  {
+    size_t shard_num = (std::min)(pool.size() + 1, envs.size());
+    size_t shard_size = (envs.size() + shard_num - 1) / shard_num;
+    shard_num = (envs.size() + shard_size - 1) / shard_size;
+
+    std::latch done(static_cast<std::ptrdiff_t>(shard_num - 1));
+    for (size_t s = 1; s < shard_num; ++s)
+    {
+      pool.add_task([&f, &done, this, s, shard_size]
+      {
+        for (size_t i = s * shard_size; i < (std::min)((s + 1) * shard_size, envs.size()); ++i)
+          f(i);
+        done.count_down();
+      });
+    }
+    for (size_t i = 0; i < (std::min)(shard_size, envs.size()); ++i)
+      f(i);
+    done.wait();
+  }
+
+  const std::vector<Cell>& VecEnv::reset(uint64_t seed)
+  {
+    for (size_t i = 0; i < envs.size(); ++i)
+      envs[i].seeds = utils::Xoshiro256{seed, i};
+    for_each_env([this](size_t i)
+    {
+      reset_env(i, envs[i].seeds());
+      result.rewards[i] = 0;
+      result.dones[i] = 0;
+    });
+    return result.observations;
+  }
+
+  const StepResult& VecEnv::step(const std::vector<Action>& actions)
+  {
+    dbg::tank_assert(actions.size() == envs.size(), "Expected an action for each env.");
+    for_each_env([this, &actions](size_t i) { step_env(i, actions[i]); });
+    return result;
+  }
+
+  void VecEnv::reset_env(size_t i, uint64_t seed)
+  {
+    auto& env = envs[i];
+    env.world = std::make_unique<g::World>("env " + std::to_string(i));
+    g::WorldScope scope(*env.world);
+    map::map().seed = seed;
+    utils::seed_rand(seed);
+
+    std::lock_guard ml(g::mainloop_mtx());
+    // A user, so that the AutoTanks around the agent are simulated. (see cfg::Config::lod_near)
+    env.agent = g::add_user(options.zone, "");
+    g::add_auto_tanks(options.auto_tanks, options.auto_tank_lvl, options.zone, env.agent);
+    env.steps = 0;
+    env.hp = g::id_at(env.agent)->hp;
+    env.auto_tanks = g::state().tanks.size() - 1;
+    observe(i);
+  }
+
+  void VecEnv::step_env(size_t i, const Action& action)
+  {
+    auto& env = envs[i];
+    {
+      g::WorldScope scope(*env.world);
+      auto agent = g::id_at(env.agent);
+      if (action.has_value())
+        g::tank_react(env.agent, *action);
+      {
+        std::lock_guard ml(g::mainloop_mtx());
+        auto r = options.view_radius;
+        g::set_visible_zone(env.agent, {agent->pos.x - r, agent->pos.x + r + 1, agent->pos.y - r, agent->pos.y + r + 1});
+      }
+      g::mainloop();
+      ++env.steps;
+
+      size_t auto_tanks = std::ranges::count_if(g::state().tanks | std::views::values,
+                                                [](auto&& t) { return t->is_auto() && t->is_alive(); });
+      float reward = static_cast<float>(env.auto_tanks - auto_tanks)
+                     - static_cast<float>(env.hp - agent->hp) / static_cast<float>(agent->max_hp);
+      if (!agent->is_alive())
+        reward -= 1;
+      env.auto_tanks = auto_tanks;
+      env.hp = agent->hp;
+
+      result.rewards[i] = reward;
+      result.dones[i] = !agent->is_alive() || auto_tanks == 0 || env.steps >= options.max_steps;
+      if (!result.dones[i])
+      {
+        observe(i);
+        return;
+      }
+    }
+    reset_env(i, env.seeds());
+  }
+
+  void VecEnv::observe(size_t i)
+  {
+    auto& env = envs[i];
+    auto pos = g::id_at(env.agent)->pos;
+    auto obs = result.observations.begin() + static_cast<std::ptrdiff_t>(i * obs_size());
+    for (int y = pos.y + options.view_radius; y >= pos.y - options.view_radius; --y)
+    {
+      for (int x = pos.x - options.view_radius; x <= pos.x + options.view_radius; ++x)
+      {
+        auto point = draw::extract_point({x, y});
+        switch (point.status)
+        {
+          case map::Status::WALL:
+            *obs++ = Cell::WALL;
+            break;
+          case map::Status::TANK:
+            *obs++ = static_cast<size_t>(point.tank_id) == env.agent ? Cell::SELF : Cell::TANK;
+            break;
+          case map::Status::BULLET:
+            *obs++ = Cell::BULLET;
+            break;
+          default:
+            *obs++ = Cell::EMPTY;
+            break;
+        }
+      }
+    }
+  }
+}
@@ -12,77 +12,113 @@
 //   See the License for the specific language governing permissions and
 //   limitations under the License.
 #include "tank/game.h"
+#include <algorithm>
+#include <latch>
+#include <limits>
 #include <list>
+#include <map>
 #include <mutex>
 #include <optional>
 #include <ranges>
+#include <set>
+#include <thread>
 #include <tank/drawing.h>
 #include <tank/online.h>
 #include <vector>
 #include "tank/broadcast.h"
 #include "tank/bullet.h"
 #include "tank/game_map.h"
+#include "tank/record.h"
 #include "tank/tank.h"
+#include "tank/world.h"
 #include "tank/utils/debug.h"
+#include "tank/utils/thpool.h"
 #include "tank/utils/utils.h"
 
 namespace czh::g
 {
-  GameState state{
-    .running = true,
-    .suspend = false,
-    .mode = Mode::NATIVE,
-    .page = Page::MAIN,
-    .users = {{0, g::UserData{.user_id = 0, .active = true}}},
-    .id = 0,
-    .next_id = 0,
-    .next_bullet_id = 0
-  };
-  std::mutex mainloop_mtx;
-  std::mutex tank_reacting_mtx;
+  // Consecutive misses before rejection sampling gives up and scans the zone, e.g. in a zone full of walls.
+  constexpr size_t max_sampling_misses = 64;
 
-  std::optional<map::Pos> get_available_pos(const map::Zone& zone)
+  bool is_available(const map::Pos& pos)
+  {
+    return !map::map().has(map::Status::WALL, pos) && !map::map().has(map::Status::TANK, pos);
+  }
+
+  std::vector<map::Pos> get_available_pos(const map::Zone& zone, size_t n)
   {
+    std::vector<map::Pos> ret;
+    if (n == 0 || zone.x_min >= zone.x_max || zone.y_min >= zone.y_max)
+      return ret;
+
+    // Most of a zone is usually free, so a few random cells are enough.
+    std::set<map::Pos> taken;
+    size_t misses = 0;
+    while (ret.size() < n && misses < max_sampling_misses)
+    {
+      map::Pos pos{
+        utils::randnum<int>(zone.x_min, zone.x_max),
+        utils::randnum<int>(zone.y_min, zone.y_max)
+      };
+      if (is_available(pos) && taken.insert(pos).second)
+      {
+        ret.emplace_back(pos);
+        misses = 0;
+      }
+      else
+        ++misses;
+    }
+    if (ret.size() == n)
+      return ret;
+
     std::vector<map::Pos> p;
     for (int i = zone.x_min; i < zone.x_max; ++i)
     {
       for (int j = zone.y_min; j < zone.y_max; ++j)
       {
-        if (!map::map.has(map::Status::WALL, {i, j}) && !map::map.has(map::Status::TANK, {i, j}))
-        {
+        if (is_available({i, j}) && !taken.contains({i, j}))
           p.emplace_back(map::Pos{i, j});
-        }
       }
     }
-    if (p.empty())
+    // Partial Fisher-Yates shuffle, the first ones are the picked.
+    for (size_t i = 0; i < p.size() && ret.size() < n; ++i)
     {
-      return std::nullopt;
+      std::swap(p[i], p[utils::randnum<size_t>(i, p.size())]);
+      ret.emplace_back(p[i]);
     }
-    return p[utils::randnum<size_t>(0, p.size())];
+    return ret;
+  }
+
+  std::optional<map::Pos> get_available_pos(const map::Zone& zone)
+  {
+    auto pos = get_available_pos(zone, 1);
+    if (pos.empty())
+      return std::nullopt;
+    return pos[0];
   }
 
   tank::Tank* id_at(size_t id)
   {
-    auto it = state.tanks.find(id);
-    if (it == state.tanks.end())
+    auto it = state().tanks.find(id);
+    if (it == state().tanks.end())
       return nullptr;
     return it->second;
   }
 
   std::size_t add_tank(const map::Pos& pos, size_t from_id)
   {
-    if (map::map.has(map::Status::WALL, pos) || map::map.has(map::Status::TANK, pos))
+    if (map::map().has(map::Status::WALL, pos) || map::map().has(map::Status::TANK, pos))
     {
       bc::error(from_id, "No available space.");
       return 0;
     }
 
-    state.tanks.insert({
-      state.next_id, new tank::NormalTank(state.next_id, "Tank " + std::to_string(state.next_id),
+    state().tanks.insert({
+      state().next_id, new tank::NormalTank(state().next_id, "Tank " + std::to_string(state().next_id),
                                           10000, pos, 1, 100, 60)
     });
-    ++state.next_id;
-    return state.next_id - 1;
+    ++state().next_id;
+    return state().next_id - 1;
   }
 
   std::size_t add_tank(const map::Zone& zone, size_t from_id)
@@ -96,22 +132,42 @@ namespace czh::g
     return add_tank(*pos, from_id);
   }
 
+  tank::AutoTank* new_auto_tank(std::size_t id, std::size_t lvl, const map::Pos& pos)
+  {
+    return new tank::AutoTank(id, "AutoTank " + std::to_string(id),
+                              static_cast<int>(11 - lvl) * 150, pos, static_cast<int>(10 - lvl), 1,
+                              static_cast<int>(11 - lvl) * 15, 60);
+  }
+
   std::size_t add_auto_tank(std::size_t lvl, const map::Pos& pos, size_t from_id)
   {
-    if (map::map.has(map::Status::WALL, pos) || map::map.has(map::Status::TANK, pos))
+    if (map::map().has(map::Status::WALL, pos) || map::map().has(map::Status::TANK, pos))
     {
       bc::error(from_id, "No available space.");
       return 0;
     }
 
-    state.tanks.insert(
-      {
-        state.next_id, new tank::AutoTank(state.next_id, "AutoTank " + std::to_string(state.next_id),
-                                          static_cast<int>(11 - lvl) * 150, pos, static_cast<int>(10 - lvl), 1,
-                                          static_cast<int>(11 - lvl) * 15, 60)
-      });
-    ++state.next_id;
-    return state.next_id - 1;
+    state().tanks.insert({state().next_id, new_auto_tank(state().next_id, lvl, pos)});
+    ++state().next_id;
+    return state().next_id - 1;
+  }
+
+  std::vector<std::size_t> add_auto_tanks(std::size_t n, std::size_t lvl, const map::Zone& zone, size_t from_id)
+  {
+    auto pos = get_available_pos(zone, n);
+    if (pos.size() < n)
+      bc::error(from_id, "No available space for {} AutoTanks.", n - pos.size());
+
+    std::vector<std::size_t> ids;
+    ids.reserve(pos.size());
+    for (auto& p : pos)
+    {
+      // IDs only grow, so each tank goes at the end.
+      auto id = state().next_id++;
+      state().tanks.emplace_hint(state().tanks.end(), id, new_auto_tank(id, lvl, p));
+      ids.emplace_back(id);
+    }
+    return ids;
   }
 
   std::size_t add_auto_tank(std::size_t lvl, const map::Zone& zone, size_t from_id)
@@ -140,12 +196,63 @@ namespace czh::g
     }
   }
 
+  std::size_t add_user(const map::Zone& zone, const std::string& ip)
+  {
+    auto id = add_tank(zone, state().id);
+    state().users[id] = UserData{
+      .user_id = id,
+      .ip = ip
+    };
+    state().users[id].last_update = std::chrono::steady_clock::now();
+    state().users[id].active = true;
+    rec::record({.type = rec::EntryType::ADD_USER, .user = id, .zone = zone});
+    return id;
+  }
+
+  void remove_user(std::size_t id)
+  {
+    rec::record({.type = rec::EntryType::REMOVE_USER, .user = id});
+    state().tanks[id]->kill();
+    state().tanks[id]->clear();
+    delete state().tanks[id];
+    state().tanks.erase(id);
+    state().users.erase(id);
+  }
+
+  void login(std::size_t id, const map::Zone& zone)
+  {
+    rec::record({.type = rec::EntryType::LOGIN, .user = id, .zone = zone});
+    revive(id, zone, id);
+    state().users[id].last_update = std::chrono::steady_clock::now();
+    state().users[id].active = true;
+    // Changes aren't kept while offline.
+    state().users[id].full_resync = true;
+  }
+
+  void set_visible_zone(std::size_t id, const map::Zone& zone)
+  {
+    auto& user = state().users[id];
+    if (user.visible_zone == zone)
+      return;
+    user.visible_zone = zone;
+    rec::record({.type = rec::EntryType::VIEW, .user = id, .zone = zone});
+  }
+
+  void logout(std::size_t id)
+  {
+    rec::record({.type = rec::EntryType::LOGOUT, .user = id});
+    state().tanks[id]->kill();
+    state().tanks[id]->clear();
+    state().users[id].active = false;
+    state().users[id].map_changes.clear();
+  }
+
   [[nodiscard]] std::vector<std::size_t> get_alive()
   {
     std::vector<std::size_t> ret;
-    for (std::size_t i = 0; i < state.tanks.size(); ++i)
+    for (std::size_t i = 0; i < state().tanks.size(); ++i)
     {
-      if (state.tanks[i]->is_alive())
+      if (state().tanks[i]->is_alive())
       {
         ret.emplace_back(i);
       }
@@ -155,13 +262,13 @@ namespace czh::g
 
   void clear_death()
   {
-    for (auto it = state.bullets.begin(); it != state.bullets.end();)
+    for (auto it = state().bullets.begin(); it != state().bullets.end();)
     {
       if (!(*it)->is_alive())
       {
-        map::map.remove_status(map::Status::BULLET, (*it)->pos);
+        map::map().remove_status(map::Status::BULLET, (*it)->pos);
         delete *it;
-        it = state.bullets.erase(it);
+        it = state().bullets.erase(it);
       }
       else
       {
@@ -169,113 +276,355 @@ namespace czh::g
       }
     }
 
-    for (auto& tank : state.tanks | std::views::values)
+    for (auto& tank : state().tanks | std::views::values)
     {
       if (!tank->is_alive() && !tank->has_cleared())
         tank->clear();
     }
   }
 
+  std::size_t kill_tanks(const std::function<bool(const tank::Tank*)>& pred)
+  {
+    std::size_t killed = 0;
+    for (auto& tank : state().tanks | std::views::values)
+    {
+      if (tank->is_alive() && pred(tank))
+      {
+        tank->kill();
+        ++killed;
+      }
+    }
+    clear_death();
+    return killed;
+  }
+
+  std::size_t remove_tanks(const std::function<bool(const tank::Tank*)>& pred)
+  {
+    std::set<std::size_t> removing;
+    for (auto& [id, tank] : state().tanks)
+    {
+      if (pred(tank))
+      {
+        removing.insert(id);
+        tank->kill();
+      }
+    }
+    if (removing.empty())
+      return 0;
+
+    for (auto& b : state().bullets)
+    {
+      if (removing.contains(b->get_tank()))
+        b->kill();
+    }
+    clear_death(); // before delete
+    std::erase_if(state().tanks, [&removing](auto&& t)
+    {
+      if (!removing.contains(t.first))
+        return false;
+      delete t.second;
+      return true;
+    });
+    return removing.size();
+  }
+
   void tank_react(std::size_t id, tank::NormalTankEvent event)
   {
-    if (!state.running)
+    if (!state().running)
       return;
+    state().events.emplace(id, event);
+  }
 
-    std::lock_guard l(tank_reacting_mtx);
-    if (id_at(id)->is_alive())
+  // Maximum events processed for one user in a tick, the rest waits for the next tick.
+  constexpr size_t max_events_per_tick = 4;
+  // A user's backlog of movement is capped so that a key-repeat burst can't queue up seconds of it.
+  constexpr size_t max_pending_events = 16;
+  // FIRE and auto-driving events are never evicted, only a flood of them beyond this is refused.
+  constexpr size_t max_pending_kept = 64;
+
+  bool is_move_event(tank::NormalTankEvent e)
+  {
+    switch (e)
     {
-      state.events.emplace_back(id, event);
+      case tank::NormalTankEvent::UP:
+      case tank::NormalTankEvent::DOWN:
+      case tank::NormalTankEvent::LEFT:
+      case tank::NormalTankEvent::RIGHT:
+        return true;
+      default:
+        break;
     }
+    return false;
   }
 
+  bool is_auto_drive_event(tank::NormalTankEvent e)
+  {
+    switch (e)
+    {
+      case tank::NormalTankEvent::UP_AUTO:
+      case tank::NormalTankEvent::DOWN_AUTO:
+      case tank::NormalTankEvent::LEFT_AUTO:
+      case tank::NormalTankEvent::RIGHT_AUTO:
+      case tank::NormalTankEvent::FIRE_AUTO:
+      case tank::NormalTankEvent::AUTO_OFF:
+        return true;
+      default:
+        break;
+    }
+    return false;
+  }
+
+  void add_pending_event(std::size_t id, tank::NormalTankEvent event)
+  {
+    auto& pending = state().pending_events[id];
+    if (!pending.empty() && is_auto_drive_event(event) && is_auto_drive_event(pending.back()))
+    {
+      // Only the last auto-driving state matters.
+      pending.back() = event;
+      return;
+    }
+    // Redundant repeats, e.g. UP UP UP from a key-repeat burst, are one move.
+    if (!pending.empty() && is_move_event(event) && pending.back() == event)
+      return;
+    if (pending.size() >= max_pending_events)
+    {
+      // The oldest movement makes room, FIRE and auto-driving stay.
+      if (auto it = std::ranges::find_if(pending, is_move_event); it != pending.end())
+        pending.erase(it);
+      else if (is_move_event(event) || pending.size() >= max_pending_kept)
+        return;
+    }
+    pending.emplace_back(event);
+  }
+
+  void apply_event(tank::NormalTank* tank, tank::NormalTankEvent event)
+  {
+    switch (event)
+    {
+      case tank::NormalTankEvent::UP:
+        tank->up();
+        break;
+      case tank::NormalTankEvent::DOWN:
+        tank->down();
+        break;
+      case tank::NormalTankEvent::LEFT:
+        tank->left();
+        break;
+      case tank::NormalTankEvent::RIGHT:
+        tank->right();
+        break;
+      case tank::NormalTankEvent::FIRE:
+        tank->fire();
+        break;
+      case tank::NormalTankEvent::UP_AUTO:
+        tank->start_auto_drive(tank::NormalTankEvent::UP);
+        break;
+      case tank::NormalTankEvent::DOWN_AUTO:
+        tank->start_auto_drive(tank::NormalTankEvent::DOWN);
+        break;
+      case tank::NormalTankEvent::LEFT_AUTO:
+        tank->start_auto_drive(tank::NormalTankEvent::LEFT);
+        break;
+      case tank::NormalTankEvent::RIGHT_AUTO:
+        tank->start_auto_drive(tank::NormalTankEvent::RIGHT);
+        break;
+      case tank::NormalTankEvent::FIRE_AUTO:
+        tank->start_auto_drive(tank::NormalTankEvent::FIRE);
+        break;
+      case tank::NormalTankEvent::AUTO_OFF:
+        tank->stop_auto_drive();
+        break;
+    }
+  }
+
+  enum class Lod
+  {
+    FULL,
+    REDUCED,
+    FROZEN
+  };
+
+  std::vector<map::Zone> interest_zones()
+  {
+    std::vector<map::Zone> ret;
+    for (auto& user : state().users | std::views::values)
+    {
+      if (user.active)
+        ret.emplace_back(user.visible_zone);
+    }
+    return ret;
+  }
+
+  Lod get_lod(const map::Pos& pos, const std::vector<map::Zone>& interests)
+  {
+    int distance = std::numeric_limits<int>::max();
+    for (auto& zone : interests)
+      distance = (std::min)(distance, zone.distance(pos));
+    if (distance <= cfg::config().lod_near)
+      return Lod::FULL;
+    if (distance <= cfg::config().lod_far)
+      return Lod::REDUCED;
+    return Lod::FROZEN;
+  }
+
+  // Below it, planning in parallel costs more than it saves.
+  constexpr size_t min_parallel_planning = 64;
+
+  utils::Thpool& planning_pool()
+  {
+    // Shared by all the worlds.
+    static utils::Thpool pool;
+    return pool;
+  }
+
+  int band_of(const map::Pos& pos)
+  {
+    constexpr auto width = static_cast<int>(map::MAP_DIVISION);
+    return pos.x >= 0 ? pos.x / width : (pos.x + 1) / width - 1;
+  }
+
+  // AutoTanks plan against the world as it was at the beginning of the tick, and act
+  // afterward in the order of their IDs, so the result doesn't depend on the number of threads.
+  void plan_auto_tanks(const std::vector<tank::AutoTank*>& tanks)
+  {
+    if (tanks.size() < min_parallel_planning)
+    {
+      for (auto& t : tanks)
+        t->plan();
+      return;
+    }
+
+    // Shards are made of whole MAP_DIVISION-wide bands, so that a thread's
+    // tanks mostly read the same part of the map.
+    std::map<int, std::vector<tank::AutoTank*> > bands;
+    for (auto& t : tanks)
+      bands[band_of(t->pos)].emplace_back(t);
+
+    auto& pool = planning_pool();
+    size_t shard_num = pool.size() + 1;
+    size_t shard_size = (tanks.size() + shard_num - 1) / shard_num;
+    std::vector<std::vector<tank::AutoTank*> > shards(1);
+    for (auto& band : bands | std::views::values)
+    {
+      if (shards.back().size() >= shard_size)
+        shards.emplace_back();
+      shards.back().insert(shards.back().end(), band.begin(), band.end());
+    }
+
+    std::latch done(static_cast<std::ptrdiff_t>(shards.size() - 1));
+    for (size_t i = 1; i < shards.size(); ++i)
+    {
+      pool.add_task([&shard = shards[i], &done, &w = world()]
+      {
+        WorldScope scope(w);
+        for (auto& t : shard)
+          t->plan();
+        done.count_down();
+      });
+    }
+    for (auto& t : shards[0])
+      t->plan();
+    done.wait();
+  }
+
+  // Ticks between two compactions of the messages. (see bc::compact_messages)
+  constexpr size_t compact_interval = 256;
+
   void mainloop()
   {
-    if (!state.running)
+    if (!state().running)
       return;
 
-    std::lock_guard ml(mainloop_mtx);
+    std::lock_guard cl(command_mtx());
+    std::lock_guard ml(mainloop_mtx());
     //std::lock_guard dl(draw::drawing_mtx);
 
     // auto tank
-    for (auto& tank : state.tanks | std::views::values)
+    auto interests = interest_zones();
+    std::vector<tank::AutoTank*> planning;
+    std::vector<std::pair<tank::NormalTank*, tank::NormalTankEvent> > auto_driving;
+    for (auto& tank : state().tanks | std::views::values)
     {
       dbg::tank_assert(tank != nullptr);
-      if (tank->is_alive())
-      {
-        if (tank->is_auto)
-          dynamic_cast<tank::AutoTank*>(tank)->react();
-        else
-        {
-          auto n = dynamic_cast<tank::NormalTank*>(tank);
-          if (n->is_auto_driving())
-            state.events.emplace_back(tank->get_id(), n->get_auto_event());
-        }
-      }
+      if (!tank->is_alive())
+        continue;
+      tank::visit(tank, utils::Overloaded{
+                    [&interests, &planning](tank::AutoTank* t)
+                    {
+                      switch (get_lod(t->pos, interests))
+                      {
+                        case Lod::FULL:
+                          t->wake(state().tick);
+                          planning.emplace_back(t);
+                          break;
+                        case Lod::REDUCED:
+                          t->wake(state().tick);
+                          // Staggered, so that not all of them move at the same tick.
+                          if ((state().tick + t->get_id()) % cfg::config().lod_interval == 0)
+                            t->react_cheap(cfg::config().lod_interval);
+                          break;
+                        case Lod::FROZEN:
+                          break;
+                      }
+                    },
+                    [&auto_driving](tank::NormalTank* n)
+                    {
+                      if (n->is_auto_driving())
+                        auto_driving.emplace_back(n, n->get_auto_event());
+                    }
+                  });
     }
 
+    plan_auto_tanks(planning);
+    for (auto& t : planning)
+      t->act();
+
     // normal tank
+    state().events.drain([](std::pair<std::size_t, tank::NormalTankEvent>&& e)
+    {
+      rec::record({.type = rec::EntryType::EVENT, .user = e.first, .event = e.second});
+      add_pending_event(e.first, e.second);
+    });
+    for (auto it = state().pending_events.begin(); it != state().pending_events.end();)
     {
-      std::lock_guard tl(tank_reacting_mtx);
-      for (auto& r : state.events)
+      auto& [id, pending] = *it;
+      auto tank = id_at(id);
+      auto n = tank == nullptr ? nullptr : tank::get_if<tank::NormalTank>(tank);
+      if (n == nullptr || !n->is_alive())
       {
-        auto tank = dynamic_cast<tank::NormalTank*>(id_at(r.first));
-        switch (r.second)
-        {
-          case tank::NormalTankEvent::UP:
-            tank->up();
-            break;
-          case tank::NormalTankEvent::DOWN:
-            tank->down();
-            break;
-          case tank::NormalTankEvent::LEFT:
-            tank->left();
-            break;
-          case tank::NormalTankEvent::RIGHT:
-            tank->right();
-            break;
-          case tank::NormalTankEvent::FIRE:
-            tank->fire();
-            break;
-          case tank::NormalTankEvent::UP_AUTO:
-            tank->start_auto_drive(tank::NormalTankEvent::UP);
-            break;
-          case tank::NormalTankEvent::DOWN_AUTO:
-            tank->start_auto_drive(tank::NormalTankEvent::DOWN);
-            break;
-          case tank::NormalTankEvent::LEFT_AUTO:
-            tank->start_auto_drive(tank::NormalTankEvent::LEFT);
-            break;
-          case tank::NormalTankEvent::RIGHT_AUTO:
-            tank->start_auto_drive(tank::NormalTankEvent::RIGHT);
-            break;
-          case tank::NormalTankEvent::FIRE_AUTO:
-            tank->start_auto_drive(tank::NormalTankEvent::FIRE);
-            break;
-          case tank::NormalTankEvent::AUTO_OFF:
-            tank->stop_auto_drive();
-            break;
-        }
+        it = state().pending_events.erase(it);
+        continue;
+      }
+      for (size_t i = 0; i < max_events_per_tick && !pending.empty(); ++i)
+      {
+        apply_event(n, pending.front());
+        pending.pop_front();
       }
-      state.events.clear();
+      if (pending.empty())
+        it = state().pending_events.erase(it);
+      else
+        ++it;
     }
+    for (auto& [tank, event] : auto_driving)
+      apply_event(tank, event);
 
     // bullet move
-    for (auto& b : state.bullets)
+    for (auto& b : state().bullets)
     {
       if (b->is_alive())
         b->react();
     }
 
-    for (auto& b : state.bullets)
+    for (auto& b : state().bullets)
     {
       if (!b->is_alive())
         continue;
 
-      if ((map::map.count(map::Status::BULLET, b->pos) > 1) || map::map.has(map::Status::TANK, b->pos))
+      if ((map::map().count(map::Status::BULLET, b->pos) > 1) || map::map().has(map::Status::TANK, b->pos))
       {
         int lethality = 0;
         int attacker = -1;
-        auto bullets_instance = map::map.at(b->pos).get_bullets();
+        auto bullets_instance = map::map().at(b->pos).get_bullets();
         dbg::tank_assert(!bullets_instance.empty());
         for (auto& bi : bullets_instance)
         {
@@ -285,21 +634,20 @@ namespace czh::g
           attacker = static_cast<int>(bi->get_tank());
         }
 
-        if (map::map.has(map::Status::TANK, b->pos))
+        if (map::map().has(map::Status::TANK, b->pos))
         {
-          if (auto tank = map::map.at(b->pos).get_tank(); tank != nullptr)
+          if (auto tank = map::map().at(b->pos).get_tank(); tank != nullptr)
           {
             auto tank_attacker = id_at(attacker);
             dbg::tank_assert(tank_attacker != nullptr);
-            if (tank->is_auto)
+            if (auto t = tank::get_if<tank::AutoTank>(tank); t != nullptr)
             {
-              auto t = dynamic_cast<tank::AutoTank*>(tank);
               if (attacker != t->get_id())
               {
                 int ret = t->set_target(attacker);
               }
             }
-            tank->attacked(lethality);
+            tank::visit(tank, [lethality](auto t) { t->attacked(lethality); });
             if (!tank->is_alive())
               bc::info(-1, "{} was killed by {}.", tank->name, tank_attacker->name);
           }
@@ -307,20 +655,27 @@ namespace czh::g
       }
     }
     clear_death();
+    if (state().tick % compact_interval == 0)
+    {
+      std::lock_guard sl(bc::send_msg_mtx());
+      bc::compact_messages();
+    }
+    ++state().tick;
+    rec::end_tick();
   }
 
   void quit()
   {
-    for (auto it = state.tanks.begin(); it != state.tanks.end();)
+    for (auto it = state().tanks.begin(); it != state().tanks.end();)
     {
       delete it->second;
-      it = state.tanks.erase(it);
+      it = state().tanks.erase(it);
     }
-    if (state.mode == g::Mode::CLIENT)
+    if (state().mode == g::Mode::CLIENT)
     {
       online::cli.logout();
     }
-    else if (state.mode == g::Mode::SERVER)
+    else if (state().mode == g::Mode::SERVER)
     {
       online::svr.stop();
     }
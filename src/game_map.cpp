@@ -14,21 +14,31 @@
 #include "tank/game_map.h"
 #include "tank/utils/debug.h"
 #include "tank/utils/utils.h"
+#include <algorithm>
 #include <ranges>
 #include <vector>
 #include "tank/game.h"
+#include "tank/config.h"
 
 namespace czh::map
 {
-  Map map;
   const Point empty_point("used for empty point", {});
   const Point wall_point("used for wall point", {map::Status::WALL});
 
-
   void add_changes(const Pos &p)
   {
-    for (auto &r : g::state.users | std::views::values)
+    for (auto &r : g::state().users | std::views::values)
+    {
+      if (!r.active || r.full_resync)
+        continue;
+      if (r.map_changes.size() >= cfg::config().max_map_changes)
+      {
+        r.map_changes.clear();
+        r.full_resync = true;
+        continue;
+      }
       r.map_changes.insert(p);
+    }
   }
 
   Zone Zone::bigger_zone(int i) const { return {x_min - i, x_max + i, y_min - i, y_max + i}; }
@@ -37,6 +47,13 @@ namespace czh::map
 
   bool Zone::contains(const Pos &p) const { return contains(p.x, p.y); }
 
+  int Zone::distance(const Pos &p) const
+  {
+    int dx = (std::max)({x_min - p.x, p.x - (x_max - 1), 0});
+    int dy = (std::max)({y_min - p.y, p.y - (y_max - 1), 0});
+    return (std::max)(dx, dy);
+  }
+
   bool Point::is_generated() const { return generated; }
 
   bool Point::is_temporary() const { return temporary; }
@@ -119,7 +136,7 @@ namespace czh::map
 
   std::size_t get_distance(const Pos &from, const Pos &to) { return std::abs(from.x - to.x) + std::abs(from.y - to.y); }
 
-  Map::Map() : seed(utils::randnum<unsigned long long>(1, 20)) {}
+  Map::Map() : seed(utils::randnum<unsigned long long>(1, 20, utils::thread_rng())) {}
 
   int Map::tank_up(const Pos &pos) { return tank_move(pos, 0); }
 
@@ -206,6 +223,21 @@ namespace czh::map
     return generate(i, seed);
   }
 
+  std::vector<tank::Tank *> Map::tanks_in(const Zone &zone) const
+  {
+    std::vector<tank::Tank *> ret;
+    for (int x = zone.x_min; x < zone.x_max; ++x)
+    {
+      auto end = map.lower_bound(Pos(x, zone.y_max));
+      for (auto it = map.lower_bound(Pos(x, zone.y_min)); it != end; ++it)
+      {
+        if (it->second.tank != nullptr)
+          ret.emplace_back(it->second.tank);
+      }
+    }
+    return ret;
+  }
+
   int Map::fill(const Zone &zone, const Status &status)
   {
     for (int i = zone.x_min; i < zone.x_max; ++i)
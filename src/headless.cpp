@@ -0,0 +1,436 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#include "tank/headless.h"
+#include "tank/archive.h"
+#include "tank/broadcast.h"
+#include "tank/command.h"
+#include "tank/config.h"
+#include "tank/env.h"
+#include "tank/game.h"
+#include "tank/game_map.h"
+#include "tank/record.h"
+#include "tank/utils/utils.h"
+#include "tank/utils/random.h"
+#include "tank/utils/scheduler.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <csignal>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace czh::hl
+{
+  // Set by SIGINT or SIGTERM, the run stops after the current tick and reports.
+  volatile std::sig_atomic_t stop_requested = 0;
+
+  void request_stop(int)
+  {
+    stop_requested = 1;
+  }
+
+  // Tick costs in constant memory, so that an endless run can report them too. The count, min,
+  // max and mean are exact, the percentiles come from a uniform sample of the ticks. (reservoir sampling)
+  class TickCosts
+  {
+  public:
+    static constexpr size_t sample_size = 4096;
+
+  private:
+    size_t count{0};
+    int64_t min{0};
+    int64_t max{0};
+    double total{0};
+    std::vector<int64_t> sample;
+    utils::Xoshiro256 rng; // Not the world's, a replay mustn't see its numbers drawn
+
+  public:
+    TickCosts() { sample.reserve(sample_size); }
+
+    void add(int64_t cost)
+    {
+      min = count == 0 ? cost : (std::min)(min, cost);
+      max = count == 0 ? cost : (std::max)(max, cost);
+      total += static_cast<double>(cost);
+      ++count;
+      if (sample.size() < sample_size)
+        sample.emplace_back(cost);
+      else if (auto i = utils::randnum<size_t>(0, count, rng); i < sample_size)
+        sample[i] = cost;
+    }
+
+    [[nodiscard]] size_t size() const { return count; }
+
+    // In microseconds.
+    [[nodiscard]] double mean() const { return count == 0 ? 0 : total / static_cast<double>(count) / 1e3; }
+
+    // In microseconds, p in [0, 1].
+    [[nodiscard]] double percentile(double p)
+    {
+      if (count == 0)
+        return 0;
+      if (p == 0)
+        return static_cast<double>(min) / 1e3;
+      if (p == 1)
+        return static_cast<double>(max) / 1e3;
+      auto idx = static_cast<size_t>(p * static_cast<double>(sample.size() - 1));
+      std::ranges::nth_element(sample, sample.begin() + static_cast<std::ptrdiff_t>(idx));
+      return static_cast<double>(sample[idx]) / 1e3;
+    }
+  };
+
+  std::optional<size_t> to_size(const std::string& s)
+  {
+    if (s.empty() || !std::ranges::all_of(s, [](char c) { return std::isdigit(c); }))
+      return std::nullopt;
+    try
+    {
+      return std::stoull(s);
+    }
+    catch (...)
+    {
+      return std::nullopt;
+    }
+  }
+
+  std::string usage()
+  {
+    return R"(Usage: tank [--headless [options]]
+  --headless            Run the simulation without a terminal.
+  --ticks [n]           Number of ticks to run, 0 for endless. (default: 1000)
+                        SIGINT or SIGTERM stops the run early, which still reports.
+  --tick [ms]           Fixed tick in milliseconds, 0 for as fast as possible. (default: 0)
+  --seed [seed]         The seed of the game map and of the world's random numbers.
+  --summon [n]:[level]  Summon n AutoTanks before the first tick. Can be repeated.
+  --spread [r]          Summon in [-r, r) around (0, 0) instead of the visible zone.
+  --scenario [file]     Run the commands in the file, one '[tick] [command]' per line.
+  --replay [file]       Replay a recording and check that it is reproduced tick by tick.
+  --env [n]             Step n training environments with random actions and report env steps/s.
+  --help                Show this message.
+)";
+  }
+
+  std::optional<std::string> load_scenario(const std::string& filename, Scenario& scenario)
+  {
+    std::ifstream in(filename);
+    if (!in.good())
+      return std::format("Failed to open '{}'.", filename);
+
+    std::string line;
+    size_t lineno = 0;
+    while (std::getline(in, line))
+    {
+      ++lineno;
+      auto beg = line.find_first_not_of(" \t\r");
+      if (beg == std::string::npos || line[beg] == '#')
+        continue;
+      auto sep = line.find(' ', beg);
+      auto tick = to_size(line.substr(beg, sep - beg));
+      if (!tick.has_value() || sep == std::string::npos)
+        return std::format("{}:{}: Expected '[tick] [command]'.", filename, lineno);
+      auto cmd = line.substr(sep + 1);
+      if (!cmd.empty() && cmd.back() == '\r')
+        cmd.pop_back();
+      scenario.commands.emplace_back(ScenarioCommand{.tick = *tick, .command = cmd});
+    }
+    std::ranges::stable_sort(scenario.commands, std::less{}, [](auto&& c) { return c.tick; });
+    return std::nullopt;
+  }
+
+  std::optional<std::string> parse_args(int argc, char** argv, Options& options)
+  {
+    std::vector<std::string> args(argv + 1, argv + argc);
+    for (size_t i = 0; i < args.size(); ++i)
+    {
+      auto next = [&args, &i]() -> std::optional<std::string>
+      {
+        if (i + 1 >= args.size())
+          return std::nullopt;
+        return args[++i];
+      };
+
+      if (args[i] == "--headless")
+        options.enabled = true;
+      else if (args[i] == "--help")
+        options.help = true;
+      else if (args[i] == "--ticks")
+      {
+        auto n = next().and_then(to_size);
+        if (!n.has_value())
+          return "Invalid --ticks.";
+        options.ticks = *n;
+      }
+      else if (args[i] == "--tick")
+      {
+        auto n = next().and_then(to_size);
+        if (!n.has_value())
+          return "Invalid --tick.";
+        options.tick = std::chrono::milliseconds(*n);
+      }
+      else if (args[i] == "--seed")
+      {
+        auto n = next().and_then(to_size);
+        if (!n.has_value())
+          return "Invalid --seed.";
+        options.scenario.seed = *n;
+      }
+      else if (args[i] == "--summon")
+      {
+        auto v = next();
+        if (!v.has_value())
+          return "Invalid --summon.";
+        auto sep = v->find(':');
+        auto n = to_size(v->substr(0, sep));
+        auto lvl = sep == std::string::npos ? std::optional<size_t>{1} : to_size(v->substr(sep + 1));
+        if (!n.has_value() || !lvl.has_value() || *lvl < 1 || *lvl > 10)
+          return "Invalid --summon. (e.g. --summon 100:5, 1 <= level <= 10)";
+        options.scenario.summons.emplace_back(*n, *lvl);
+      }
+      else if (args[i] == "--spread")
+      {
+        auto n = next().and_then(to_size);
+        if (!n.has_value() || *n == 0)
+          return "Invalid --spread.";
+        auto r = static_cast<int>(*n);
+        options.scenario.summon_zone = map::Zone{-r, r, -r, r};
+      }
+      else if (args[i] == "--scenario")
+      {
+        auto v = next();
+        if (!v.has_value())
+          return "Invalid --scenario.";
+        if (auto err = load_scenario(*v, options.scenario); err.has_value())
+          return err;
+      }
+      else if (args[i] == "--env")
+      {
+        auto n = next().and_then(to_size);
+        if (!n.has_value() || *n == 0)
+          return "Invalid --env.";
+        options.envs = *n;
+      }
+      else if (args[i] == "--replay")
+      {
+        auto v = next();
+        if (!v.has_value())
+          return "Invalid --replay.";
+        options.replay = *v;
+      }
+      else
+        return std::format("Unknown option '{}'.\n{}", args[i], usage());
+    }
+    return std::nullopt;
+  }
+
+  void print_messages(uint64_t& printed)
+  {
+    std::lock_guard sl(bc::send_msg_mtx());
+    for (auto& m : bc::get_messages(g::state().id, printed))
+      std::cout << "  " << m->content << "\n";
+    printed = g::state().messages.end();
+  }
+
+  void report(const Options& options, TickCosts& costs, std::chrono::steady_clock::duration wall_)
+  {
+    auto wall = std::chrono::duration_cast<std::chrono::nanoseconds>(wall_);
+    size_t alive = std::ranges::count_if(g::state().tanks, [](auto&& t) { return t.second->is_alive(); });
+
+    std::cout << std::format("Ticks: {}, Wall: {:.3f} s, {:.1f} ticks/s\n", costs.size(),
+                             static_cast<double>(wall.count()) / 1e9,
+                             wall.count() == 0 ? 0 : static_cast<double>(costs.size()) * 1e9 / static_cast<double>(wall.count()));
+    std::cout << std::format("Tick cost (us): min {:.1f}, mean {:.1f}, p50 {:.1f}, p90 {:.1f}, p99 {:.1f}, max {:.1f}\n",
+                             costs.percentile(0), costs.mean(), costs.percentile(0.5), costs.percentile(0.9),
+                             costs.percentile(0.99), costs.percentile(1));
+    if (options.tick.count() != 0)
+    {
+      auto& stats = g::scheduler().get_stats();
+      std::cout << std::format("Late: {}, Overruns: {}, Catch-up: {}, Dropped: {}\n", stats.late_ticks.load(),
+                               stats.overruns.load(), stats.catch_up_steps.load(), stats.dropped_steps.load());
+    }
+    std::cout << std::format("Tanks: {} ({} alive), Bullets: {}\n", g::state().tanks.size(), alive,
+                             g::state().bullets.size());
+    std::cout.flush();
+  }
+
+  int replay(const Options& options)
+  {
+    rec::Recording recording;
+    if (auto err = rec::load(options.replay, recording); err.has_value())
+    {
+      std::cerr << *err << std::endl;
+      return 1;
+    }
+    ar::load(recording.archive);
+    utils::seed_rand(recording.rng_seed);
+    g::state().tick = recording.begin_tick;
+
+    auto end_tick = recording.begin_tick + recording.hashes.size();
+    if (options.ticks.has_value() && *options.ticks != 0)
+      end_tick = (std::min)(end_tick, recording.begin_tick + *options.ticks);
+
+    TickCosts costs;
+    size_t mismatches = 0;
+    auto entry = recording.entries.cbegin();
+    auto beg = std::chrono::steady_clock::now();
+    std::signal(SIGINT, request_stop);
+    std::signal(SIGTERM, request_stop);
+    while (g::state().tick < end_tick && !stop_requested)
+    {
+      auto tick = g::state().tick;
+      for (; entry != recording.entries.cend() && entry->tick <= tick; ++entry)
+        rec::apply(*entry);
+
+      auto tick_beg = std::chrono::steady_clock::now();
+      g::mainloop();
+      auto cost = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tick_beg);
+
+      if (g::state().tick == tick) // paused
+      {
+        if (entry == recording.entries.cend() || entry->tick > tick)
+        {
+          std::cout << std::format("Paused at tick {} without anything to continue.\n", tick);
+          ++mismatches;
+          break;
+        }
+        continue;
+      }
+      costs.add(cost.count());
+
+      if (auto hash = rec::world_hash(); hash != recording.hashes[tick - recording.begin_tick])
+      {
+        if (mismatches < 10)
+        {
+          std::cout << std::format("Tick {}: world hash {:016x}, expected {:016x}.\n",
+                                   tick, hash, recording.hashes[tick - recording.begin_tick]);
+        }
+        ++mismatches;
+      }
+    }
+    report(options, costs, std::chrono::steady_clock::now() - beg);
+    if (mismatches != 0)
+    {
+      std::cout << std::format("Replay diverged: {} of {} ticks mismatched.\n", mismatches, costs.size());
+      return 1;
+    }
+    std::cout << std::format("Replay matched the recording from tick {} to {}.\n", recording.begin_tick,
+                             g::state().tick);
+    return 0;
+  }
+
+  int run_env(const Options& options)
+  {
+    env::Options env_options{.num_envs = options.envs};
+    if (!options.scenario.summons.empty())
+    {
+      env_options.auto_tanks = options.scenario.summons[0].first;
+      env_options.auto_tank_lvl = options.scenario.summons[0].second;
+    }
+    env::VecEnv envs(env_options);
+    envs.reset(options.scenario.seed.value_or(0));
+
+    utils::Xoshiro256 rng(options.scenario.seed.value_or(0));
+    std::vector<env::Action> actions(envs.size());
+    auto steps = options.ticks.value_or(1000);
+    size_t episodes = 0;
+    double rewards = 0;
+    auto beg = std::chrono::steady_clock::now();
+    for (size_t step = 0; step < steps; ++step)
+    {
+      for (auto& a : actions)
+        a = static_cast<tank::NormalTankEvent>(utils::randnum<int>(0, 5, rng)); // UP, DOWN, LEFT, RIGHT or FIRE
+      auto& result = envs.step(actions);
+      episodes += std::ranges::count(result.dones, 1);
+      for (auto& r : result.rewards)
+        rewards += r;
+    }
+    auto wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - beg).count();
+    std::cout << std::format("Envs: {}, Steps: {}, Wall: {:.3f} s, {:.1f} env steps/s\n", envs.size(), steps, wall,
+                             wall == 0 ? 0 : static_cast<double>(steps * envs.size()) / wall);
+    std::cout << std::format("Episodes done: {}, Total reward: {:.2f}\n", episodes, rewards);
+    std::cout.flush();
+    return 0;
+  }
+
+  int run(const Options& options)
+  {
+    if (!options.replay.empty())
+      return replay(options);
+    if (options.envs != 0)
+      return run_env(options);
+
+    const auto& scenario = options.scenario;
+    if (scenario.seed.has_value())
+    {
+      map::map().seed = *scenario.seed;
+      utils::seed_rand(*scenario.seed);
+    }
+    g::add_tank(map::Pos{0, 0}, 0);
+    g::state().users[g::state().id].visible_zone = scenario.zone;
+
+    uint64_t printed = 0;
+    for (auto& [n, lvl] : scenario.summons)
+    {
+      std::lock_guard ml(g::mainloop_mtx());
+      g::add_auto_tanks(n, lvl, scenario.summon_zone.value_or(scenario.zone), g::state().id);
+    }
+    // Messages from summoning and ticks are noise here, only command output is printed.
+    printed = g::state().messages.end();
+
+    cfg::config().tick = options.tick;
+    auto ticks = options.ticks.value_or(1000);
+    TickCosts costs;
+    auto cmd_it = scenario.commands.cbegin();
+    std::signal(SIGINT, request_stop);
+    std::signal(SIGTERM, request_stop);
+    auto beg = std::chrono::steady_clock::now();
+
+    size_t tick = 0;
+    while ((ticks == 0 || tick < ticks) && !stop_requested)
+    {
+      // A late tick is caught up with several steps, like the game thread does.
+      size_t steps = 1;
+      if (options.tick.count() != 0)
+        steps = g::scheduler().wait_next(options.tick, cfg::config().max_catch_up);
+
+      for (size_t step = 0; step < steps && (ticks == 0 || tick < ticks); ++step, ++tick)
+      {
+        for (; cmd_it != scenario.commands.cend() && cmd_it->tick <= tick; ++cmd_it)
+        {
+          {
+            std::lock_guard sl(bc::send_msg_mtx());
+            printed = g::state().messages.end();
+          }
+          std::cout << "[" << tick << "] " << cmd_it->command << "\n";
+          cmd::run_command(g::state().id, cmd_it->command);
+          print_messages(printed);
+        }
+
+        auto tick_beg = std::chrono::steady_clock::now();
+        g::mainloop();
+        auto cost = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tick_beg);
+        costs.add(cost.count());
+      }
+
+      if (options.tick.count() != 0)
+        g::scheduler().finish(steps);
+    }
+
+    report(options, costs, std::chrono::steady_clock::now() - beg);
+    return 0;
+  }
+}
\ No newline at end of file
@@ -909,7 +909,7 @@ namespace czh::input
 
   Input get_input()
   {
-    if (state.typing_command || g::state.page != g::Page::GAME)
+    if (state.typing_command || g::state().page != g::Page::GAME)
       return get_raw_input();
 
     while (state.is_long_pressing == true)
@@ -918,7 +918,7 @@ namespace czh::input
       {
         auto d = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() -
                                                                        state.last_press);
-        if (d.count() > cfg::config.long_pressing_threshold)
+        if (d.count() > cfg::config().long_pressing_threshold)
         {
           state.is_long_pressing = false;
           return Input::LP_END;
@@ -941,7 +941,7 @@ namespace czh::input
     auto d = std::chrono::duration_cast<std::chrono::microseconds>(now - state.last_press);
     if (raw == Input::UP || raw == Input::DOWN || raw == Input::LEFT || raw == Input::RIGHT || raw == Input::KEY_SPACE)
     {
-      if (state.last_input_value == raw && d.count() < cfg::config.long_pressing_threshold)
+      if (state.last_input_value == raw && d.count() < cfg::config().long_pressing_threshold)
       {
         if (state.is_long_pressing == false)
         {
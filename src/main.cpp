@@ -17,11 +17,14 @@
 #include "tank/config.h"
 #include "tank/drawing.h"
 #include "tank/game.h"
+#include "tank/headless.h"
 #include "tank/input.h"
 #include "tank/online.h"
+#include "tank/record.h"
 #include "tank/tank.h"
 #include "tank/term.h"
 #include "tank/utils/utils.h"
+#include "tank/utils/scheduler.h"
 
 #ifdef _WIN32
 #include <timeapi.h>
@@ -34,6 +37,7 @@
 #endif
 
 #include <chrono>
+#include <cstdio>
 #include <string>
 #include <thread>
 #include <vector>
@@ -41,15 +45,22 @@ using namespace czh;
 
 void react(tank::NormalTankEvent event)
 {
-  if (draw::state.snapshot.tanks[g::state.id].is_alive)
+  bool alive;
+  // The render thread replaces the snapshot under drawing_mtx.
   {
-    if (g::state.mode == g::Mode::CLIENT)
+    std::lock_guard dl(draw::drawing_mtx);
+    auto it = draw::state.snapshot.tanks.find(g::state().id);
+    alive = it != draw::state.snapshot.tanks.end() && it->second.is_alive;
+  }
+  if (alive)
+  {
+    if (g::state().mode == g::Mode::CLIENT)
     {
       int ret = online::cli.tank_react(event);
     }
     else
     {
-      g::tank_react(g::state.id, event);
+      g::tank_react(g::state().id, event);
     }
   }
 }
@@ -59,12 +70,24 @@ void sighandler(int)
 {
   term::keyboard.init();
   draw::state.inited = false;
-  g::state.suspend = false;
+  g::state().suspend = false;
 }
 #endif
 
-int main()
+int main(int argc, char** argv)
 {
+  hl::Options headless;
+  if (auto err = hl::parse_args(argc, argv, headless); err.has_value())
+  {
+    std::fputs(err->c_str(), stderr);
+    return 1;
+  }
+  if (headless.help)
+  {
+    std::fputs(hl::usage().c_str(), stdout);
+    return 0;
+  }
+
 #ifdef _WIN32
   TIMECAPS tc;
   dbg::tank_assert(timeGetDevCaps(&tc, sizeof(TIMECAPS)) == TIMERR_NOERROR);
@@ -72,36 +95,50 @@ int main()
   timeBeginPeriod(wTimerRes);
 #endif
 
+  if (headless.enabled)
+    return hl::run(headless);
+
+  term::keyboard.init();
+
 #ifdef SIGCONT
   signal(SIGCONT, sighandler);
 #endif
 
+  // The simulation never waits for the terminal: it publishes a snapshot every tick,
+  // and the render thread draws the latest one at its own frame rate.
   std::thread game_thread(
     []
     {
       while (true)
       {
-        std::chrono::high_resolution_clock::time_point beg = std::chrono::high_resolution_clock::now();
-        if (g::state.mode == g::Mode::NATIVE || g::state.mode == g::Mode::SERVER)
-          g::mainloop();
-
-        auto ret = draw::update_snapshot();
-        if (ret == 0)
-          draw::draw();
-
-        std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
-        auto cost = std::chrono::duration_cast<std::chrono::milliseconds>(end - beg);
-        if (cfg::config.tick > cost)
+        size_t steps = g::scheduler().wait_next(cfg::config().tick, cfg::config().max_catch_up);
+        if (g::state().mode == g::Mode::NATIVE || g::state().mode == g::Mode::SERVER)
         {
-          std::this_thread::sleep_for(cfg::config.tick - cost);
+          for (size_t i = 0; i < steps; ++i)
+            g::mainloop();
+          if (steps != 0)
+            online::svr.publish_frames();
         }
+        draw::update_snapshot();
+        g::scheduler().finish(steps);
+      }
+    });
+  std::thread render_thread(
+    []
+    {
+      utils::TickScheduler frame_scheduler;
+      while (true)
+      {
+        frame_scheduler.wait_next(std::chrono::microseconds(1000000 / cfg::config().max_fps), 0);
+        draw::draw();
+        frame_scheduler.finish();
       }
     });
   g::add_tank(map::Pos{0, 0}, 0);
   while (true)
   {
     input::Input i = input::get_input();
-    if (g::state.page == g::Page::GAME)
+    if (g::state().page == g::Page::GAME)
     {
       switch (i)
       {
@@ -139,24 +176,30 @@ int main()
           react(tank::NormalTankEvent::FIRE);
           break;
         case input::Input::KEY_O:
-          g::state.page = g::Page::STATUS;
+          g::state().page = g::Page::STATUS;
           draw::state.inited = false;
           break;
         case input::Input::KEY_I:
-          g::state.page = g::Page::NOTIFICATION;
+          g::state().page = g::Page::NOTIFICATION;
           draw::state.inited = false;
           break;
         case input::Input::KEY_L:
         {
-          if (g::state.mode == g::Mode::CLIENT)
+          // Not the world's stream, so it never disturbs a recording.
+          auto lvl = utils::randnum<size_t>(1, 11, utils::thread_rng());
+          if (g::state().mode == g::Mode::CLIENT)
           {
-            int ret = online::cli.add_auto_tank(utils::randnum<int>(1, 11));
+            int ret = online::cli.add_auto_tank(lvl);
           }
           else
           {
-            std::lock_guard ml(g::mainloop_mtx);
+            std::lock_guard ml(g::mainloop_mtx());
             std::lock_guard dl(draw::drawing_mtx);
-            g::add_auto_tank(utils::randnum<int>(1, 11), draw::state.visible_zone, 0);
+            rec::record({
+              .type = rec::EntryType::ADD_AUTO_TANK, .user = g::state().id,
+              .zone = draw::state.visible_zone, .lvl = lvl
+            });
+            g::add_auto_tank(lvl, draw::state.visible_zone, g::state().id);
           }
         }
         break;
@@ -164,7 +207,7 @@ int main()
           break;
       }
     }
-    else if (g::state.page == g::Page::HELP)
+    else if (g::state().page == g::Page::HELP)
     {
       switch (i)
       {
@@ -186,7 +229,7 @@ int main()
           break;
       }
     }
-    else if (g::state.page == g::Page::STATUS)
+    else if (g::state().page == g::Page::STATUS)
     {
       switch (i)
       {
@@ -205,14 +248,14 @@ int main()
           }
           break;
         case input::Input::KEY_O:
-          g::state.page = g::Page::GAME;
+          g::state().page = g::Page::GAME;
           draw::state.inited = false;
           break;
         default:
           break;
       }
     }
-    else if (g::state.page == g::Page::NOTIFICATION)
+    else if (g::state().page == g::Page::NOTIFICATION)
     {
       switch (i)
       {
@@ -231,7 +274,7 @@ int main()
           }
           break;
         case input::Input::KEY_I:
-          g::state.page = g::Page::GAME;
+          g::state().page = g::Page::GAME;
           draw::state.inited = false;
           break;
         default:
@@ -252,17 +295,17 @@ int main()
         input::edit_refresh_line_lock();
         if (auto c = input::get_input(); c == input::Input::COMMAND)
         {
-          cmd::run_command(g::state.id, input::state.line);
+          cmd::run_command(g::state().id, input::state.line);
         }
         input::state.typing_command = false;
         break;
       case input::Input::KEY_ENTER:
-        g::state.page = g::Page::GAME;
+        g::state().page = g::Page::GAME;
         draw::state.inited = false;
         break;
       case input::Input::KEY_CTRL_C:
       {
-        std::lock_guard ml(g::mainloop_mtx);
+        std::lock_guard ml(g::mainloop_mtx());
         std::lock_guard dl(draw::drawing_mtx);
         g::quit();
 #ifdef _WIN32
@@ -274,32 +317,32 @@ int main()
 #ifdef SIGCONT
       case input::Input::KEY_CTRL_Z:
       {
-        std::lock_guard ml(g::mainloop_mtx);
+        std::lock_guard ml(g::mainloop_mtx());
         std::lock_guard dl(draw::drawing_mtx);
-        if (g::state.mode == g::Mode::CLIENT)
+        if (g::state().mode == g::Mode::CLIENT)
         {
           online::cli.logout();
-          g::state.id = 0;
-          draw::state.focus = g::state.id;
+          g::state().id = 0;
+          draw::state.focus = g::state().id;
           draw::state.inited = false;
-          g::state.mode = g::Mode::NATIVE;
+          g::state().mode = g::Mode::NATIVE;
         }
-        else if (g::state.mode == g::Mode::SERVER)
+        else if (g::state().mode == g::Mode::SERVER)
         {
           online::svr.stop();
-          for (auto& id : g::state.users | std::views::keys)
+          for (auto& id : g::state().users | std::views::keys)
           {
             if (id == 0)
               continue;
-            g::state.tanks[id]->kill();
-            g::state.tanks[id]->clear();
-            delete g::state.tanks[id];
-            g::state.tanks.erase(id);
+            g::state().tanks[id]->kill();
+            g::state().tanks[id]->clear();
+            delete g::state().tanks[id];
+            g::state().tanks.erase(id);
           }
-          g::state.users = {{0, g::state.users[0]}};
-          g::state.mode = g::Mode::NATIVE;
+          g::state().users = {{0, g::state().users[0]}};
+          g::state().mode = g::Mode::NATIVE;
         }
-        g::state.suspend = true;
+        g::state().suspend = true;
         term::keyboard.deinit();
         raise(SIGSTOP);
       }
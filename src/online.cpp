@@ -19,24 +19,31 @@
 #include "tank/game.h"
 #include "tank/drawing.h"
 #include "tank/broadcast.h"
+#include "tank/record.h"
+#include "tank/world.h"
 #include "tank/utils/utils.h"
+#include "tank/utils/delta.h"
 #include "tank/utils/serialization.h"
 #include "tank/utils/debug.h"
 
 #include <string>
 #include <chrono>
+#include <tuple>
 #include <utility>
 #include <vector>
+#include <ranges>
 #include <format>
 
 namespace czh::online
 {
   OnlineState state
   {
-    .delay = 0
+    .delay = 0,
+    .dropped_frames = 0
   };
   TankServer svr;
   TankClient cli;
+  utils::NetSim net_sim;
   std::mutex online_mtx;
 
   std::string make_request(const std::string& cmd)
@@ -56,6 +63,201 @@ namespace czh::online
     return utils::serialize(std::forward<Args>(args)...);
   }
 
+  // On TCP, a request is sent with an ID and its response comes back with it, so that a client
+  // can have several in flight. 0 is for requests that have no response.
+  std::string tag_request(uint32_t request_id, const std::string& req)
+  {
+    return utils::serialize(request_id, req);
+  }
+
+  // The most cells a subscriber's zone may cover, about a 1024 x 1024 terminal. Its frames are made
+  // on the thread ticking the world, a bigger zone would stall the tick for every player.
+  constexpr int64_t max_zone_cells = 1 << 20;
+
+  // Not inverted or empty, and at most max_zone_cells.
+  bool is_valid_zone(const map::Zone& zone)
+  {
+    if (zone.x_min >= zone.x_max || zone.y_min >= zone.y_max)
+      return false;
+    auto width = static_cast<int64_t>(zone.x_max) - zone.x_min;
+    auto height = static_cast<int64_t>(zone.y_max) - zone.y_min;
+    return width <= max_zone_cells && height <= max_zone_cells && width * height <= max_zone_cells;
+  }
+
+  // What the user sees of a subscriber's zone, without the margin the client keeps around it.
+  // A zone too small for the margin is all visible.
+  map::Zone visible_part(const map::Zone& zone)
+  {
+    auto visible = zone.bigger_zone(-10);
+    if (visible.x_min >= visible.x_max || visible.y_min >= visible.y_max)
+      return zone;
+    return visible;
+  }
+
+  std::string TankServer::route(utils::Socket_t fd, std::string_view req)
+  {
+    auto parsed = utils::try_deserialize<std::string_view, std::string_view>(req);
+    if (!parsed.has_value())
+      return "";
+    auto [cmd, args] = *parsed;
+    auto current_room = room_of(fd);
+    g::WorldScope scope(*current_room);
+    if (cmd == "tank_react")
+    {
+      auto [id, event] = utils::deserialize<size_t, tank::NormalTankEvent>(args);
+      g::tank_react(id, event);
+      return "";
+    }
+    else if (cmd == "subscribe")
+    {
+      auto [id, room_name, zone] = utils::deserialize<size_t, std::string, map::Zone>(args);
+      auto room = join_room(fd, room_name);
+      if (room == nullptr)
+        return "";
+      g::WorldScope room_scope(*room);
+      subscribe(fd, id, zone);
+      return "";
+    }
+    else if (cmd == "subscribe_udp")
+    {
+      auto [id, room_name, zone] = utils::deserialize<size_t, std::string, map::Zone>(args);
+      auto room = join_room(fd, room_name);
+      if (room == nullptr)
+        return make_response(uint64_t{0});
+      g::WorldScope room_scope(*room);
+      // 0 for no UDP.
+      uint64_t token = 0;
+      if (udp != nullptr)
+      {
+        {
+          std::lock_guard sl(subscribers_mtx);
+          do
+            token = token_rng();
+          while (token == 0 || udp_subscribers.contains(token));
+        }
+        if (!subscribe(fd, id, zone, std::make_shared<utils::UDPConnection>(token)))
+          token = 0;
+      }
+      return make_response(token);
+    }
+    else if (cmd == "view")
+    {
+      auto [zone, roster] = utils::deserialize<map::Zone, bool>(args);
+      if (!is_valid_zone(zone))
+        return "";
+      size_t id;
+      //
+      {
+        std::lock_guard sl(subscribers_mtx);
+        auto it = subscribers.find(fd);
+        if (it == subscribers.end())
+          return "";
+        it->second->zone = zone;
+        it->second->roster = roster;
+        id = it->second->id;
+      }
+      std::lock_guard ml(g::mainloop_mtx());
+      if (g::state().users.contains(id))
+        g::set_visible_zone(id, visible_part(zone));
+      return "";
+    }
+    else if (cmd == "ack")
+    {
+      auto tick = utils::deserialize<size_t>(args);
+      std::lock_guard sl(subscribers_mtx);
+      if (auto it = subscribers.find(fd); it != subscribers.end())
+        it->second->acked = tick;
+      return "";
+    }
+    else if (cmd == "ping")
+      return make_response(0);
+    else if (cmd == "register")
+    {
+      std::string ipstr;
+      if (auto ip = utils::get_peer_ip(fd); ip.has_value())
+        ipstr = *ip;
+      auto room = join_room(fd, utils::deserialize<std::string>(args));
+      if (room == nullptr)
+        return make_response(-1, std::string{"Can not create the room."}, size_t{0});
+      g::WorldScope room_scope(*room);
+
+      std::lock_guard ml(g::mainloop_mtx());
+      std::lock_guard dl(draw::drawing_mtx);
+      // Near the server user in the default world, around the origin in rooms.
+      auto zone = g::is_default_world() ? draw::state.visible_zone : map::Zone{-32, 32, -16, 16};
+      auto id = g::add_user(zone, ipstr);
+      bc::info(bc::to_everyone, "{} registered as {}.", ipstr, id);
+      if (g::state().page == g::Page::STATUS)
+        draw::state.inited = false;
+      return make_response(0, std::string{"Success."}, id);
+    }
+    else if (cmd == "deregister")
+    {
+      std::string ipstr;
+      if (auto ip = utils::get_peer_ip(fd); ip.has_value())
+        ipstr = *ip;
+      auto id = utils::deserialize<size_t>(args);
+      std::lock_guard ml(g::mainloop_mtx());
+      std::lock_guard dl(draw::drawing_mtx);
+      bc::info(bc::to_everyone, "{} ({}) deregistered.", ipstr, id);
+      g::remove_user(id);
+      return "";
+    }
+    else if (cmd == "login")
+    {
+      std::string ipstr;
+      if (auto ip = utils::get_peer_ip(fd); ip.has_value())
+        ipstr = *ip;
+      auto [id, room_name] = utils::deserialize<size_t, std::string>(args);
+      auto room = join_room(fd, room_name);
+      if (room == nullptr)
+        return make_response(-1, std::string{"Can not create the room."});
+      g::WorldScope room_scope(*room);
+      if (id == g::state().id)
+        return make_response(-1, std::string{"Cannot login as the server user."});
+
+      std::lock_guard ml(g::mainloop_mtx());
+      std::lock_guard dl(draw::drawing_mtx);
+      auto tank = g::id_at(id);
+      if (tank == nullptr || tank->is_auto())
+        return make_response(-1, std::string{"No such user."});
+      else if (tank->is_alive())
+        return make_response(-1, std::string{"Already logined."});
+      bc::info(bc::to_everyone, "{} ({}) logined.", ipstr, id);
+      g::login(id, g::state().users[id].visible_zone);
+      return make_response(0, std::string{"Success."});
+    }
+    else if (cmd == "logout")
+    {
+      std::string ipstr;
+      if (auto ip = utils::get_peer_ip(fd); ip.has_value())
+        ipstr = *ip;
+      auto id = utils::deserialize<size_t>(args);
+      std::lock_guard ml(g::mainloop_mtx());
+      std::lock_guard dl(draw::drawing_mtx);
+      bc::info(bc::to_everyone, "{} ({}) logout.", ipstr, id);
+      g::logout(id);
+      return "";
+    }
+    else if (cmd == "add_auto_tank")
+    {
+      auto [id, zone, lvl]
+          = utils::deserialize<size_t, map::Zone, size_t>(args);
+      std::lock_guard ml(g::mainloop_mtx());
+      std::lock_guard dl(draw::drawing_mtx);
+      rec::record({.type = rec::EntryType::ADD_AUTO_TANK, .user = id, .zone = zone, .lvl = lvl});
+      g::add_auto_tank(lvl, zone, id);
+      return "";
+    }
+    else if (cmd == "run_command")
+    {
+      auto [id, command] = utils::deserialize<size_t, std::string>(args);
+      cmd::run_command(id, command);
+      return "";
+    }
+    return "";
+  }
+
   void TankServer::start(int port_)
   {
     port = port_;
@@ -67,172 +269,522 @@ namespace czh::online
       delete svr;
     }
     svr = new utils::TCPServer(
-      [](utils::Socket_t fd, const std::string& req) -> std::string
+      [this](utils::Socket_t fd, std::string_view packet)
       {
-        auto [cmd, args] = utils::deserialize<std::string, std::string>(req);
-        if (cmd == "tank_react")
-        {
-          auto [id, event] = utils::deserialize<size_t, tank::NormalTankEvent>(args);
-          g::tank_react(id, event);
-          return "";
-        }
-        else if (cmd == "update")
-        {
-          auto [id, zone] = utils::deserialize<size_t, map::Zone>(args);
-          auto beg = std::chrono::steady_clock::now();
-          std::lock_guard ml(g::mainloop_mtx);
-          //std::lock_guard dl(drawing::drawing_mtx);
-          auto& user = g::state.users[id];
-          std::set<map::Pos> changes;
-          for (auto& r : user.map_changes)
-          {
-            if (zone.contains(r))
-              changes.insert(r);
-          }
-          auto d = std::chrono::duration_cast<std::chrono::milliseconds>
-              (std::chrono::steady_clock::now() - beg);
-
-          std::vector<msg::Message> msgs;
-          for (auto it = user.messages.rbegin(); it < user.messages.rend(); ++it)
-          {
-            if (!it->read)
-            {
-              msgs.emplace_back(*it);
-              it->read = true;
-            }
-            else // New messages are at the end of the std::vector, so just break.
-              break;
-          }
-          user.map_changes.clear();
-          user.last_update = std::chrono::steady_clock::now();
-          user.visible_zone = zone.bigger_zone(-10);
-
-          return make_response(d.count(), draw::extract_userinfo(),
-                               changes, draw::extract_tanks(),
-                               msgs, draw::extract_map(zone));
-        }
-        else if (cmd == "register")
-        {
-          std::string ipstr;
-          if (auto ip = utils::get_peer_ip(fd); ip.has_value())
-            ipstr = *ip;
-
-          std::lock_guard ml(g::mainloop_mtx);
-          std::lock_guard dl(draw::drawing_mtx);
-          auto id = g::add_tank(draw::state.visible_zone, g::state.id);
-          g::state.users[id] = g::UserData{
-            .user_id = id,
-            .ip = ipstr
-          };
-          g::state.users[id].last_update = std::chrono::steady_clock::now();
-          g::state.users[id].active = true;
-          bc::info(bc::to_everyone, "{} registered as {}.", ipstr, id);
-          if (g::state.page == g::Page::STATUS)
-            draw::state.inited = false;
-          return make_response(id);
-        }
-        else if (cmd == "deregister")
-        {
-          std::string ipstr;
-          if (auto ip = utils::get_peer_ip(fd); ip.has_value())
-            ipstr = *ip;
-          auto id = utils::deserialize<size_t>(args);
-          std::lock_guard ml(g::mainloop_mtx);
-          std::lock_guard dl(draw::drawing_mtx);
-          bc::info(bc::to_everyone, "{} ({}) deregistered.", ipstr, id);
-          g::state.tanks[id]->kill();
-          g::state.tanks[id]->clear();
-          delete g::state.tanks[id];
-          g::state.tanks.erase(id);
-          g::state.users.erase(id);
-          return "";
-        }
-        else if (cmd == "login")
-        {
-          std::string ipstr;
-          if (auto ip = utils::get_peer_ip(fd); ip.has_value())
-            ipstr = *ip;
-          auto id = utils::deserialize<size_t>(args);
-          if (id == g::state.id)
-            return make_response(-1, std::string{"Cannot login as the server user."});
-
-          std::lock_guard ml(g::mainloop_mtx);
-          std::lock_guard dl(draw::drawing_mtx);
-          auto tank = g::id_at(id);
-          if (tank == nullptr || tank->is_auto)
-            return make_response(-1, std::string{"No such user."});
-          else if (tank->is_alive())
-            return make_response(-1, std::string{"Already logined."});
-          bc::info(bc::to_everyone, "{} ({}) logined.", ipstr, id);
-          g::revive(id, g::state.users[id].visible_zone, id);
-          g::state.users[id].last_update = std::chrono::steady_clock::now();
-          g::state.users[id].active = true;
-          return make_response(0, std::string{"Success."});
-        }
-        else if (cmd == "logout")
-        {
-          std::string ipstr;
-          if (auto ip = utils::get_peer_ip(fd); ip.has_value())
-            ipstr = *ip;
-          auto id = utils::deserialize<size_t>(args);
-          std::lock_guard ml(g::mainloop_mtx);
-          std::lock_guard dl(draw::drawing_mtx);
-          bc::info(bc::to_everyone, "{} ({}) logout.", ipstr, id);
-          g::state.tanks[id]->kill();
-          g::state.tanks[id]->clear();
-          g::state.users[id].active = false;
-          return "";
-        }
-        else if (cmd == "add_auto_tank")
-        {
-          auto [id, zone, lvl]
-              = utils::deserialize<size_t, map::Zone, size_t>(args);
-          std::lock_guard ml(g::mainloop_mtx);
-          std::lock_guard dl(draw::drawing_mtx);
-          g::add_auto_tank(lvl, zone, id);
-          return "";
-        }
-        else if (cmd == "run_command")
-        {
-          auto [id, command] = utils::deserialize<size_t, std::string>(args);
-          cmd::run_command(id, command);
-          return "";
-        }
-        return "";
+        auto parsed = utils::try_deserialize<uint32_t, std::string_view>(packet);
+        if (!parsed.has_value())
+          return std::string{};
+        auto [request_id, req] = *parsed;
+        auto res = route(fd, req);
+        if (request_id == 0 || res.empty())
+          return std::string{};
+        return tag_request(request_id, res);
       },
-
-      [](utils::Socket_t fd)
+      [this](utils::Socket_t fd)
       {
+        unsubscribe(fd);
+        leave_room(fd);
       },
-      [](utils::Socket_t fd)
+      [this](utils::Socket_t fd)
       {
+        // A frame stream closes with its client, which reports it.
+        if (auto sub = unsubscribe(fd); sub != nullptr && sub->udp == nullptr)
+        {
+          leave_room(fd);
+          return;
+        }
         std::string ipstr;
         if (auto ip = utils::get_peer_ip(fd); ip.has_value())
           ipstr = *ip;
-        bc::info(bc::to_everyone, std::format("{} disconnected unexpectedly.", ipstr));
+        {
+          auto room = room_of(fd);
+          g::WorldScope scope(*room);
+          bc::info(bc::to_everyone, std::format("{} disconnected unexpectedly.", ipstr));
+        }
+        leave_room(fd);
       }
     );
 
-    dbg::tank_assert(g::state.mode == g::Mode::SERVER);
+    dbg::tank_assert(g::state().mode == g::Mode::SERVER);
     try
     {
       svr->bind_and_listen(port_);
-      bc::info(g::state.id, "Server started at {}.", port);
+      bc::info(g::state().id, "Server started at {}.", port);
       th = std::thread([this] { svr->start(); });
+      // Clients can still use TCP without it.
+      try
+      {
+        udp = new utils::UDPSocket(&net_sim);
+        udp->open(port_);
+        udp_stopping = false;
+        udp_th = std::thread([this] { receive_datagrams(); });
+      }
+      catch (std::runtime_error& err)
+      {
+        delete udp;
+        udp = nullptr;
+        bc::warn(g::state().id, "UDP unavailable: {}", err.what());
+      }
+      push_stopping = false;
+      outbox.clear();
+      push_th = std::thread([this] { push_frames(); });
     }
     catch (std::runtime_error& err)
     {
-      g::state.mode = g::Mode::NATIVE;
-      bc::error(g::state.id, err.what());
+      g::state().mode = g::Mode::NATIVE;
+      bc::error(g::state().id, err.what());
       return;
     }
   }
 
   void TankServer::stop()
   {
+    //
+    {
+      std::lock_guard pl(push_mtx);
+      push_stopping = true;
+    }
+    push_cond.notify_one();
+    if (push_th.joinable())
+      push_th.join();
     svr->stop();
     th.join();
     delete svr;
+    svr = nullptr;
+    if (udp != nullptr)
+    {
+      udp_stopping = true;
+      udp_th.join();
+      delete udp;
+      udp = nullptr;
+    }
+    //
+    {
+      std::lock_guard sl(subscribers_mtx);
+      subscribers.clear();
+      udp_subscribers.clear();
+      has_subscribers = false;
+    }
+    g::close_rooms();
+    std::lock_guard l(rooms_mtx);
+    rooms.clear();
+  }
+
+  // Tanks this far out of a zone are still sent, so that ones moving along its edge
+  // don't leave and enter every other tick.
+  constexpr int interest_margin = 8;
+
+  // The status page's roster is capped, so that a crowded world can't grow a frame past max_frame_size.
+  constexpr size_t max_roster = 1024;
+
+  // The tanks a subscriber is sent: those around its zone and every user's, and for the status page
+  // the others too, up to max_roster in all. Each TankView is made once per tick in cache. Requires mainloop_mtx.
+  std::map<size_t, draw::TankView> interest_of(const map::Zone& zone, bool roster,
+                                               std::map<size_t, draw::TankView>& cache)
+  {
+    std::map<size_t, draw::TankView> ret;
+    auto add = [&ret, &cache](const tank::Tank* t)
+    {
+      auto it = cache.find(t->get_id());
+      if (it == cache.end())
+        it = cache.emplace(t->get_id(), draw::extract_tank(t)).first;
+      ret.emplace(*it);
+    };
+    for (auto& t : map::map().tanks_in(zone.bigger_zone(interest_margin)))
+      add(t);
+    for (auto& id : g::state().users | std::views::keys)
+    {
+      if (auto t = g::id_at(id); t != nullptr)
+        add(t);
+    }
+    if (roster)
+    {
+      for (auto it = g::state().tanks.begin(); it != g::state().tanks.end() && ret.size() < max_roster; ++it)
+        add(it->second);
+    }
+    return ret;
+  }
+
+  // What the frames of a tick have in common. Everything is made when first needed, once for
+  // all the subscribers, and the serialized parts are shared by their frames.
+  struct FrameCache
+  {
+    std::shared_ptr<const std::map<size_t, draw::UserView> > userinfo;
+    std::map<size_t, draw::TankView> tanks;
+    std::map<size_t, std::shared_ptr<const std::string> > tank_entries; // As elements of a std::map
+    // By the userinfo of the baseline, the same for all the clients that acked the same tick.
+    std::map<const std::map<size_t, draw::UserView>*, std::shared_ptr<const std::string> > userinfo_deltas;
+  };
+
+  // The frame of a subscriber: the tick, how many frames were skipped, its zone, the changes and messages
+  // since its last frame, and everything visible as a delta against the baseline of the tick the client acked.
+  // Without that baseline the frame is a delta against nothing, i.e. a full one.
+  // Tanks entering or leaving its interest are the added and removed ones. Requires mainloop_mtx.
+  std::string make_frame(Subscriber& sub, size_t skipped, const map::Zone& zone, bool roster, FrameCache& cache)
+  {
+    static const Baseline empty_baseline{.tick = 0, .userinfo = std::make_shared<std::map<size_t, draw::UserView> >()};
+
+    auto& user = g::state().users[sub.id];
+    std::set<map::Pos> changes;
+    for (auto& r : user.map_changes)
+    {
+      if (zone.contains(r))
+        changes.insert(r);
+    }
+    bool full_resync = user.full_resync;
+    user.map_changes.clear();
+    user.full_resync = false;
+    user.last_update = std::chrono::steady_clock::now();
+
+    std::vector<msg::Message> msgs;
+    {
+      std::lock_guard sl(bc::send_msg_mtx());
+      for (auto& m : bc::take_unread(sub.id))
+        msgs.emplace_back(*m);
+    }
+    // Frames over UDP may be lost, messages mustn't.
+    if (sub.udp != nullptr && !msgs.empty())
+    {
+      sub.udp->send_reliable(utils::serialize(msgs));
+      msgs.clear();
+    }
+
+    // Acks only move forward, older baselines are never needed again.
+    size_t acked = sub.acked;
+    while (!sub.baselines.empty() && sub.baselines.front().tick < acked)
+      sub.baselines.pop_front();
+    const Baseline* base = &empty_baseline;
+    if (acked != 0 && !sub.baselines.empty() && sub.baselines.front().tick == acked)
+      base = &sub.baselines.front();
+
+    auto& userinfo_delta = cache.userinfo_deltas[base->userinfo.get()];
+    if (userinfo_delta == nullptr)
+      userinfo_delta = std::make_shared<const std::string>(utils::serialize(utils::diff(*base->userinfo, *cache.userinfo)));
+
+    // Serialized like the MapDelta, from the tanks serialized for this tick.
+    auto tanks = interest_of(zone, roster, cache.tanks);
+    utils::Serialized tanks_changed;
+    std::vector<size_t> tanks_removed;
+    utils::diff(base->tanks, tanks,
+                [&cache, &tanks_changed](size_t id, const draw::TankView& t)
+                {
+                  auto& entry = cache.tank_entries[id];
+                  if (entry == nullptr)
+                    entry = std::make_shared<const std::string>(utils::serialize_element(std::pair{id, t}));
+                  tanks_changed.pieces.emplace_back(entry);
+                },
+                [&tanks_removed](size_t id) { tanks_removed.emplace_back(id); });
+
+    auto map_view = draw::extract_map(zone);
+    auto ret = make_response(g::state().tick, skipped, base->tick, zone, map_view.seed, changes, full_resync, msgs,
+                             utils::Serialized{{userinfo_delta}},
+                             std::pair{std::move(tanks_changed), std::move(tanks_removed)},
+                             utils::diff(base->view, map_view.view));
+
+    sub.baselines.emplace_back(Baseline{
+      .tick = g::state().tick,
+      .userinfo = cache.userinfo,
+      .tanks = std::move(tanks),
+      .view = std::move(map_view.view)
+    });
+    if (sub.baselines.size() > max_baselines)
+      sub.baselines.pop_front();
+    return ret;
+  }
+
+  bool TankServer::subscribe(utils::Socket_t fd, size_t id, const map::Zone& zone,
+                             std::shared_ptr<utils::UDPConnection> conn)
+  {
+    if (!is_valid_zone(zone))
+      return false;
+    //
+    {
+      std::lock_guard ml(g::mainloop_mtx());
+      if (!g::state().users.contains(id))
+        return false;
+      g::set_visible_zone(id, visible_part(zone));
+    }
+    auto sub = std::make_shared<Subscriber>(fd, &g::world(), id, zone);
+    // Nothing but frames is sent on a stream, and they are sent without blocking. (see push_frames())
+    if (conn == nullptr)
+      utils::set_nonblocking(fd);
+    else
+      sub->udp = std::move(conn);
+    std::lock_guard sl(subscribers_mtx);
+    if (sub->udp != nullptr)
+      udp_subscribers[sub->udp->get_token()] = sub;
+    subscribers[fd] = std::move(sub);
+    has_subscribers = true;
+    return true;
+  }
+
+  std::shared_ptr<Subscriber> TankServer::unsubscribe(utils::Socket_t fd)
+  {
+    std::shared_ptr<Subscriber> sub;
+    //
+    {
+      std::lock_guard sl(subscribers_mtx);
+      auto it = subscribers.find(fd);
+      if (it == subscribers.end())
+        return nullptr;
+      sub = std::move(it->second);
+      subscribers.erase(it);
+      if (sub->udp != nullptr)
+        udp_subscribers.erase(sub->udp->get_token());
+      has_subscribers = !subscribers.empty();
+    }
+    // Waits for a frame being sent, fd is closed after this returns.
+    std::lock_guard l(sub->send_mtx);
+    sub->closed = true;
+    return sub;
+  }
+
+  void TankServer::publish_frames()
+  {
+    if (!has_subscribers)
+      return;
+    std::vector<std::tuple<std::shared_ptr<Subscriber>, size_t, map::Zone, bool> > subs;
+    //
+    {
+      std::lock_guard sl(subscribers_mtx);
+      std::lock_guard pl(push_mtx);
+      for (auto& sub : subscribers | std::views::values)
+      {
+        if (sub->world != &g::world())
+          continue;
+        // Counted here, so that the catch-up steps between two calls aren't taken for skipped frames.
+        if (sub->pending)
+          ++sub->skipped;
+        else
+        {
+          subs.emplace_back(sub, sub->skipped, sub->zone, sub->roster);
+          sub->skipped = 0;
+        }
+      }
+    }
+    if (subs.empty())
+      return;
+
+    std::vector<std::pair<std::shared_ptr<Subscriber>, std::string> > frames;
+    //
+    {
+      std::lock_guard ml(g::mainloop_mtx());
+      FrameCache cache{
+        .userinfo = std::make_shared<const std::map<size_t, draw::UserView> >(draw::extract_userinfo())
+      };
+      for (auto& [sub, skipped, zone, roster] : subs)
+      {
+        if (g::state().users.contains(sub->id))
+          frames.emplace_back(sub, make_frame(*sub, skipped, zone, roster, cache));
+      }
+    }
+    //
+    {
+      std::lock_guard pl(push_mtx);
+      for (auto& frame : frames)
+      {
+        frame.first->pending = true;
+        outbox.emplace_back(std::move(frame));
+      }
+    }
+    push_cond.notify_one();
+  }
+
+  // The most a frame can be, over a stream as over datagrams.
+  constexpr size_t max_frame_size = utils::max_sequenced_size;
+
+  // A client whose stream has no room for a frame for so long is dropped.
+  constexpr auto stall_timeout = std::chrono::seconds(2);
+
+  // How often the frames that didn't fit are tried again.
+  constexpr auto stall_retry = std::chrono::milliseconds(5);
+
+  // Sends what the socket has room for of the subscriber's frame. True once the frame is done with,
+  // false if the rest has to wait. Requires send_mtx.
+  bool send_frame(Subscriber& sub)
+  {
+    if (sub.closed)
+      return true;
+    std::vector<utils::IoBuf> bufs;
+    size_t frame_sent = 0;
+    if (sub.out_sent < sizeof(utils::MsgHeader))
+    {
+      bufs.emplace_back(utils::make_io_buf(reinterpret_cast<const char*>(&sub.out_header) + sub.out_sent,
+                                           sizeof(utils::MsgHeader) - sub.out_sent));
+    }
+    else
+      frame_sent = sub.out_sent - sizeof(utils::MsgHeader);
+    bufs.emplace_back(utils::make_io_buf(sub.out_frame.data() + frame_sent, sub.out_frame.size() - frame_sent));
+
+    auto sent = utils::send_some(sub.fd, bufs);
+    if (sent >= 0)
+      sub.out_sent += static_cast<size_t>(sent);
+    if (sent >= 0 && sub.out_sent == sizeof(utils::MsgHeader) + sub.out_frame.size())
+    {
+      sub.out_frame.clear();
+      return true;
+    }
+    if (sent < 0 || std::chrono::steady_clock::now() - sub.out_begin > stall_timeout)
+    {
+      // Possibly half sent, the stream can't be resumed.
+      sub.closed = true;
+      utils::tank_shutdown(sub.fd);
+      return true;
+    }
+    return false;
+  }
+
+  void TankServer::push_frames()
+  {
+    std::vector<std::pair<std::shared_ptr<Subscriber>, std::string> > sending;
+    // The streams that had no room for all of their frame. Like the others, they get no
+    // new frame until it is sent.
+    std::vector<std::shared_ptr<Subscriber> > stalled;
+    std::vector<std::shared_ptr<Subscriber> > done;
+    while (true)
+    {
+      //
+      {
+        std::unique_lock pl(push_mtx);
+        auto ready = [this] { return push_stopping || !outbox.empty(); };
+        if (stalled.empty())
+          push_cond.wait(pl, ready);
+        else
+          push_cond.wait_for(pl, stall_retry, ready);
+        if (push_stopping)
+          return;
+        sending.swap(outbox);
+      }
+      std::erase_if(stalled, [&done](auto& sub)
+      {
+        std::lock_guard l(sub->send_mtx);
+        if (!send_frame(*sub))
+          return false;
+        done.emplace_back(sub);
+        return true;
+      });
+      for (auto& [sub, frame] : sending)
+      {
+        std::lock_guard l(sub->send_mtx);
+        if (sub->closed)
+        {
+          done.emplace_back(sub);
+          continue;
+        }
+        if (frame.size() > max_frame_size)
+        {
+          // The client is dropped, a full frame to resync it would be no smaller.
+          sub->closed = true;
+          utils::tank_shutdown(sub->fd);
+          done.emplace_back(sub);
+          continue;
+        }
+        if (sub->udp != nullptr)
+        {
+          // Nowhere to send before the client's first datagram.
+          if (auto peer = sub->udp->get_peer(); peer.has_value())
+          {
+            // Never empty, the frame's size was checked above.
+            auto datagrams = sub->udp->make_datagrams(&frame);
+            for (auto& d : *datagrams)
+            {
+              if (udp->send_to(*peer, d) != 0)
+                break;
+            }
+          }
+          done.emplace_back(sub);
+          continue;
+        }
+        sub->out_header = utils::make_header(utils::HEADER_MAGIC, frame.size());
+        sub->out_frame = std::move(frame);
+        sub->out_sent = 0;
+        sub->out_begin = std::chrono::steady_clock::now();
+        if (send_frame(*sub))
+          done.emplace_back(sub);
+        else
+          stalled.emplace_back(sub);
+      }
+      //
+      {
+        std::lock_guard pl(push_mtx);
+        for (auto& sub : done)
+          sub->pending = false;
+      }
+      sending.clear();
+      done.clear();
+    }
+  }
+
+  void TankServer::receive_datagrams()
+  {
+    sockaddr_in from{};
+    std::string data;
+    std::vector<utils::Delivery> deliveries;
+    while (!udp_stopping)
+    {
+      if (!udp->recv_from(from, data, std::chrono::milliseconds(50)))
+        continue;
+      // Anyone can send to the port, only the datagrams of a subscriber are parsed.
+      auto token = utils::datagram_token(data);
+      if (!token.has_value())
+        continue;
+      std::shared_ptr<Subscriber> sub;
+      //
+      {
+        std::lock_guard sl(subscribers_mtx);
+        auto it = udp_subscribers.find(*token);
+        if (it == udp_subscribers.end())
+          continue;
+        sub = it->second;
+      }
+      auto datagram = utils::parse_datagram(data);
+      if (!datagram.has_value())
+        continue;
+      deliveries.clear();
+      sub->udp->receive(from, std::move(*datagram), deliveries);
+      for (auto& d : deliveries)
+        route(sub->fd, d.data);
+    }
+  }
+
+  std::shared_ptr<g::World> TankServer::room_of(utils::Socket_t fd)
+  {
+    std::lock_guard l(rooms_mtx);
+    auto it = rooms.find(fd);
+    if (it == rooms.end())
+      return {std::shared_ptr<g::World>{}, &g::default_world()};
+    return it->second;
+  }
+
+  std::shared_ptr<g::World> TankServer::join_room(utils::Socket_t fd, const std::string& name)
+  {
+    auto room = g::join_room(name);
+    if (room == nullptr)
+      return nullptr;
+    std::shared_ptr<g::World> prev;
+    //
+    {
+      std::lock_guard l(rooms_mtx);
+      prev = std::exchange(rooms[fd], room);
+    }
+    if (prev != nullptr)
+      g::leave_room(*prev);
+    return room;
+  }
+
+  void TankServer::leave_room(utils::Socket_t fd)
+  {
+    std::shared_ptr<g::World> room;
+    //
+    {
+      std::lock_guard l(rooms_mtx);
+      auto it = rooms.find(fd);
+      if (it == rooms.end())
+        return;
+      room = std::move(it->second);
+      rooms.erase(it);
+    }
+    g::leave_room(*room);
   }
 
   TankServer::~TankServer()
@@ -254,47 +806,195 @@ namespace czh::online
 
   void TankClient::cli_failed(bool shutdown)
   {
-    dbg::tank_assert(g::state.mode == g::Mode::CLIENT);
-    cli->disconnect();
-    delete cli;
-    cli = nullptr;
+    dbg::tank_assert(g::state().mode == g::Mode::CLIENT);
+    stop_stream();
+    stop_io();
 
-    g::state.mode = g::Mode::NATIVE;
-    g::state.users = {{0, g::state.users[g::state.id]}};
-    g::state.id = 0;
-    draw::state.focus = g::state.id;
+    g::state().mode = g::Mode::NATIVE;
+    g::state().users = {{0, g::state().users[g::state().id]}};
+    g::state().id = 0;
+    draw::state.focus = g::state().id;
     draw::state.inited = false;
     if (shutdown)
-      bc::error(g::state.id, "Server is about to shutdown");
+      bc::error(g::state().id, "Server is about to shutdown");
     else
-      bc::error(g::state.id, "Disconnected due to network issues.");
+      bc::error(g::state().id, "Disconnected due to network issues.");
+  }
+
+  void TankClient::start_io()
+  {
+    io_queue.drain([](std::string&&) {});
+    io_stopping = false;
+    io_failed = false;
+    io_err = utils::RecvRet::ok;
+    pinging = false;
+    //
+    {
+      std::lock_guard pl(pending_mtx);
+      io_closed = false;
+    }
+    io_th = std::thread([this] { io_loop(); });
+  }
+
+  void TankClient::stop_io()
+  {
+    if (cli == nullptr)
+      return;
+    io_stopping = true;
+    io_poller.wake();
+    if (io_th.joinable())
+      io_th.join();
+    cli->disconnect();
+    delete cli;
+    cli = nullptr;
+  }
+
+  void TankClient::io_loop()
+  {
+    auto fd = cli->get_socket();
+    io_poller.add(fd);
+    std::vector<utils::Socket_t> ready;
+    utils::OutBuffer out;
+    auto err = utils::RecvRet::ok;
+    while (err == utils::RecvRet::ok)
+    {
+      // Everything queued since the last turn goes out in one write.
+      io_queue.drain([&out](std::string&& req) { out.add(std::move(req)); });
+      if (out.flush(fd) != 0)
+      {
+        err = utils::RecvRet::failed;
+        break;
+      }
+      // Stops after sending everything queued before, like the logout.
+      if (io_stopping)
+        break;
+
+      ready.clear();
+      if (io_poller.wait(ready) != 0)
+      {
+        err = utils::RecvRet::failed;
+        break;
+      }
+      if (ready.empty())
+        continue;
+      if (cli->receive() != utils::RecvRet::ok)
+      {
+        err = utils::RecvRet::failed;
+        break;
+      }
+      // Every response received so far. A partial one stays buffered until the socket is readable again.
+      while (auto packet = cli->next())
+      {
+        auto [recv_err, res] = *packet;
+        if (recv_err != utils::RecvRet::ok)
+        {
+          err = recv_err;
+          break;
+        }
+        auto [request_id, body] = utils::deserialize<uint32_t, std::string_view>(res);
+        std::function<void(utils::RecvRet, std::string)> callback;
+        //
+        {
+          std::lock_guard pl(pending_mtx);
+          if (auto it = pending.find(request_id); it != pending.end())
+          {
+            callback = std::move(it->second);
+            pending.erase(it);
+          }
+        }
+        if (callback)
+          callback(utils::RecvRet::ok, std::string{body});
+      }
+      if (err != utils::RecvRet::ok)
+        break;
+      io_poller.rearm(fd);
+    }
+    io_poller.remove(fd);
+
+    if (err != utils::RecvRet::ok)
+    {
+      io_err = err;
+      io_failed = true;
+    }
+    decltype(pending) unanswered;
+    //
+    {
+      std::lock_guard pl(pending_mtx);
+      io_closed = true;
+      unanswered.swap(pending);
+    }
+    for (auto& callback : unanswered | std::views::values)
+      callback(err == utils::RecvRet::ok ? utils::RecvRet::failed : err, "");
   }
 
-  std::optional<size_t> TankClient::signup(const std::string& addr_, int port_)
+  void TankClient::request(std::string req, std::function<void(utils::RecvRet, std::string)> callback)
   {
-    if (cli != nullptr)
+    std::unique_lock pl(pending_mtx);
+    if (io_closed)
     {
-      cli->disconnect();
-      delete cli;
-      cli = nullptr;
+      pl.unlock();
+      callback(io_failed ? io_err : utils::RecvRet::failed, "");
+      return;
     }
+    auto request_id = next_request++;
+    if (next_request == 0)
+      next_request = 1;
+    pending.emplace(request_id, std::move(callback));
+    pl.unlock();
+    io_queue.push(tag_request(request_id, req));
+    io_poller.wake();
+  }
+
+  std::tuple<utils::RecvRet, std::string> TankClient::request_and_wait(std::string req)
+  {
+    auto promise = std::make_shared<std::promise<std::tuple<utils::RecvRet, std::string> > >();
+    auto future = promise->get_future();
+    request(std::move(req), [promise](utils::RecvRet err, std::string res)
+    {
+      promise->set_value({err, std::move(res)});
+    });
+    return future.get();
+  }
+
+  int TankClient::post(std::string req)
+  {
+    if (io_failed)
+      return -1;
+    io_queue.push(tag_request(0, req));
+    io_poller.wake();
+    return 0;
+  }
+
+  std::optional<size_t> TankClient::signup(const std::string& addr_, int port_, const std::string& room_)
+  {
+    stop_stream();
+    stop_io();
     cli = new utils::TCPClient();
     cli->init();
     std::lock_guard l(online_mtx);
     host = addr_;
     port = port_;
+    room = room_;
     if (cli->connect(addr_, port_) != 0)
     {
       cli_failed();
       return std::nullopt;
     }
+    start_io();
 
-    std::string content = make_request("register");
-    auto [err, res] = cli->send_and_recv(content);
+    auto [err, res] = request_and_wait(make_request("register", room));
 
     if (err == utils::RecvRet::ok)
     {
-      auto id = utils::deserialize<size_t>(res);
+      auto [i, msg, id] = utils::deserialize<int, std::string, size_t>(res);
+      if (i != 0)
+      {
+        bc::error(g::state().id, msg);
+        cli_failed();
+        return std::nullopt;
+      }
+      if (subscribe(id) != 0)
+        return std::nullopt;
       return id;
     }
     else if (err == utils::RecvRet::failed)
@@ -310,37 +1010,34 @@ namespace czh::online
     return std::nullopt;
   }
 
-  int TankClient::login(const std::string& addr_, int port_, size_t id)
+  int TankClient::login(const std::string& addr_, int port_, const std::string& room_, size_t id)
   {
-    if (cli != nullptr)
-    {
-      cli->disconnect();
-      delete cli;
-      cli = nullptr;
-    }
+    stop_stream();
+    stop_io();
     cli = new utils::TCPClient();
     cli->init();
     std::lock_guard l(online_mtx);
     host = addr_;
     port = port_;
+    room = room_;
     if (cli->connect(addr_, port_) != 0)
     {
       cli_failed();
       return -1;
     }
+    start_io();
 
-    std::string content = make_request("login", id);
-    auto [err, res] = cli->send_and_recv(content);
+    auto [err, res] = request_and_wait(make_request("login", id, room));
 
     if (err == utils::RecvRet::ok)
     {
       auto [i, msg] = utils::deserialize<int, std::string>(res);
       if (i != 0)
       {
-        bc::error(g::state.id, msg);
+        bc::error(g::state().id, msg);
         return -2;
       }
-      return 0;
+      return subscribe(id);
     }
     else if (err == utils::RecvRet::failed)
     {
@@ -358,27 +1055,26 @@ namespace czh::online
   void TankClient::logout()
   {
     std::lock_guard l(online_mtx);
-    std::string content = make_request("logout", g::state.id);
-    if (cli->send(content) < 0)
-    {
-#ifdef _WIN32
-      char buf[256];
-      strerror_s(buf, sizeof(buf), errno);
-      bc::error(g::state.id, std::format("send(): {}", buf));
-#else
-      bc::error(g::state.id, std::format("send(): {}", strerror(errno)));
-#endif
-    }
-    cli->disconnect();
-    delete cli;
-    cli = nullptr;
+    if (post(make_request("logout", g::state().id)) != 0)
+      bc::error(g::state().id, "Failed to send the logout request.");
+    stop_stream();
+    // Sends the logout first.
+    stop_io();
   }
 
   int TankClient::tank_react(tank::NormalTankEvent e)
   {
     std::lock_guard l(online_mtx);
-    std::string content = make_request("tank_react", g::state.id, e);
-    if (cli->send(content) != 0)
+    std::string content = make_request("tank_react", g::state().id, e);
+    if (udp != nullptr)
+    {
+      udp_conn->send_redundant(std::move(content));
+      if (send_datagrams() == 0)
+        return 0;
+      cli_failed();
+      return -1;
+    }
+    if (post(std::move(content)) != 0)
     {
       cli_failed();
       return -1;
@@ -386,58 +1082,326 @@ namespace czh::online
     return 0;
   }
 
-  int TankClient::update()
+  int TankClient::subscribe(size_t id)
   {
-    std::lock_guard l(online_mtx);
-    auto beg = std::chrono::steady_clock::now();
-    std::string content = make_request("update", g::state.id, draw::state.visible_zone.bigger_zone(10));
-    auto [err, res] = cli->send_and_recv(content);
+    auto zone = draw::get_snapshot_zone();
+    if (use_udp)
+    {
+      auto [err, res] = request_and_wait(make_request("subscribe_udp", id, room, zone));
+      if (err != utils::RecvRet::ok)
+      {
+        cli_failed(err == utils::RecvRet::shutdown);
+        return -1;
+      }
+      auto token = utils::deserialize<uint64_t>(res);
+      if (token == 0)
+      {
+        bc::error(g::state().id, "The server doesn't accept UDP.");
+        cli_failed();
+        return -1;
+      }
+      udp = new utils::UDPSocket(&net_sim);
+      try
+      {
+        udp->open(0);
+      }
+      catch (std::runtime_error& err)
+      {
+        bc::error(g::state().id, err.what());
+        delete udp;
+        udp = nullptr;
+        cli_failed();
+        return -1;
+      }
+      udp_conn = std::make_unique<utils::UDPConnection>(token, utils::make_address(host, port));
+    }
+    else
+    {
+      stream = new utils::TCPClient();
+      stream->init();
+      if (stream->connect(host, port) != 0
+          || stream->send(tag_request(0, make_request("subscribe", id, room, zone))) != 0)
+      {
+        stop_stream();
+        cli_failed();
+        return -1;
+      }
+    }
+    stream_zone = zone;
+    stream_roster = false;
+    stream_stopping = false;
+    stream_failed = false;
+    stream_err = utils::RecvRet::ok;
+    baselines.clear();
+    frame_lost = false;
+    last_ping = {};
+    state.dropped_frames = 0;
+    if (udp != nullptr)
+      stream_th = std::thread([this, id] { receive_datagrams(id); });
+    else
+      stream_th = std::thread([this, id] { receive_frames(id); });
+    return 0;
+  }
 
-    if (err == utils::RecvRet::ok)
+  void TankClient::stop_stream()
+  {
+    if (stream == nullptr && udp == nullptr)
+      return;
+    stream_stopping = true;
+    if (stream != nullptr)
+      stream->interrupt();
+    if (stream_th.joinable())
+      stream_th.join();
+    delete stream;
+    stream = nullptr;
+    delete udp;
+    udp = nullptr;
+    udp_conn.reset();
+  }
+
+  void receive_messages(size_t id, std::vector<msg::Message> msgs)
+  {
+    std::lock_guard sl(bc::send_msg_mtx());
+    for (auto& r : msgs)
+      bc::receive_message(id, std::move(r));
+  }
+
+  size_t TankClient::apply_frame(size_t id, std::string_view frame, bool resync)
+  {
+    size_t tick;
+    size_t skipped;
+    size_t base_tick;
+    size_t seed;
+    draw::Snapshot snapshot;
+    std::vector<msg::Message> msgs;
+    utils::MapDelta<size_t, draw::UserView> userinfo;
+    utils::MapDelta<size_t, draw::TankView> tanks;
+    utils::MapDelta<map::Pos, draw::PointView> view;
+    std::tie(tick, skipped, base_tick, snapshot.zone, seed, snapshot.changes, snapshot.full_resync,
+             msgs, userinfo, tanks, view)
+        = utils::deserialize<
+          decltype(tick),
+          decltype(skipped),
+          decltype(base_tick),
+          decltype(snapshot.zone),
+          decltype(seed),
+          decltype(snapshot.changes),
+          decltype(snapshot.full_resync),
+          decltype(msgs),
+          decltype(userinfo),
+          decltype(tanks),
+          decltype(view)>(frame);
+    // The server skips a subscriber still sending its last frame, the next one has
+    // everything since then. Ticks aren't counted, several may pass between two frames.
+    state.dropped_frames += skipped;
+    receive_messages(id, std::move(msgs));
+
+    // The changes in the frames before were lost, the next snapshot redraws everything.
+    frame_lost |= resync;
+
+    // The server only uses the last acked baseline, so older ones can go.
+    const Baseline* base = nullptr;
+    if (base_tick != 0)
     {
-      int delay;
-      auto old_seed = draw::state.snapshot.map.seed;
-      std::vector<msg::Message> msgs;
-      std::tie(delay, draw::state.snapshot.userinfo, draw::state.snapshot.changes, draw::state.snapshot.tanks,
-               msgs, draw::state.snapshot.map)
-          = utils::deserialize<
-            decltype(delay),
-            decltype(draw::state.snapshot.userinfo),
-            decltype(draw::state.snapshot.changes),
-            decltype(draw::state.snapshot.tanks),
-            decltype(msgs),
-            decltype(draw::state.snapshot.map)>(res);
-      int curr_delay = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>
-                         (std::chrono::steady_clock::now() - beg).count()) - delay;
-      state.delay = static_cast<int>((state.delay + 0.1 * curr_delay) / 1.1);
-
-      for (auto& r : msgs) // reverse
-        g::state.users[g::state.id].messages.emplace_back(r);
-
-      if (old_seed != draw::state.snapshot.map.seed)
-        draw::state.inited = false;
-      return 0;
+      while (!baselines.empty() && baselines.front().tick < base_tick)
+        baselines.pop_front();
+      if (!baselines.empty() && baselines.front().tick == base_tick)
+        base = &baselines.front();
+      // Asks for a full frame.
+      if (base == nullptr)
+      {
+        frame_lost = true;
+        return 0;
+      }
     }
-    else if (err == utils::RecvRet::failed)
+
+    if (base != nullptr)
     {
-      cli_failed();
+      snapshot.userinfo = *base->userinfo;
+      snapshot.tanks = base->tanks;
+      snapshot.map.view = base->view;
+    }
+    utils::apply(snapshot.userinfo, userinfo);
+    utils::apply(snapshot.tanks, tanks);
+    utils::apply(snapshot.map.view, view);
+    snapshot.map.seed = seed;
+    snapshot.full_resync |= frame_lost;
+    frame_lost = false;
+
+    baselines.emplace_back(Baseline{
+      .tick = tick,
+      .userinfo = std::make_shared<const std::map<size_t, draw::UserView> >(snapshot.userinfo),
+      .tanks = snapshot.tanks,
+      .view = snapshot.map.view
+    });
+    if (baselines.size() > max_baselines)
+      baselines.pop_front();
+    draw::publish_snapshot(std::move(snapshot));
+    return tick;
+  }
+
+  void TankClient::receive_frames(size_t id)
+  {
+    while (true)
+    {
+      auto [err, res] = stream->recv();
+      if (err != utils::RecvRet::ok)
+      {
+        stream_err = err;
+        stream_failed = true;
+        return;
+      }
+      auto ack = apply_frame(id, res, false);
+      std::lock_guard l(stream_mtx);
+      if (stream->send(tag_request(0, make_request("ack", ack))) != 0)
+      {
+        stream_err = utils::RecvRet::failed;
+        stream_failed = true;
+        return;
+      }
+    }
+  }
+
+  // Without frames, the client still acks what it received this often.
+  constexpr auto udp_heartbeat = std::chrono::milliseconds(100);
+
+  // The server is gone if nothing came for so long.
+  constexpr auto udp_timeout = std::chrono::seconds(5);
+
+  void TankClient::receive_datagrams(size_t id)
+  {
+    sockaddr_in from{};
+    std::string data;
+    std::vector<utils::Delivery> deliveries;
+    uint32_t last_frame = 0;
+    // The first one tells the server where to send frames.
+    std::chrono::steady_clock::time_point last_sent;
+    while (!stream_stopping)
+    {
+      auto now = std::chrono::steady_clock::now();
+      if (udp_conn->since_received() > udp_timeout)
+      {
+        stream_err = utils::RecvRet::failed;
+        stream_failed = true;
+        return;
+      }
+      if (now - last_sent >= udp_heartbeat)
+      {
+        [[maybe_unused]] auto ret = send_datagrams();
+        last_sent = now;
+      }
+
+      if (!udp->recv_from(from, data, std::chrono::milliseconds(10)))
+        continue;
+      auto datagram = utils::parse_datagram(data);
+      if (!datagram.has_value() || datagram->token != udp_conn->get_token())
+        continue;
+      deliveries.clear();
+      udp_conn->receive(from, std::move(*datagram), deliveries);
+      for (auto& d : deliveries)
+      {
+        if (d.channel == utils::Channel::reliable)
+          receive_messages(id, utils::deserialize<std::vector<msg::Message> >(d.data));
+        else if (d.channel == utils::Channel::sequenced)
+        {
+          auto ack = apply_frame(id, d.data, last_frame != 0 && d.id != last_frame + 1);
+          last_frame = d.id;
+          // The ack is sequenced too, only the latest one matters.
+          auto req = make_request("ack", ack);
+          [[maybe_unused]] auto ret = send_datagrams(&req);
+          last_sent = std::chrono::steady_clock::now();
+        }
+      }
+    }
+  }
+
+  int TankClient::send_datagrams(const std::string* sequenced)
+  {
+    auto peer = udp_conn->get_peer();
+    auto datagrams = udp_conn->make_datagrams(sequenced);
+    if (!datagrams.has_value())
       return -1;
+    for (auto& d : *datagrams)
+    {
+      if (udp->send_to(*peer, d) != 0)
+        return -1;
     }
-    else if (err == utils::RecvRet::shutdown)
+    return 0;
+  }
+
+  int TankClient::update()
+  {
+    std::lock_guard l(online_mtx);
+    if (stream_failed || io_failed)
     {
-      cli_failed(true);
-      state.delay = -1;
-      draw::state.inited = false;
+      auto err = stream_failed ? stream_err : io_err;
+      if (err == utils::RecvRet::shutdown)
+      {
+        cli_failed(true);
+        state.delay = -1;
+        draw::state.inited = false;
+      }
+      else
+        cli_failed();
       return -1;
     }
-    return -1;
+
+    auto zone = draw::get_snapshot_zone();
+    bool roster = g::state().page == g::Page::STATUS;
+    if (zone != stream_zone || roster != stream_roster)
+    {
+      int ret;
+      if (udp != nullptr)
+      {
+        udp_conn->send_reliable(make_request("view", zone, roster));
+        ret = send_datagrams();
+      }
+      else
+      {
+        // Not held by cli_failed(), which waits for stream_th.
+        std::lock_guard sl(stream_mtx);
+        ret = stream->send(tag_request(0, make_request("view", zone, roster)));
+      }
+      if (ret != 0)
+      {
+        cli_failed();
+        return -1;
+      }
+      stream_zone = zone;
+      stream_roster = roster;
+    }
+
+    // Measured on io_th when the response comes, one at a time.
+    auto beg = std::chrono::steady_clock::now();
+    if (beg - last_ping < std::chrono::seconds(1) || pinging)
+      return 0;
+    last_ping = beg;
+    pinging = true;
+    request(make_request("ping"), [this, beg](utils::RecvRet err, std::string)
+    {
+      if (err == utils::RecvRet::ok)
+      {
+        state.delay = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>
+          (std::chrono::steady_clock::now() - beg).count());
+      }
+      pinging = false;
+    });
+    return 0;
   }
 
   int TankClient::add_auto_tank(size_t lvl)
   {
     std::lock_guard l(online_mtx);
-    std::string content = make_request("add_auto_tank", g::state.id, draw::state.visible_zone, lvl);
-    if (cli->send(content) != 0)
+    std::string content = make_request("add_auto_tank", g::state().id, draw::state.visible_zone, lvl);
+    if (udp != nullptr)
+    {
+      udp_conn->send_reliable(std::move(content));
+      if (send_datagrams() == 0)
+        return 0;
+      cli_failed();
+      return -1;
+    }
+    if (post(std::move(content)) != 0)
     {
       cli_failed();
       return -1;
@@ -448,8 +1412,16 @@ namespace czh::online
   int TankClient::run_command(const std::string& str)
   {
     std::lock_guard l(online_mtx);
-    std::string content = make_request("run_command", g::state.id, str);
-    if (cli->send(content) != 0)
+    std::string content = make_request("run_command", g::state().id, str);
+    if (udp != nullptr)
+    {
+      udp_conn->send_reliable(std::move(content));
+      if (send_datagrams() == 0)
+        return 0;
+      cli_failed();
+      return -1;
+    }
+    if (post(std::move(content)) != 0)
     {
       cli_failed();
       return -1;
@@ -459,7 +1431,7 @@ namespace czh::online
 
   TankClient::~TankClient()
   {
-    delete cli;
+    stop_io();
   }
 
   int TankClient::get_port() const
@@ -471,4 +1443,19 @@ namespace czh::online
   {
     return host;
   }
+
+  std::string TankClient::get_room() const
+  {
+    return room;
+  }
+
+  void TankClient::set_udp(bool udp_)
+  {
+    use_udp = udp_;
+  }
+
+  bool TankClient::is_udp() const
+  {
+    return udp != nullptr;
+  }
 }
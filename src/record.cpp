@@ -0,0 +1,212 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#include "tank/record.h"
+#include "tank/archive.h"
+#include "tank/bullet.h"
+#include "tank/command.h"
+#include "tank/game.h"
+#include "tank/tank.h"
+#include "tank/world.h"
+#include "tank/utils/serialization.h"
+#include "tank/utils/utils.h"
+
+#include <atomic>
+#include <format>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <string>
+
+namespace czh::rec
+{
+  std::atomic<bool> recording{false};
+  std::mutex record_mtx;
+  Recording current;
+  // Only the world the recording was started in is recorded.
+  std::atomic<g::World*> recording_world{nullptr};
+
+  const std::set<std::string> recorded_cmds
+  {
+    "fill", "tp", "revive", "summon", "kill", "clear",
+    "set", "pause", "continue", "load"
+  };
+
+  bool is_recording()
+  {
+    return recording;
+  }
+
+  bool is_recorded_command(const std::string& name)
+  {
+    return recorded_cmds.contains(name);
+  }
+
+  void start()
+  {
+    std::lock_guard l(record_mtx);
+    current = Recording{};
+    current.rng_seed = utils::thread_rng()();
+    current.begin_tick = g::state().tick;
+    current.archive = ar::archive();
+    utils::seed_rand(current.rng_seed);
+    recording_world = &g::world();
+
+    // Events already drained but not applied yet.
+    for (auto& [id, pending] : g::state().pending_events)
+    {
+      for (auto& e : pending)
+      {
+        current.entries.emplace_back(Entry{
+          .type = EntryType::EVENT, .tick = current.begin_tick, .user = id, .event = e
+        });
+      }
+    }
+    recording = true;
+  }
+
+  Recording stop()
+  {
+    std::lock_guard l(record_mtx);
+    recording = false;
+    return std::move(current);
+  }
+
+  void record(Entry entry)
+  {
+    if (!recording || recording_world != &g::world())
+      return;
+    std::lock_guard l(record_mtx);
+    if (!recording)
+      return;
+    entry.tick = g::state().tick;
+    current.entries.emplace_back(std::move(entry));
+  }
+
+  void end_tick()
+  {
+    if (!recording || recording_world != &g::world())
+      return;
+    auto hash = world_hash();
+    std::lock_guard l(record_mtx);
+    if (recording)
+      current.hashes.emplace_back(hash);
+  }
+
+  // FNV-1a
+  class Hasher
+  {
+  private:
+    uint64_t value{14695981039346656037ull};
+
+  public:
+    template<typename T>
+      requires std::is_integral_v<T> || std::is_enum_v<T>
+    Hasher& add(T v)
+    {
+      auto u = static_cast<uint64_t>(v);
+      for (size_t i = 0; i < sizeof(T); ++i)
+      {
+        value ^= (u >> (i * 8)) & 0xff;
+        value *= 1099511628211ull;
+      }
+      return *this;
+    }
+
+    [[nodiscard]] uint64_t get() const { return value; }
+  };
+
+  uint64_t world_hash()
+  {
+    Hasher h;
+    h.add(g::state().next_id).add(g::state().running.load());
+    for (auto& [id, tank] : g::state().tanks)
+    {
+      h.add(id).add(tank->is_alive()).add(tank->hp).add(tank->max_hp)
+          .add(tank->pos.x).add(tank->pos.y).add(tank->direction);
+    }
+    for (auto& b : g::state().bullets)
+      h.add(b->get_tank()).add(b->is_alive()).add(b->pos.x).add(b->pos.y);
+    return h.get();
+  }
+
+  void apply(const Entry& entry)
+  {
+    if (entry.type == EntryType::COMMAND)
+    {
+      if (auto it = g::state().users.find(entry.user); it != g::state().users.end())
+        it->second.visible_zone = entry.zone;
+      cmd::run_command(entry.user, entry.command);
+      return;
+    }
+    else if (entry.type == EntryType::EVENT)
+    {
+      // Not g::tank_react(), which drops events while paused.
+      g::state().events.emplace(entry.user, entry.event);
+      return;
+    }
+
+    std::lock_guard ml(g::mainloop_mtx());
+    switch (entry.type)
+    {
+      case EntryType::ADD_USER:
+        g::add_user(entry.zone, "");
+        break;
+      case EntryType::REMOVE_USER:
+        g::remove_user(entry.user);
+        break;
+      case EntryType::LOGIN:
+        g::login(entry.user, entry.zone);
+        break;
+      case EntryType::LOGOUT:
+        g::logout(entry.user);
+        break;
+      case EntryType::ADD_AUTO_TANK:
+        g::add_auto_tank(entry.lvl, entry.zone, entry.user);
+        break;
+      case EntryType::VIEW:
+        g::set_visible_zone(entry.user, entry.zone);
+        break;
+      default:
+        dbg::tank_assert(false, "Unexpected entry type.");
+        break;
+    }
+  }
+
+  std::optional<std::string> save(const Recording& recording, const std::string& filename)
+  {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out.good())
+      return std::format("Failed to open '{}'.", filename);
+    auto data = utils::serialize(recording);
+    out.write(data.c_str(), static_cast<std::streamsize>(data.size()));
+    out.close();
+    return std::nullopt;
+  }
+
+  std::optional<std::string> load(const std::string& filename, Recording& recording)
+  {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.good())
+      return std::format("Failed to open '{}'.", filename);
+    std::string tmp;
+    in.seekg(0, std::ios::end);
+    auto length = in.tellg();
+    in.seekg(0, std::ios::beg);
+    tmp.resize(length);
+    in.read(tmp.data(), length);
+    in.close();
+    recording = utils::deserialize<Recording>(tmp);
+    return std::nullopt;
+  }
+}
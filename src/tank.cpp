@@ -12,6 +12,8 @@
 //   See the License for the specific language governing permissions and
 //   limitations under the License.
 #include "tank/tank.h"
+#include <algorithm>
+#include <cmath>
 #include <functional>
 #include <list>
 #include <map>
@@ -24,12 +26,15 @@
 
 namespace czh::tank
 {
-  void Tank::kill() { attacked(hp); }
+  void Tank::kill()
+  {
+    visit(this, [this](auto t) { t->attacked(hp); });
+  }
 
   int Tank::up()
   {
     direction = map::Direction::UP;
-    int ret = map::map.tank_up(pos);
+    int ret = map::map().tank_up(pos);
     if (ret == 0)
     {
       pos.y++;
@@ -40,7 +45,7 @@ namespace czh::tank
   int Tank::down()
   {
     direction = map::Direction::DOWN;
-    int ret = map::map.tank_down(pos);
+    int ret = map::map().tank_down(pos);
     if (ret == 0)
     {
       pos.y--;
@@ -51,7 +56,7 @@ namespace czh::tank
   int Tank::left()
   {
     direction = map::Direction::LEFT;
-    int ret = map::map.tank_left(pos);
+    int ret = map::map().tank_left(pos);
     if (ret == 0)
     {
       pos.x--;
@@ -62,7 +67,7 @@ namespace czh::tank
   int Tank::right()
   {
     direction = map::Direction::RIGHT;
-    int ret = map::map.tank_right(pos);
+    int ret = map::map().tank_right(pos);
     if (ret == 0)
     {
       pos.x++;
@@ -72,9 +77,9 @@ namespace czh::tank
 
   int Tank::fire() const
   {
-    g::state.bullets.emplace_back(
-        new bullet::Bullet(g::state.next_bullet_id++, id, pos, direction, bullet_hp, bullet_lethality, bullet_range));
-    int ret = map::map.add_bullet(g::state.bullets.back(), pos);
+    g::state().bullets.emplace_back(
+        new bullet::Bullet(g::state().next_bullet_id++, id, pos, direction, bullet_hp, bullet_lethality, bullet_range));
+    int ret = map::map().add_bullet(g::state().bullets.back(), pos);
     return ret;
   }
 
@@ -86,7 +91,7 @@ namespace czh::tank
 
   void Tank::clear()
   {
-    map::map.remove_status(map::Status::TANK, pos);
+    map::map().remove_status(map::Status::TANK, pos);
     hascleared = true;
   }
 
@@ -106,7 +111,7 @@ namespace czh::tank
       return;
     hascleared = false;
     pos = newpos;
-    map::map.add_tank(this, pos);
+    map::map().add_tank(this, pos);
   }
 
   AutoTankEvent get_pos_direction(const map::Pos &from, const map::Pos &to)
@@ -139,7 +144,7 @@ namespace czh::tank
     if (G > map::MAP_DIVISION * 20)
       return {};
 
-    static auto check = [](const map::Pos &p) { return !map::map.has(map::Status::WALL, p); };
+    static auto check = [](const map::Pos &p) { return !map::map().has(map::Status::WALL, p); };
     std::vector<Node> ret;
 
     map::Pos pos_up(pos.x, pos.y + 1);
@@ -172,7 +177,7 @@ namespace czh::tank
   {
     if (pos == target_pos)
       return false;
-    if (map::map.has(map::Status::WALL, pos) || (!curr_at_pos && map::map.has(map::Status::TANK, pos)))
+    if (map::map().has(map::Status::WALL, pos) || (!curr_at_pos && map::map().has(map::Status::TANK, pos)))
       return false;
     int x = target_pos.x - pos.x;
     int y = target_pos.y - pos.y;
@@ -183,7 +188,7 @@ namespace czh::tank
       for (int i = a + 1; i < b; ++i)
       {
         map::Pos tmp = {pos.x, i};
-        if (map::map.has(map::Status::WALL, tmp) || map::map.has(map::Status::TANK, tmp))
+        if (map::map().has(map::Status::WALL, tmp) || map::map().has(map::Status::TANK, tmp))
           return false;
       }
     }
@@ -194,7 +199,7 @@ namespace czh::tank
       for (int i = a + 1; i < b; ++i)
       {
         map::Pos tmp = {i, pos.y};
-        if (map::map.has(map::Status::WALL, tmp) || map::map.has(map::Status::TANK, tmp))
+        if (map::map().has(map::Status::WALL, tmp) || map::map().has(map::Status::TANK, tmp))
           return false;
       }
     }
@@ -435,7 +440,7 @@ namespace czh::tank
         for (int i = from.y; i <= to.y; ++i)
         {
           map::Pos p{from.x, i};
-          if (map::map.has(map::Status::WALL, p) || map::map.has(map::Status::TANK, p))
+          if (map::map().has(map::Status::WALL, p) || map::map().has(map::Status::TANK, p))
             return false;
         }
       }
@@ -446,7 +451,7 @@ namespace czh::tank
         for (int i = from.x; i <= to.x; ++i)
         {
           map::Pos p{i, from.y};
-          if (map::map.has(map::Status::WALL, p) || map::map.has(map::Status::TANK, p))
+          if (map::map().has(map::Status::WALL, p) || map::map().has(map::Status::TANK, p))
             return false;
         }
       }
@@ -477,7 +482,7 @@ namespace czh::tank
       }
       else
       {
-        e = avail[utils::randnum<size_t>(0, avail.size())];
+        e = avail[utils::randnum<size_t>(0, avail.size(), rng)];
         break;
       }
     }
@@ -493,6 +498,13 @@ namespace czh::tank
 
   void AutoTank::react()
   {
+    plan();
+    act();
+  }
+
+  void AutoTank::plan()
+  {
+    next_action = Action::NONE;
     if (++gap_count < gap)
       return;
     gap_count = 0;
@@ -512,9 +524,9 @@ namespace czh::tank
           if (i == pos.x && j == pos.y)
             continue;
 
-          if (map::map.at(i, j).has(map::Status::TANK))
+          if (map::map().at(i, j).has(map::Status::TANK))
           {
-            auto t = map::map.at(i, j).get_tank();
+            auto t = map::map().at(i, j).get_tank();
             dbg::tank_assert(t != nullptr);
             if (t->is_alive())
             {
@@ -561,36 +573,93 @@ namespace czh::tank
       {
         direction = map::Direction::DOWN;
       }
-      fire();
+      next_action = Action::FIRE;
     }
-    else
+    else if (route_pos < route.size())
+      next_action = Action::MOVE;
+  }
+
+  void AutoTank::act()
+  {
+    if (next_action == Action::FIRE)
+      fire();
+    else if (next_action == Action::MOVE)
     {
-      if (route_pos >= route.size())
-        return;
-      auto w = route[route_pos++];
-      int ret = -1;
-      switch (w)
-      {
-        case AutoTankEvent::UP:
-          ret = up();
-          break;
-        case AutoTankEvent::DOWN:
-          ret = down();
-          break;
-        case AutoTankEvent::LEFT:
-          ret = left();
-          break;
-        case AutoTankEvent::RIGHT:
-          ret = right();
-          break;
-        default:
-          break;
-      }
+      int ret = move(route[route_pos++]);
       if (ret != 0)
       {
         --route_pos;
         fire();
       }
     }
+    next_action = Action::NONE;
+  }
+
+  void AutoTank::react_cheap(int ticks)
+  {
+    gap_count += ticks;
+    if (gap_count < gap)
+      return;
+    gap_count = 0;
+    has_good_target = false;
+
+    if (route_pos >= route.size())
+      generate_random_route();
+    if (route_pos >= route.size())
+      return;
+    if (move(route[route_pos++]) != 0)
+    {
+      route.clear();
+      route_pos = 0;
+    }
+  }
+
+  void AutoTank::wake(size_t tick)
+  {
+    if (lod_tick != no_lod_tick && tick > lod_tick + 1)
+      fast_forward(tick - lod_tick - 1);
+    lod_tick = tick;
+  }
+
+  void AutoTank::fast_forward(size_t ticks)
+  {
+    // Unattended, a tank wanders around: after n random steps it is about sqrt(n) away.
+    static constexpr int max_distance = 32;
+    route.clear();
+    route_pos = 0;
+    gap_count = 0;
+    auto steps = ticks / static_cast<size_t>((std::max)(gap, 1));
+    int r = (std::min)(static_cast<int>(std::sqrt(static_cast<double>(steps))), max_distance);
+    if (r == 0)
+      return;
+    for (int i = 0; i < 8; ++i)
+    {
+      map::Pos p{pos.x + utils::randnum<int>(-r, r + 1, rng), pos.y + utils::randnum<int>(-r, r + 1, rng)};
+      if (!map::map().has(map::Status::WALL, p) && !map::map().has(map::Status::TANK, p))
+      {
+        map::map().remove_status(map::Status::TANK, pos);
+        map::map().add_tank(this, p);
+        pos = p;
+        break;
+      }
+    }
+  }
+
+  int AutoTank::move(AutoTankEvent e)
+  {
+    switch (e)
+    {
+      case AutoTankEvent::UP:
+        return up();
+      case AutoTankEvent::DOWN:
+        return down();
+      case AutoTankEvent::LEFT:
+        return left();
+      case AutoTankEvent::RIGHT:
+        return right();
+      default:
+        break;
+    }
+    return -1;
   }
 } // namespace czh::tank
@@ -20,18 +20,20 @@ namespace czh::term
 {
   KeyBoard keyboard;
 
+  // The terminal is set up by init() in main() rather than here, so that
+  // the headless mode never touches the tty.
   KeyBoard::KeyBoard() :
-      keyboard_mode(0), initial_settings(), new_settings()
+      keyboard_mode(0), inited(false), initial_settings(), new_settings()
 #ifdef CZH_TANK_KEYBOARD_MODE_1
       ,
       peek_character(0)
 #endif
   {
-    init();
   }
 
   void KeyBoard::init()
   {
+    inited = true;
 #if defined(CZH_TANK_KEYBOARD_MODE_0)
     keyboard_mode = 0;
     HANDLE handle = GetStdHandle(STD_INPUT_HANDLE);
@@ -56,7 +58,11 @@ namespace czh::term
     flush();
   }
 
-  KeyBoard::~KeyBoard() { deinit(); }
+  KeyBoard::~KeyBoard()
+  {
+    if (inited)
+      deinit();
+  }
 
   void KeyBoard::deinit() const
   {
@@ -0,0 +1,264 @@
+//   Copyright 2022-2024 tank - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#include "tank/world.h"
+#include "tank/broadcast.h"
+#include "tank/bullet.h"
+#include "tank/online.h"
+#include "tank/tank.h"
+#include "tank/utils/thpool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ranges>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace czh::g
+{
+  World::World(std::string name_)
+    : name(std::move(name_)),
+      state{
+        .running = true,
+        .suspend = false,
+        .mode = Mode::NATIVE,
+        .page = Page::MAIN,
+        .users = {{0, g::UserData{.user_id = 0, .active = true}}},
+        .id = 0,
+        .next_id = 0,
+        .next_bullet_id = 0,
+        .tick = 0
+      },
+      config(cfg::default_config),
+      random(utils::WorldRandom::from_device())
+  {
+    if (!name.empty())
+    {
+      // A room has no local user, its messages go to all its players.
+      state.mode = Mode::SERVER;
+      state.page = Page::GAME;
+      state.users.clear();
+      state.id = bc::to_everyone;
+    }
+  }
+
+  thread_local World* current_world = nullptr;
+
+  // Each room is ticked by a pool task, which the ticker thread adds when the room's deadline comes.
+  std::mutex rooms_mtx;
+  std::condition_variable rooms_cond; // The rooms changed, or a room finished a tick
+  std::map<std::string, std::shared_ptr<World> > rooms;
+  std::thread ticker;
+  bool ticker_stopping{false};
+  size_t ticking_rooms{0};
+
+  World::~World()
+  {
+    for (auto& b : state.bullets)
+      delete b;
+    for (auto& t : state.tanks | std::views::values)
+      delete t;
+  }
+
+  World& default_world()
+  {
+    // Never destroyed, other threads may still be running at exit.
+    static World* w = new World{""};
+    return *w;
+  }
+
+  World& world()
+  {
+    if (current_world != nullptr)
+      return *current_world;
+    return default_world();
+  }
+
+  bool is_default_world()
+  {
+    return &world() == &default_world();
+  }
+
+  WorldScope::WorldScope(World& w) : prev(current_world)
+  {
+    current_world = &w;
+  }
+
+  WorldScope::~WorldScope()
+  {
+    current_world = prev;
+  }
+
+  GameState& state()
+  {
+    return world().state;
+  }
+
+  std::mutex& mainloop_mtx()
+  {
+    return world().mainloop_mtx;
+  }
+
+  std::mutex& command_mtx()
+  {
+    return world().command_mtx;
+  }
+
+  utils::TickScheduler& scheduler()
+  {
+    return world().scheduler;
+  }
+
+  utils::Thpool& room_pool()
+  {
+    // Never destroyed, like the default world.
+    static auto pool = new utils::Thpool;
+    return *pool;
+  }
+
+  void tick_room(const std::shared_ptr<World>& room)
+  {
+    //
+    {
+      WorldScope scope(*room);
+      size_t steps = scheduler().take_due(cfg::config().max_catch_up);
+      for (size_t i = 0; i < steps; ++i)
+        mainloop();
+      online::svr.publish_frames();
+      scheduler().finish(steps);
+    }
+    std::lock_guard l(rooms_mtx);
+    room->ticking = false;
+    --ticking_rooms;
+    rooms_cond.notify_all();
+  }
+
+  void run_ticker()
+  {
+    std::unique_lock l(rooms_mtx);
+    while (!ticker_stopping)
+    {
+      auto now = utils::TickScheduler::Clock::now();
+      auto wake = now + std::chrono::seconds(1);
+      for (auto& room : rooms | std::views::values)
+      {
+        if (room->ticking)
+          continue;
+        auto deadline = room->scheduler.next_deadline(room->config.tick);
+        if (deadline <= now)
+        {
+          room->ticking = true;
+          ++ticking_rooms;
+          room_pool().add_task([room] { tick_room(room); });
+        }
+        else
+          wake = (std::min)(wake, deadline);
+      }
+      rooms_cond.wait_until(l, wake);
+    }
+  }
+
+  std::shared_ptr<World> join_room(const std::string& name)
+  {
+    if (name.empty())
+      return {std::shared_ptr<World>{}, &default_world()};
+
+    std::lock_guard l(rooms_mtx);
+    auto it = rooms.find(name);
+    if (it == rooms.end())
+    {
+      if (rooms.size() >= max_rooms || name.size() > max_room_name)
+        return nullptr;
+      it = rooms.emplace(name, std::make_shared<World>(name)).first;
+      if (!ticker.joinable())
+        ticker = std::thread(run_ticker);
+      rooms_cond.notify_all();
+    }
+    ++it->second->members;
+    return it->second;
+  }
+
+  void leave_room(World& room)
+  {
+    if (&room == &default_world())
+      return;
+    std::lock_guard l(rooms_mtx);
+    if (--room.members != 0)
+      return;
+    // It is not there anymore after close_rooms().
+    if (auto it = rooms.find(room.name); it != rooms.end() && it->second.get() == &room)
+      rooms.erase(it);
+  }
+
+  std::vector<std::string> get_room_names()
+  {
+    std::lock_guard l(rooms_mtx);
+    auto keys = rooms | std::views::keys;
+    return {keys.begin(), keys.end()};
+  }
+
+  void close_rooms()
+  {
+    std::thread stopping;
+    //
+    {
+      std::lock_guard l(rooms_mtx);
+      ticker_stopping = true;
+      stopping.swap(ticker);
+    }
+    rooms_cond.notify_all();
+    if (stopping.joinable())
+      stopping.join();
+    std::unique_lock l(rooms_mtx);
+    rooms_cond.wait(l, [] { return ticking_rooms == 0; });
+    rooms.clear();
+    ticker_stopping = false;
+  }
+}
+
+namespace czh::map
+{
+  Map& map()
+  {
+    return g::world().map;
+  }
+}
+
+namespace czh::cfg
+{
+  Config& config()
+  {
+    return g::world().config;
+  }
+}
+
+namespace czh::bc
+{
+  std::mutex& send_msg_mtx()
+  {
+    return g::world().send_msg_mtx;
+  }
+}
+
+namespace czh::utils
+{
+  WorldRandom& world_random()
+  {
+    return g::world().random;
+  }
+}